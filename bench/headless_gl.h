@@ -0,0 +1,54 @@
+#ifndef HEADLESS_GL_H
+#define HEADLESS_GL_H
+
+#include <glad/glad.h>
+
+// stand-ins for the OpenGL calls a cloth makes on its render mesh, so the simulation runs without a
+// window or driver. buffers get made up names and uploads return at once, which leaves only the CPU
+// side of Mesh::updateVertices() and friends to measure
+namespace headless {
+	inline GLuint nextName = 1;
+
+	inline void APIENTRY genNames(GLsizei n, GLuint* names)
+	{
+		for (GLsizei i = 0; i < n; i++)
+			names[i] = nextName++;
+	}
+	inline void APIENTRY deleteNames(GLsizei, const GLuint*) {}
+	inline void APIENTRY bind(GLenum, GLuint) {}
+	inline void APIENTRY bindVertexArray(GLuint) {}
+	inline void APIENTRY bufferData(GLenum, GLsizeiptr, const void*, GLenum) {}
+	inline void APIENTRY bufferSubData(GLenum, GLintptr, GLsizeiptr, const void*) {}
+	inline void APIENTRY vertexAttribPointer(GLuint, GLint, GLenum, GLboolean, GLsizei, const void*) {}
+	inline void APIENTRY attribArray(GLuint) {}
+	inline void APIENTRY vertexAttribDivisor(GLuint, GLuint) {}
+	inline void APIENTRY activeTexture(GLenum) {}
+	inline void APIENTRY drawElements(GLenum, GLsizei, GLenum, const void*) {}
+	inline void APIENTRY drawElementsInstanced(GLenum, GLsizei, GLenum, const void*, GLsizei) {}
+	inline GLint APIENTRY getUniformLocation(GLuint, const GLchar*) { return -1; }
+	inline void APIENTRY uniform1i(GLint, GLint) {}
+}
+
+// point the loader at the stand-ins instead of gladLoadGLLoader()
+inline void loadHeadlessGL()
+{
+	glad_glGenBuffers = headless::genNames;
+	glad_glGenVertexArrays = headless::genNames;
+	glad_glDeleteBuffers = headless::deleteNames;
+	glad_glDeleteVertexArrays = headless::deleteNames;
+	glad_glBindBuffer = headless::bind;
+	glad_glBindTexture = headless::bind;
+	glad_glBindVertexArray = headless::bindVertexArray;
+	glad_glBufferData = headless::bufferData;
+	glad_glBufferSubData = headless::bufferSubData;
+	glad_glVertexAttribPointer = headless::vertexAttribPointer;
+	glad_glEnableVertexAttribArray = headless::attribArray;
+	glad_glDisableVertexAttribArray = headless::attribArray;
+	glad_glVertexAttribDivisor = headless::vertexAttribDivisor;
+	glad_glActiveTexture = headless::activeTexture;
+	glad_glDrawElements = headless::drawElements;
+	glad_glDrawElementsInstanced = headless::drawElementsInstanced;
+	glad_glGetUniformLocation = headless::getUniformLocation;
+	glad_glUniform1i = headless::uniform1i;
+}
+#endif
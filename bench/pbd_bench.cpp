@@ -0,0 +1,550 @@
+// pbd_bench: times the phases of the cloth simulation on grid cloths from 20x20 to 2048x2048 particles
+// without a window, and writes the results as CSV and JSON so runs of different commits can be compared.
+//
+// usage: pbd_bench [--sizes 20,64,256] [--threads n] [--solver edges|tiled|stencil] [--time seconds]
+//                  [--csv file] [--json file] [--label text] [--counters] [--allocations]
+//        pbd_bench --replay file [--mesh file] [--tolerance meters] [--threads n] [--time seconds] [--csv file] ...
+//
+// --replay steps the viewer's scene through input recorded with I in the viewer, at its fixed time step, and times
+// the steps instead of the grid cloths. --mesh gives the file the viewer was started with, --tolerance fails the
+// run if a particle ends further than that from where it was at the end of the recording.
+// --counters prints IPC and cache misses per particle of every phase, on Linux with PBD_PROFILE only.
+// --allocations fails the run if steps of a settled world or copies of its frames allocate, with PBD_MEMORY only
+
+#include "headless_gl.h"
+
+#include "cloth.h"
+#include "sphere.h"
+#include "scheduler.h"
+#include "world.h"
+#include "scene.h"
+#include "input_log.h"
+#include "memory_tracker.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#define BENCH_MIN_SAMPLES 5
+#define BENCH_MAX_SAMPLES 1000
+#define BENCH_WARMUP 0.2 // part of the time of a benchmark spent on steps that aren't measured
+#define BENCH_SETTLE_STEPS 200 // steps before the allocation check, buffers reach their final size in these
+#define BENCH_CHECK_STEPS 100 // steps that must not allocate
+
+typedef chrono::steady_clock Clock;
+
+struct Options
+{
+	vector<unsigned int> sizes = { 20, 32, 64, 128, 256, 512, 1024, 2048 };
+	unsigned int threads = 0; // workers besides the main thread
+	Solver solver = SOLVER_EDGES;
+	double time = 1.0; // seconds per benchmark and size, at least BENCH_MIN_SAMPLES are taken anyway
+	string csv = "pbd_bench.csv";
+	string json = "pbd_bench.json";
+	string label; // commit or anything else that tells runs apart
+	bool counters = false;
+	bool allocations = false;
+	string replay; // input log to replay instead of the grid benchmarks
+	string mesh;
+	double tolerance = -1.0; // none if negative
+};
+
+// samples of one benchmark at one size, in seconds
+struct Result
+{
+	string name;
+	unsigned int size;
+	unsigned int particles;
+	unsigned int iterations; // solver iterations per sample, 1 for everything but the constraints
+	vector<double> samples;
+
+	double mean() const
+	{
+		double sum = 0.0;
+		for (unsigned int i = 0; i < samples.size(); i++)
+			sum += samples[i];
+		return sum / samples.size();
+	}
+
+	// sample standard deviation
+	double stddev() const
+	{
+		if (samples.size() < 2)
+			return 0.0;
+		double m = mean(), sum = 0.0;
+		for (unsigned int i = 0; i < samples.size(); i++)
+			sum += (samples[i] - m) * (samples[i] - m);
+		return sqrt(sum / (samples.size() - 1));
+	}
+
+	double min() const
+	{
+		return *min_element(samples.begin(), samples.end());
+	}
+
+	double median() const
+	{
+		vector<double> sorted = samples;
+		sort(sorted.begin(), sorted.end());
+		unsigned int n = sorted.size();
+		return n % 2 ? sorted[n / 2] : 0.5 * (sorted[n / 2 - 1] + sorted[n / 2]);
+	}
+
+	double nsPerParticleIteration() const
+	{
+		return mean() * 1e9 / ((double)particles * iterations);
+	}
+
+	// millions of particles processed per second, every solver iteration counts
+	double throughput() const
+	{
+		return (double)particles * iterations / mean() * 1e-6;
+	}
+};
+
+static double seconds(Clock::time_point since)
+{
+	return chrono::duration<double>(Clock::now() - since).count();
+}
+
+// phases of a step by the names their parallelFor() calls pass to the scheduler
+enum Phase { PHASE_INTEGRATE, PHASE_CONSTRAINT, PHASE_COLLISION, PHASE_OTHER, PHASE_COUNT };
+
+static Phase phaseOf(const char* name)
+{
+	if (strcmp(name, "integrate") == 0)
+		return PHASE_INTEGRATE;
+	if (strcmp(name, "collision") == 0)
+		return PHASE_COLLISION;
+	if (strncmp(name, "edge ", 5) == 0 || strncmp(name, "stencil ", 8) == 0 || strcmp(name, "tiles") == 0)
+		return PHASE_CONSTRAINT;
+	return PHASE_OTHER;
+}
+
+// wall time of every phase in a step from the tasks the scheduler reports. phases follow each other,
+// so consecutive tasks of one name form one run of a phase from its first start to its last stop
+class PhaseTimer {
+public:
+	PhaseTimer(Scheduler& scheduler) : scheduler(scheduler), tasks(scheduler.threadCount())
+	{
+		scheduler.setTaskHook([this](const TaskTiming& task) {
+			tasks[task.worker].push_back(task);
+		});
+	}
+
+	~PhaseTimer()
+	{
+		scheduler.setTaskHook(nullptr);
+	}
+
+	void clear()
+	{
+		for (unsigned int i = 0; i < tasks.size(); i++)
+			tasks[i].clear();
+	}
+
+	// seconds per phase since clear()
+	void collect(double phases[PHASE_COUNT])
+	{
+		all.clear();
+		for (unsigned int i = 0; i < tasks.size(); i++)
+			all.insert(all.end(), tasks[i].begin(), tasks[i].end());
+		sort(all.begin(), all.end(), [](const TaskTiming& a, const TaskTiming& b) {
+			return a.start < b.start;
+		});
+		fill(phases, phases + PHASE_COUNT, 0.0);
+		for (unsigned int i = 0; i < all.size();)
+		{
+			Clock::time_point start = all[i].start, stop = all[i].stop;
+			unsigned int j = i + 1;
+			for (; j < all.size() && strcmp(all[j].name, all[i].name) == 0; j++)
+				stop = max(stop, all[j].stop);
+			phases[phaseOf(all[i].name)] += chrono::duration<double>(stop - start).count();
+			i = j;
+		}
+	}
+
+private:
+	Scheduler& scheduler;
+	vector<vector<TaskTiming>> tasks; // per worker, so the hook needs no lock
+	vector<TaskTiming> all;
+};
+
+// the phases of a step, the step as a whole, and packing and copying the positions for rendering
+static void benchStep(const Options& options, Scheduler& scheduler, unsigned int size, vector<Result>& results)
+{
+	unsigned int particles = size * size;
+	Cloth cloth(size, size);
+	cloth.setScheduler(&scheduler);
+	cloth.setSolver(options.solver);
+	Sphere sphere(0.2f, glm::vec3(0.0f, -0.3f, 0.0f)); // the cloth falls onto it after a few steps
+
+	Clock::time_point start = Clock::now();
+	do
+		cloth.update(1.0f / 60.0f, &sphere);
+	while (seconds(start) < options.time * BENCH_WARMUP);
+
+	const char* names[PHASE_COUNT] = { "integrate", "pbdConstraint", "handleCollision", NULL };
+	Result phases[PHASE_COUNT], step = { "step", size, particles, 1, {} };
+	for (unsigned int p = 0; p < PHASE_COUNT; p++)
+		phases[p] = { names[p] ? names[p] : "", size, particles, p == PHASE_CONSTRAINT ? (unsigned int)iteration : 1u, {} };
+
+	PhaseTimer timer(scheduler);
+#ifdef PBD_PROFILE
+	if (options.counters)
+		Profiler::instance().setCounting(true);
+#endif
+	start = Clock::now();
+	while (step.samples.size() < BENCH_MAX_SAMPLES && (step.samples.size() < BENCH_MIN_SAMPLES || seconds(start) < options.time))
+	{
+		timer.clear();
+		Clock::time_point begin = Clock::now();
+		cloth.update(1.0f / 60.0f, &sphere);
+		step.samples.push_back(seconds(begin));
+		double spent[PHASE_COUNT];
+		timer.collect(spent);
+		for (unsigned int p = 0; p < PHASE_COUNT; p++)
+			phases[p].samples.push_back(spent[p]);
+	}
+	for (unsigned int p = 0; p < PHASE_COUNT; p++)
+		if (names[p])
+			results.push_back(phases[p]);
+	results.push_back(step);
+#ifdef PBD_PROFILE
+	if (options.counters && Profiler::instance().isCounting())
+	{
+		Profiler::instance().reportCounters(std::cout);
+		Profiler::instance().setCounting(false);
+	}
+#endif
+
+	// what the simulation thread does for the renderer every frame, the upload itself is left out
+	Result pack = { "packVertices", size, particles, 1, {} };
+	Result upload = { "Mesh::updateVertices", size, particles, 1, {} };
+	cloth.computeNormals();
+	vector<PackedVertex> packed;
+	glm::vec3 boundsMin, boundsExtent;
+	vector<Vertex> frame(cloth.getVertices().begin(), cloth.getVertices().end());
+	start = Clock::now();
+	while (pack.samples.size() < BENCH_MAX_SAMPLES && (pack.samples.size() < BENCH_MIN_SAMPLES || seconds(start) < options.time))
+	{
+		Clock::time_point begin = Clock::now();
+		cloth.packVertices(packed, boundsMin, boundsExtent, true);
+		pack.samples.push_back(seconds(begin));
+		begin = Clock::now();
+		cloth.updateMesh(frame);
+		upload.samples.push_back(seconds(begin));
+	}
+	results.push_back(pack);
+	results.push_back(upload);
+}
+
+// building the cloth from scratch, and the edge deduplication on its own
+static void benchBuild(const Options& options, unsigned int size, vector<Result>& results)
+{
+	unsigned int particles = size * size;
+	Result build = { "topology build", size, particles, 1, {} };
+	Result dedup = { "edgeDuplicateRemoval", size, particles, 1, {} };
+	Clock::time_point start = Clock::now();
+	while (build.samples.size() < BENCH_MAX_SAMPLES && (build.samples.size() < BENCH_MIN_SAMPLES || seconds(start) < options.time))
+	{
+		unique_ptr<Cloth> cloth(new Cloth(size, size));
+		build.samples.push_back(cloth->getBuildTiming().total);
+		dedup.samples.push_back(cloth->getBuildTiming().edges);
+	}
+	results.push_back(build);
+	results.push_back(dedup);
+}
+
+// the recorded session as often as fits in the time, at least once, every step a sample. false if the
+// log can't be read, doesn't fit the scene or a replay ends further from the recording than the tolerance
+static bool benchReplay(const Options& options, Scheduler& scheduler, vector<Result>& results)
+{
+	InputLog log;
+	if (!log.load(options.replay.c_str()))
+		return false;
+	World world(&scheduler);
+	buildScene(world, options.mesh.empty() ? NULL : options.mesh.c_str(), &scheduler);
+	unsigned int particles = 0;
+	for (unsigned int i = 0; i < world.clothCount(); i++)
+		particles += world.getCloth(i)->particleCount();
+
+	Result step = { "replay step", 0, particles, 1, {} };
+	float deviation = 0.0f;
+	Clock::time_point start = Clock::now();
+	do
+	{
+		Clock::time_point last = Clock::now();
+		bool matches = log.replay(world, [&](unsigned int) {
+			Clock::time_point now = Clock::now();
+			step.samples.push_back(chrono::duration<double>(now - last).count());
+			last = now;
+		});
+		if (!matches)
+		{
+			std::cout << "ERROR::BENCH::REPLAY_DOES_NOT_MATCH_SCENE: " << options.replay << std::endl;
+			return false;
+		}
+		deviation = max(deviation, log.deviation(world));
+	}
+	while (seconds(start) < options.time);
+	if (step.samples.empty())
+		return false;
+	results.push_back(step);
+
+	printf("replayed %u steps with %u input events, largest deviation from the recording %g m\n", log.stepCount(),
+		(unsigned int)log.getEvents().size(), deviation);
+	return options.tolerance < 0.0 || deviation <= options.tolerance;
+}
+
+#ifdef PBD_MEMORY
+// steps of a world with a sleeping cloth on a collider and the frame copies the simulation thread makes for the
+// renderer, none of them may allocate once the world settled. false with the allocations per subsystem otherwise
+static bool checkAllocations(const Options& options, Scheduler& scheduler, unsigned int size)
+{
+	World world(&scheduler);
+	Cloth* cloth = world.addCloth(new Cloth(size, size));
+	cloth->setSolver(options.solver);
+	cloth->setSleeping(true);
+	world.addCollider(Sphere(0.2f, glm::vec3(0.0f, -0.3f, 0.0f)));
+	vector<PackedVertex> packed;
+	vector<Vertex> frame;
+	glm::vec3 boundsMin, boundsExtent;
+	auto step = [&]() {
+		world.step(1.0f / 60.0f);
+		cloth->computeNormals();
+		cloth->packVertices(packed, boundsMin, boundsExtent, true);
+		frame.assign(cloth->getVertices().begin(), cloth->getVertices().end());
+		cloth->updateMesh(frame);
+		MEMORY_FRAME();
+	};
+	for (unsigned int i = 0; i < BENCH_SETTLE_STEPS; i++)
+		step();
+
+	MemoryTracker::Totals before = MemoryTracker::totals();
+	for (unsigned int i = 0; i < BENCH_CHECK_STEPS; i++)
+		step();
+	MemoryTracker::Totals after = MemoryTracker::totals();
+	bool steady = after.allAllocations() == before.allAllocations();
+	if (steady)
+		printf("allocations %6u: none in %u steps\n", size, BENCH_CHECK_STEPS);
+	else
+		printf("allocations %6u: steady state allocates\n", size);
+	for (unsigned int s = 0; s < MEMORY_SUBSYSTEMS; s++)
+		if (after.allocations[s] > before.allocations[s])
+			printf("  %-16s %8.1f allocations %12.0f bytes per step\n", MemoryTracker::name(s),
+				(double)(after.allocations[s] - before.allocations[s]) / BENCH_CHECK_STEPS,
+				(double)(after.bytes[s] - before.bytes[s]) / BENCH_CHECK_STEPS);
+	fflush(stdout);
+	MemoryTracker::report(std::cout);
+	return steady;
+}
+#endif
+
+static const char* solverName(Solver solver)
+{
+	return solver == SOLVER_TILED ? "tiled" : solver == SOLVER_STENCIL ? "stencil" : "edges";
+}
+
+static bool optimized()
+{
+#if defined(__OPTIMIZE__) || defined(NDEBUG)
+	return true;
+#else
+	return false;
+#endif
+}
+
+static bool writeCsv(const Options& options, const vector<Result>& results)
+{
+	FILE* file = fopen(options.csv.c_str(), "w");
+	if (!file)
+	{
+		std::cout << "ERROR::BENCH::FILE_NOT_CREATED: " << options.csv << std::endl;
+		return false;
+	}
+	fprintf(file, "label,solver,threads,benchmark,size,particles,iterations,samples,mean_ms,stddev_ms,min_ms,median_ms,ns_per_particle_iteration,mparticle_iterations_per_s\n");
+	for (unsigned int i = 0; i < results.size(); i++)
+	{
+		const Result& r = results[i];
+		fprintf(file, "%s,%s,%u,%s,%u,%u,%u,%u,%.6f,%.6f,%.6f,%.6f,%.4f,%.3f\n", options.label.c_str(), solverName(options.solver),
+			options.threads + 1, r.name.c_str(), r.size, r.particles, r.iterations, (unsigned int)r.samples.size(),
+			r.mean() * 1e3, r.stddev() * 1e3, r.min() * 1e3, r.median() * 1e3, r.nsPerParticleIteration(), r.throughput());
+	}
+	return fclose(file) == 0;
+}
+
+static bool writeJson(const Options& options, const vector<Result>& results)
+{
+	FILE* file = fopen(options.json.c_str(), "w");
+	if (!file)
+	{
+		std::cout << "ERROR::BENCH::FILE_NOT_CREATED: " << options.json << std::endl;
+		return false;
+	}
+	// labels are commit hashes or names, quotes and backslashes are the only characters to escape
+	string label;
+	for (unsigned int i = 0; i < options.label.size(); i++)
+	{
+		if (options.label[i] == '"' || options.label[i] == '\\')
+			label += '\\';
+		label += options.label[i];
+	}
+	fprintf(file, "{\n  \"label\": \"%s\",\n  \"solver\": \"%s\",\n  \"threads\": %u,\n  \"optimized\": %s,\n  \"results\": [\n",
+		label.c_str(), solverName(options.solver), options.threads + 1, optimized() ? "true" : "false");
+	for (unsigned int i = 0; i < results.size(); i++)
+	{
+		const Result& r = results[i];
+		fprintf(file, "    {\"benchmark\": \"%s\", \"size\": %u, \"particles\": %u, \"iterations\": %u, \"samples\": %u, "
+			"\"mean_ms\": %.6f, \"stddev_ms\": %.6f, \"min_ms\": %.6f, \"median_ms\": %.6f, "
+			"\"ns_per_particle_iteration\": %.4f, \"mparticle_iterations_per_s\": %.3f}%s\n",
+			r.name.c_str(), r.size, r.particles, r.iterations, (unsigned int)r.samples.size(),
+			r.mean() * 1e3, r.stddev() * 1e3, r.min() * 1e3, r.median() * 1e3, r.nsPerParticleIteration(), r.throughput(),
+			i + 1 < results.size() ? "," : "");
+	}
+	fprintf(file, "  ]\n}\n");
+	return fclose(file) == 0;
+}
+
+static bool parseOptions(int argc, char** argv, Options& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		if (arg == "--counters")
+		{
+#ifndef PBD_PROFILE
+			std::cout << "ERROR::BENCH::COUNTERS_NEED_PBD_PROFILE" << std::endl;
+			return false;
+#endif
+			options.counters = true;
+			continue;
+		}
+		if (arg == "--allocations")
+		{
+#ifndef PBD_MEMORY
+			std::cout << "ERROR::BENCH::ALLOCATIONS_NEED_PBD_MEMORY" << std::endl;
+			return false;
+#endif
+			options.allocations = true;
+			continue;
+		}
+		if (i + 1 >= argc)
+		{
+			std::cout << "ERROR::BENCH::MISSING_VALUE: " << arg << std::endl;
+			return false;
+		}
+		const char* value = argv[++i];
+		if (arg == "--sizes")
+		{
+			options.sizes.clear();
+			for (const char* at = value; *at;)
+			{
+				char* end;
+				unsigned long size = strtoul(at, &end, 10);
+				if (end == at || size < 2)
+				{
+					std::cout << "ERROR::BENCH::INVALID_SIZES: " << value << std::endl;
+					return false;
+				}
+				options.sizes.push_back((unsigned int)size);
+				at = *end == ',' ? end + 1 : end;
+			}
+		}
+		else if (arg == "--threads")
+			options.threads = (unsigned int)strtoul(value, NULL, 10);
+		else if (arg == "--solver")
+		{
+			string solver = value;
+			if (solver != "edges" && solver != "tiled" && solver != "stencil")
+			{
+				std::cout << "ERROR::BENCH::UNKNOWN_SOLVER: " << solver << std::endl;
+				return false;
+			}
+			options.solver = solver == "tiled" ? SOLVER_TILED : solver == "stencil" ? SOLVER_STENCIL : SOLVER_EDGES;
+		}
+		else if (arg == "--time")
+			options.time = atof(value);
+		else if (arg == "--csv")
+			options.csv = value;
+		else if (arg == "--json")
+			options.json = value;
+		else if (arg == "--label")
+			options.label = value;
+		else if (arg == "--replay")
+			options.replay = value;
+		else if (arg == "--mesh")
+			options.mesh = value;
+		else if (arg == "--tolerance")
+			options.tolerance = atof(value);
+		else
+		{
+			std::cout << "ERROR::BENCH::UNKNOWN_OPTION: " << arg << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	if (!parseOptions(argc, argv, options))
+		return 1;
+	loadHeadlessGL();
+	if (!optimized())
+		std::cout << "note: built without optimizations, configure with -DCMAKE_BUILD_TYPE=Release for numbers worth comparing" << std::endl;
+
+	Scheduler scheduler(options.threads);
+	vector<Result> results;
+	printf("%-22s %6s %9s %8s %11s %9s %11s %11s %9s\n", "benchmark", "size", "particles", "samples", "mean ms", "stddev %",
+		"min ms", "ns/p/iter", "Mp*it/s");
+	auto print = [&results](unsigned int first) {
+		for (unsigned int i = first; i < results.size(); i++)
+		{
+			const Result& r = results[i];
+			printf("%-22s %6u %9u %8u %11.4f %9.2f %11.4f %11.3f %9.1f\n", r.name.c_str(), r.size, r.particles,
+				(unsigned int)r.samples.size(), r.mean() * 1e3, 100.0 * r.stddev() / r.mean(), r.min() * 1e3,
+				r.nsPerParticleIteration(), r.throughput());
+		}
+		fflush(stdout);
+	};
+
+	bool passed = true;
+	if (!options.replay.empty())
+	{
+		passed = benchReplay(options, scheduler, results);
+		print(0);
+	}
+	else
+	{
+		for (unsigned int s = 0; s < options.sizes.size(); s++)
+		{
+			unsigned int first = results.size();
+			benchBuild(options, options.sizes[s], results);
+			benchStep(options, scheduler, options.sizes[s], results);
+			print(first);
+		}
+	}
+
+	bool written = writeCsv(options, results);
+	written = writeJson(options, results) && written;
+
+#ifdef PBD_MEMORY
+	if (options.allocations && options.replay.empty())
+	{
+		for (unsigned int s = 0; s < options.sizes.size(); s++)
+			passed = checkAllocations(options, scheduler, options.sizes[s]) && passed;
+	}
+#endif
+	return written && passed ? 0 : 1;
+}
@@ -0,0 +1,268 @@
+// pbd_convergence: steps a set of scenes with every solver at several iteration counts without a window, and
+// writes the constraint error after every iteration together with the wall time spent in the step so far as CSV,
+// so the cheapest solver and iteration count that keeps the cloth stiff enough can be read off the curves.
+//
+// usage: pbd_convergence [--size n] [--steps n] [--iterations 8,16,32,64] [--solvers edges,tiled,stencil]
+//                        [--scenes hanging,sphere,drag] [--threads n] [--target error] [--csv file] [--label text]
+//
+// the error is the stretch of the edges relative to their rest length, root mean square and largest over the cloth.
+// the tiled solver iterates TILE_DEPTH times per pass over the cloth, so its curves have a point every TILE_DEPTH
+// iterations. measuring the error isn't counted in the times. --target prints per scene the fastest configuration
+// whose root mean square error at the end of a step stays below it on average
+
+#include "headless_gl.h"
+
+#include "cloth.h"
+#include "sphere.h"
+#include "scheduler.h"
+#include "broadphase.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+#define CONVERGENCE_DRAG_RADIUS 0.2f // of the circle the grabbed particle is moved on
+#define CONVERGENCE_DRAG_PERIOD 60   // steps per circle
+
+typedef chrono::steady_clock Clock;
+
+enum Scene { SCENE_HANGING, SCENE_SPHERE, SCENE_DRAG, SCENE_COUNT };
+
+static const char* sceneNames[SCENE_COUNT] = { "hanging", "sphere", "drag" };
+
+struct Options
+{
+	unsigned int size = 20; // the grid of the viewer
+	unsigned int steps = 120;
+	vector<unsigned int> iterations = { 4, 8, 16, 32, 64 };
+	vector<Solver> solvers = { SOLVER_EDGES, SOLVER_TILED, SOLVER_STENCIL };
+	vector<Scene> scenes = { SCENE_HANGING, SCENE_SPHERE, SCENE_DRAG };
+	unsigned int threads = 0; // workers besides the main thread
+	double target = -1.0;     // none if negative
+	string csv = "pbd_convergence.csv";
+	string label;
+};
+
+// one scene run with one solver configuration
+struct Run
+{
+	Scene scene;
+	Solver solver;
+	unsigned int iterations;
+	double stepTime = 0.0;  // seconds per step without measuring
+	double finalRms = 0.0;  // mean over the steps of the error after the last iteration
+	float finalMax = 0.0f;  // largest over the steps
+};
+
+static const char* solverName(Solver solver)
+{
+	return solver == SOLVER_TILED ? "tiled" : solver == SOLVER_STENCIL ? "stencil" : "edges";
+}
+
+static double seconds(Clock::duration duration)
+{
+	return chrono::duration<double>(duration).count();
+}
+
+// step a fresh cloth through the scene, a CSV row per step and measured iteration
+static Run runScene(const Options& options, Scheduler& scheduler, Scene scene, Solver solver, unsigned int iterations, FILE* csv)
+{
+	Cloth cloth(options.size, options.size);
+	cloth.setScheduler(&scheduler);
+	cloth.setSolver(solver);
+	cloth.setIterations(iterations);
+
+	// the hanging cloth swings down from its two pinned corners, on the sphere it falls onto one below its middle
+	Broadphase broadphase;
+	Sphere sphere(0.2f, glm::vec3(0.0f, -0.3f, 0.0f));
+	if (scene == SCENE_SPHERE)
+		broadphase.add(&sphere);
+	broadphase.build();
+
+	// the drag scene moves the middle of the free edge round a vertical circle, starting and ending where it was
+	unsigned int dragged = options.size / 2 * options.size + options.size - 1;
+	if (scene == SCENE_DRAG)
+		cloth.grab(dragged);
+	glm::vec3 held = cloth.getVertices()[dragged].Position;
+	glm::vec3 dragCenter = held - glm::vec3(CONVERGENCE_DRAG_RADIUS, 0.0f, 0.0f);
+
+	Run run = { scene, solver, iterations };
+	Clock::time_point start;
+	Clock::duration measuring;
+	unsigned int step = 0;
+	float rms = 0.0f, largest = 0.0f;
+	cloth.setIterationHook([&](unsigned int done) {
+		Clock::time_point reached = Clock::now();
+		cloth.constraintError(rms, largest);
+		fprintf(csv, "%s,%s,%s,%u,%u,%u,%u,%.6f,%.8g,%.8g\n", options.label.c_str(), sceneNames[scene], solverName(solver),
+			iterations, options.threads + 1, step, done, seconds(reached - start - measuring) * 1e3, rms, largest);
+		measuring += Clock::now() - reached;
+	});
+
+	for (step = 0; step < options.steps; step++)
+	{
+		if (scene == SCENE_DRAG)
+		{
+			float angle = 2.0f * 3.14159265f * (step + 1) / CONVERGENCE_DRAG_PERIOD;
+			glm::vec3 target = dragCenter + CONVERGENCE_DRAG_RADIUS * glm::vec3(cos(angle), sin(angle), 0.0f);
+			cloth.drag(target - held);
+			held = target;
+		}
+		measuring = Clock::duration::zero();
+		start = Clock::now();
+		cloth.update(1.0f / 60.0f, broadphase);
+		run.stepTime += seconds(Clock::now() - start - measuring);
+		run.finalRms += rms;
+		run.finalMax = max(run.finalMax, largest);
+	}
+	cloth.setIterationHook(nullptr);
+	run.stepTime /= options.steps;
+	run.finalRms /= options.steps;
+	return run;
+}
+
+// comma separated list of names or numbers, false if one of them isn't valid
+template <typename T, typename F>
+static bool parseList(const char* value, vector<T>& list, const F& parse)
+{
+	list.clear();
+	string text = value;
+	for (size_t at = 0; at <= text.size();)
+	{
+		size_t end = min(text.find(',', at), text.size());
+		T item;
+		if (!parse(text.substr(at, end - at), item))
+			return false;
+		list.push_back(item);
+		at = end + 1;
+	}
+	return !list.empty();
+}
+
+static bool parseOptions(int argc, char** argv, Options& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		if (i + 1 >= argc)
+		{
+			std::cout << "ERROR::CONVERGENCE::MISSING_VALUE: " << arg << std::endl;
+			return false;
+		}
+		const char* value = argv[++i];
+		bool valid = true;
+		if (arg == "--size")
+		{
+			options.size = (unsigned int)strtoul(value, NULL, 10);
+			valid = options.size >= 2;
+		}
+		else if (arg == "--steps")
+		{
+			options.steps = (unsigned int)strtoul(value, NULL, 10);
+			valid = options.steps > 0;
+		}
+		else if (arg == "--iterations")
+			valid = parseList(value, options.iterations, [](const string& item, unsigned int& count) {
+				char* end;
+				count = (unsigned int)strtoul(item.c_str(), &end, 10);
+				return !item.empty() && *end == '\0' && count > 0;
+			});
+		else if (arg == "--solvers")
+			valid = parseList(value, options.solvers, [](const string& item, Solver& solver) {
+				solver = item == "tiled" ? SOLVER_TILED : item == "stencil" ? SOLVER_STENCIL : SOLVER_EDGES;
+				return item == "edges" || item == "tiled" || item == "stencil";
+			});
+		else if (arg == "--scenes")
+			valid = parseList(value, options.scenes, [](const string& item, Scene& scene) {
+				for (unsigned int s = 0; s < SCENE_COUNT; s++)
+					if (item == sceneNames[s])
+					{
+						scene = (Scene)s;
+						return true;
+					}
+				return false;
+			});
+		else if (arg == "--threads")
+			options.threads = (unsigned int)strtoul(value, NULL, 10);
+		else if (arg == "--target")
+			options.target = atof(value);
+		else if (arg == "--csv")
+			options.csv = value;
+		else if (arg == "--label")
+			options.label = value;
+		else
+		{
+			std::cout << "ERROR::CONVERGENCE::UNKNOWN_OPTION: " << arg << std::endl;
+			return false;
+		}
+		if (!valid)
+		{
+			std::cout << "ERROR::CONVERGENCE::INVALID_VALUE: " << arg << " " << value << std::endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+	if (!parseOptions(argc, argv, options))
+		return 1;
+	loadHeadlessGL();
+#if !defined(__OPTIMIZE__) && !defined(NDEBUG)
+	std::cout << "note: built without optimizations, configure with -DCMAKE_BUILD_TYPE=Release for times worth comparing" << std::endl;
+#endif
+
+	FILE* csv = fopen(options.csv.c_str(), "w");
+	if (!csv)
+	{
+		std::cout << "ERROR::CONVERGENCE::FILE_NOT_CREATED: " << options.csv << std::endl;
+		return 1;
+	}
+	fprintf(csv, "label,scene,solver,iterations,threads,step,iteration,time_ms,rms_error,max_error\n");
+
+	Scheduler scheduler(options.threads);
+	vector<Run> runs;
+	printf("%-8s %-8s %10s %11s %13s %13s\n", "scene", "solver", "iterations", "step ms", "rms error", "max error");
+	for (unsigned int s = 0; s < options.scenes.size(); s++)
+		for (unsigned int k = 0; k < options.solvers.size(); k++)
+			for (unsigned int i = 0; i < options.iterations.size(); i++)
+			{
+				Run run = runScene(options, scheduler, options.scenes[s], options.solvers[k], options.iterations[i], csv);
+				runs.push_back(run);
+				printf("%-8s %-8s %10u %11.4f %13.6g %13.6g\n", sceneNames[run.scene], solverName(run.solver), run.iterations,
+					run.stepTime * 1e3, run.finalRms, run.finalMax);
+				fflush(stdout);
+			}
+	bool written = fclose(csv) == 0;
+	if (!written)
+		std::cout << "ERROR::CONVERGENCE::FILE_NOT_WRITTEN: " << options.csv << std::endl;
+
+	bool met = true;
+	if (options.target >= 0.0)
+	{
+		for (unsigned int s = 0; s < options.scenes.size(); s++)
+		{
+			const Run* best = NULL;
+			for (unsigned int r = 0; r < runs.size(); r++)
+				if (runs[r].scene == options.scenes[s] && runs[r].finalRms <= options.target && (!best || runs[r].stepTime < best->stepTime))
+					best = &runs[r];
+			if (best)
+				printf("%s: %s with %u iterations is the fastest below %g, %.4f ms per step\n", sceneNames[best->scene],
+					solverName(best->solver), best->iterations, options.target, best->stepTime * 1e3);
+			else
+				printf("%s: no configuration stays below %g\n", sceneNames[options.scenes[s]], options.target);
+			met = met && best != NULL;
+		}
+	}
+	return written && met ? 0 : 1;
+}
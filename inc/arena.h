@@ -0,0 +1,250 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+
+#include "memory_tracker.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+using namespace std;
+
+#define ARENA_ALIGNMENT 64
+#define HUGE_PAGE_SIZE (2 << 20)
+
+// page backed memory straight from the OS, optionally on huge pages to save TLB entries,
+// bytes is set to the size actually mapped which has to be given to releasePages()
+inline void* allocatePages(size_t& bytes, bool hugePages)
+{
+#ifdef _WIN32
+	void* memory = NULL;
+	if (hugePages && GetLargePageMinimum() > 0)
+	{
+		// needs the lock pages in memory privilege, falls back to normal pages without it
+		size_t large = GetLargePageMinimum();
+		size_t rounded = (bytes + large - 1) / large * large;
+		memory = VirtualAlloc(NULL, rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		if (memory != NULL)
+			bytes = rounded;
+	}
+	if (memory == NULL)
+		memory = VirtualAlloc(NULL, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	return memory;
+#else
+	void* memory = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	// explicit huge pages only work if the system reserved some
+	if (hugePages)
+	{
+		size_t rounded = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+		memory = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (memory != MAP_FAILED)
+			bytes = rounded;
+	}
+#endif
+	if (memory == MAP_FAILED)
+	{
+		memory = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (memory == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		// otherwise ask for transparent huge pages
+		if (hugePages)
+			madvise(memory, bytes, MADV_HUGEPAGE);
+#endif
+	}
+	return memory;
+#endif
+}
+
+inline void releasePages(void* memory, size_t bytes)
+{
+#ifdef _WIN32
+	VirtualFree(memory, 0, MEM_RELEASE);
+#else
+	munmap(memory, bytes);
+#endif
+}
+
+// bump allocator over one contiguous block, everything is freed at once by reset() or destruction.
+// when the block runs out, allocations continue in overflow blocks and the next reset()
+// replaces all of them by one block large enough for the whole peak
+class Arena {
+public:
+	Arena() = default;
+
+	Arena(size_t capacity, bool hugePages = false) : hugePages(hugePages)
+	{
+		grow(capacity);
+	}
+
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	void* allocate(size_t bytes, size_t alignment = ARENA_ALIGNMENT)
+	{
+		size_t offset = (used + alignment - 1) / alignment * alignment;
+		if (blocks.empty() || offset + bytes > blocks.back().size)
+		{
+			// the padding counts towards the peak, or the block reset() coalesces into would be short of it
+			used = offset;
+			grow(max(bytes + alignment, blocks.empty() ? (size_t)0 : blocks.back().size));
+			offset = 0;
+		}
+		used = offset + bytes;
+		peak = max(peak, committed + used);
+		return (char*)blocks.back().memory + offset;
+	}
+
+	// free everything, coalescing overflow blocks into one
+	void reset()
+	{
+		if (blocks.size() > 1)
+		{
+			release();
+			grow(peak);
+		}
+		used = 0;
+		committed = 0;
+	}
+
+	// start of the first block, state allocated in order from a fresh arena is laid out contiguously here
+	void* data()
+	{
+		return blocks.empty() ? NULL : blocks.front().memory;
+	}
+
+	size_t size()
+	{
+		return committed + used;
+	}
+
+	size_t capacity()
+	{
+		size_t total = 0;
+		for (unsigned int i = 0; i < blocks.size(); i++)
+			total += blocks[i].size;
+		return total;
+	}
+
+	~Arena()
+	{
+		release();
+	}
+
+private:
+	struct Block
+	{
+		void* memory;
+		size_t size;
+		MemoryTag tag; // who the pages are charged to, a reset may release them under another tag
+	};
+
+	vector<Block> blocks;
+	size_t used = 0;      // bytes used in the last block
+	size_t committed = 0; // bytes used in the blocks before it
+	size_t peak = 0;
+	bool hugePages = false;
+
+	void grow(size_t bytes)
+	{
+		if (bytes == 0)
+			return;
+		void* memory = allocatePages(bytes, hugePages);
+		if (memory == NULL)
+			throw std::bad_alloc();
+		committed += used;
+		used = 0;
+		blocks.push_back({ memory, bytes, MemoryTracker::current() });
+#ifdef PBD_MEMORY
+		MemoryTracker::allocated(blocks.back().tag, bytes);
+#endif
+	}
+
+	void release()
+	{
+		for (unsigned int i = 0; i < blocks.size(); i++)
+		{
+			releasePages(blocks[i].memory, blocks[i].size);
+#ifdef PBD_MEMORY
+			MemoryTracker::freed(blocks[i].tag, blocks[i].size);
+#endif
+		}
+		blocks.clear();
+	}
+};
+
+// standard allocator over an arena, deallocation is a no-op since the arena frees in bulk.
+// without an arena it allocates 64 byte aligned from the heap like a normal allocator
+template <typename T>
+class ArenaAllocator {
+public:
+	typedef T value_type;
+	typedef true_type propagate_on_container_copy_assignment;
+	typedef true_type propagate_on_container_move_assignment;
+	typedef true_type propagate_on_container_swap;
+
+	Arena* arena = nullptr;
+
+	ArenaAllocator() = default;
+	ArenaAllocator(Arena* arena) : arena(arena) {}
+	template <typename U>
+	ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+	T* allocate(size_t n)
+	{
+		if (arena != nullptr)
+			return (T*)arena->allocate(n * sizeof(T));
+		return (T*)::operator new(n * sizeof(T), std::align_val_t(ARENA_ALIGNMENT));
+	}
+
+	void deallocate(T* p, size_t /*n*/)
+	{
+		if (arena == nullptr)
+			::operator delete(p, std::align_val_t(ARENA_ALIGNMENT));
+	}
+
+	// copies of a container go to the heap rather than sharing an arena they don't own
+	ArenaAllocator select_on_container_copy_construction() const
+	{
+		return ArenaAllocator();
+	}
+
+	template <typename U>
+	bool operator==(const ArenaAllocator<U>& other) const
+	{
+		return arena == other.arena;
+	}
+
+	template <typename U>
+	bool operator!=(const ArenaAllocator<U>& other) const
+	{
+		return arena != other.arena;
+	}
+};
+
+template <typename T>
+using SimVector = vector<T, ArenaAllocator<T>>;
+
+// copy a container into an arena vector of exactly its size
+template <typename T, typename Container>
+SimVector<T> arenaCopy(const Container& source, Arena* arena)
+{
+	SimVector<T> result{ ArenaAllocator<T>(arena) };
+	result.reserve(source.size());
+	result.assign(source.begin(), source.end());
+	return result;
+}
+#endif
@@ -0,0 +1,402 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <glm/glm.hpp>
+
+#include "cloth.h"
+#include "sphere.h"
+#include "arena.h"
+#include "scheduler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+using namespace std;
+
+// instances stepped together in one group, every particle is stored as BATCH_LANES consecutive floats,
+// one per instance, so the lane loops compile to 8-wide vectors on AVX (16 fits AVX-512 builds)
+#define BATCH_LANES 8
+
+// variation of the grid cloth simulated by one instance, defaults are the constants of Cloth
+struct BatchParams
+{
+	float velocityDamping = damping;
+	float stiffness = 1.0f; // scales every constraint correction, 1 is the full projection
+	unsigned int iterations = iteration;
+};
+
+// state of one instance after stepping
+struct BatchMetrics
+{
+	float maxStretch;    // largest relative deviation of an edge from its rest length
+	float meanStretch;   // average of the same over all edges
+	float kineticEnergy; // 1/2 sum of squared speeds, unit mass particles
+	float lowestPoint;   // smallest height of a particle
+	bool finite;         // false once a position became inf or nan
+};
+
+// many copies of the same grid cloth with different parameters stepped in lockstep. instances are grouped
+// by iteration count into groups of BATCH_LANES, the lanes of a group run the same instructions on their
+// own data and a lane that has done its iterations keeps its positions. groups are independent tasks and
+// each stays in cache for all steps of a step() call. with the default parameters an instance moves
+// exactly like Cloth with the edge solver
+class ClothBatch {
+public:
+	ClothBatch(unsigned int rows, unsigned int cols, const vector<BatchParams>& params, Scheduler* scheduler = NULL)
+		: rows(rows), cols(cols), scheduler(scheduler)
+	{
+		unsigned int n = rows * cols;
+
+		// rest lengths exactly as Cloth computes them from its initial positions
+		vector<glm::vec3> start(n);
+		for (unsigned int i = 0; i < rows; i++)
+			for (unsigned int j = 0; j < cols; j++)
+				start[i * cols + j] = glm::vec3((float)i / (float)rows - 0.5f, 0.0f, (float)j / (float)cols - 0.5f);
+		restRight.assign(n, 0.0f);
+		restDown.assign(n, 0.0f);
+		restDiag.assign(n, 0.0f);
+		for (unsigned int i = 0; i < rows; i++)
+			for (unsigned int j = 0; j < cols; j++)
+			{
+				unsigned int p = i * cols + j;
+				if (j < cols - 1)
+					restRight[p] = glm::length(start[p] - start[p + 1]);
+				if (i < rows - 1)
+					restDown[p] = glm::length(start[p] - start[p + cols]);
+				if (i < rows - 1 && j < cols - 1)
+					restDiag[p] = glm::length(start[p] - start[p + cols + 1]);
+			}
+
+		// instances with similar iteration counts share a group so few lanes idle
+		vector<unsigned int> order(params.size());
+		for (unsigned int i = 0; i < order.size(); i++)
+			order[i] = i;
+		stable_sort(order.begin(), order.end(), [&params](unsigned int a, unsigned int b) {
+			return params[a].iterations < params[b].iterations;
+		});
+
+		slots.resize(params.size());
+		groups.resize((params.size() + BATCH_LANES - 1) / BATCH_LANES);
+		for (unsigned int k = 0; k < groups.size(); k++)
+		{
+			LaneGroup& group = groups[k];
+			group.lanes = min((unsigned int)BATCH_LANES, (unsigned int)params.size() - k * BATCH_LANES);
+			group.maxIterations = 0;
+			for (unsigned int l = 0; l < BATCH_LANES; l++)
+			{
+				// unused lanes repeat the last instance
+				unsigned int instance = order[k * BATCH_LANES + min(l, group.lanes - 1)];
+				group.velocityDamping[l] = params[instance].velocityDamping;
+				group.stiffness[l] = params[instance].stiffness;
+				group.iterations[l] = params[instance].iterations;
+				group.maxIterations = max(group.maxIterations, params[instance].iterations);
+				if (l < group.lanes)
+					slots[instance] = k * BATCH_LANES + l;
+			}
+			for (unsigned int c = 0; c < 3; c++)
+			{
+				group.pos[c].assign(n * BATCH_LANES, 0.0f);
+				group.vel[c].assign(n * BATCH_LANES, 0.0f);
+				group.next[c].assign(n * BATCH_LANES, 0.0f);
+				group.right[c].assign(n * BATCH_LANES, 0.0f);
+				group.down[c].assign(n * BATCH_LANES, 0.0f);
+				group.diag[c].assign(n * BATCH_LANES, 0.0f);
+			}
+			for (unsigned int p = 0; p < n; p++)
+				for (unsigned int l = 0; l < BATCH_LANES; l++)
+				{
+					group.pos[0][p * BATCH_LANES + l] = start[p].x;
+					group.pos[1][p * BATCH_LANES + l] = start[p].y;
+					group.pos[2][p * BATCH_LANES + l] = start[p].z;
+				}
+		}
+	}
+
+	// all instances collide with the same sphere
+	void setCollider(const Sphere& sphere)
+	{
+		collider = sphere;
+		hasCollider = true;
+	}
+
+	// advance every instance by steps time steps of dt, groups in parallel
+	void step(float dt, unsigned int steps = 1)
+	{
+		auto run = [&](unsigned int begin, unsigned int end) {
+			for (unsigned int k = begin; k < end; k++)
+				for (unsigned int s = 0; s < steps; s++)
+					stepGroup(groups[k], dt);
+		};
+		if (scheduler)
+			scheduler->parallelFor("batch groups", 0, groups.size(), 1, run);
+		else
+			run(0, groups.size());
+	}
+
+	unsigned int size()
+	{
+		return slots.size();
+	}
+
+	glm::vec3 position(unsigned int instance, unsigned int particle)
+	{
+		const LaneGroup& group = groups[slots[instance] / BATCH_LANES];
+		unsigned int at = particle * BATCH_LANES + slots[instance] % BATCH_LANES;
+		return glm::vec3(group.pos[0][at], group.pos[1][at], group.pos[2][at]);
+	}
+
+	BatchMetrics metrics(unsigned int instance)
+	{
+		const LaneGroup& group = groups[slots[instance] / BATCH_LANES];
+		unsigned int l = slots[instance] % BATCH_LANES;
+		unsigned int n = rows * cols;
+
+		BatchMetrics result;
+		result.maxStretch = 0.0f;
+		result.kineticEnergy = 0.0f;
+		result.lowestPoint = FLT_MAX;
+		result.finite = true;
+		float stretchSum = 0.0f;
+		unsigned int edgeCount = 0;
+		for (unsigned int p = 0; p < n; p++)
+		{
+			glm::vec3 x = lane(group.pos, p, l);
+			glm::vec3 v = lane(group.vel, p, l);
+			result.kineticEnergy += 0.5f * glm::dot(v, v);
+			result.lowestPoint = min(result.lowestPoint, x.y);
+			result.finite = result.finite && std::isfinite(x.x) && std::isfinite(x.y) && std::isfinite(x.z);
+
+			unsigned int j = p % cols;
+			unsigned int neighbor[3] = { p + 1, p + cols, p + cols + 1 };
+			float rest[3] = { restRight[p], restDown[p], restDiag[p] };
+			bool exists[3] = { j < cols - 1, p + cols < n, j < cols - 1 && p + cols < n };
+			for (unsigned int e = 0; e < 3; e++)
+			{
+				if (!exists[e])
+					continue;
+				float stretch = fabs(glm::length(x - lane(group.pos, neighbor[e], l)) / rest[e] - 1.0f);
+				result.maxStretch = max(result.maxStretch, stretch);
+				stretchSum += stretch;
+				edgeCount++;
+			}
+		}
+		result.meanStretch = edgeCount > 0 ? stretchSum / edgeCount : 0.0f;
+		return result;
+	}
+
+private:
+	struct LaneGroup
+	{
+		// component c of particle p in lane l is at [c][p * BATCH_LANES + l]
+		SimVector<float> pos[3], vel[3], next[3];
+		SimVector<float> right[3], down[3], diag[3]; // corrections of the edges to the right, down and down-right neighbor
+		float velocityDamping[BATCH_LANES];
+		float stiffness[BATCH_LANES];
+		unsigned int iterations[BATCH_LANES];
+		unsigned int maxIterations;
+		unsigned int lanes; // lanes holding an instance
+	};
+
+	unsigned int rows, cols;
+	Scheduler* scheduler;
+	vector<LaneGroup> groups;
+	vector<unsigned int> slots; // group * BATCH_LANES + lane of every instance
+	vector<float> restRight, restDown, restDiag;
+	Sphere collider;
+	bool hasCollider = false;
+
+	static glm::vec3 lane(const SimVector<float>* v, unsigned int p, unsigned int l)
+	{
+		return glm::vec3(v[0][p * BATCH_LANES + l], v[1][p * BATCH_LANES + l], v[2][p * BATCH_LANES + l]);
+	}
+
+	bool isPinned(unsigned int p)
+	{
+		return p == 0 || p == (rows - 1) * cols;
+	}
+
+	// the same operations in the same order as Cloth::update() with the edge solver, lane by lane
+	void stepGroup(LaneGroup& group, float dt)
+	{
+		unsigned int n = rows * cols;
+		glm::vec3 gravity = g * dt;
+		for (unsigned int p = 0; p < n; p++)
+		{
+			if (isPinned(p))
+				continue;
+			for (unsigned int c = 0; c < 3; c++)
+			{
+				float* pos = &group.pos[c][p * BATCH_LANES];
+				float* vel = &group.vel[c][p * BATCH_LANES];
+				float v[BATCH_LANES], x[BATCH_LANES];
+				for (unsigned int l = 0; l < BATCH_LANES; l++)
+				{
+					v[l] = (vel[l] + gravity[c]) * group.velocityDamping[l];
+					x[l] = pos[l] + v[l] * dt;
+				}
+				copy(v, v + BATCH_LANES, vel);
+				copy(x, x + BATCH_LANES, pos);
+			}
+		}
+
+		for (unsigned int it = 0; it < group.maxIterations; it++)
+		{
+			for (unsigned int p = 0; p < n; p++)
+			{
+				unsigned int j = p % cols;
+				if (j < cols - 1)
+					edgeCorrections(group, group.right, p, p + 1, restRight[p]);
+				if (p + cols < n)
+					edgeCorrections(group, group.down, p, p + cols, restDown[p]);
+				if (j < cols - 1 && p + cols < n)
+					edgeCorrections(group, group.diag, p, p + cols + 1, restDiag[p]);
+			}
+			for (unsigned int p = 0; p < n; p++)
+				gatherCorrections(group, p, it, dt);
+			for (unsigned int c = 0; c < 3; c++)
+				group.pos[c].swap(group.next[c]);
+		}
+
+		if (hasCollider)
+			for (unsigned int p = 0; p < n; p++)
+				collide(group, p, dt);
+	}
+
+	// correction of the edge from a to b in every lane, scaled by the lane's stiffness
+	static void edgeCorrections(LaneGroup& group, SimVector<float>* out, unsigned int a, unsigned int b, float rest)
+	{
+		const float* ax = &group.pos[0][a * BATCH_LANES];
+		const float* ay = &group.pos[1][a * BATCH_LANES];
+		const float* az = &group.pos[2][a * BATCH_LANES];
+		const float* bx = &group.pos[0][b * BATCH_LANES];
+		const float* by = &group.pos[1][b * BATCH_LANES];
+		const float* bz = &group.pos[2][b * BATCH_LANES];
+		// lanes are computed into locals first here and below, the compiler can't tell
+		// the outputs don't overlap the inputs and wouldn't vectorize
+		float cx[BATCH_LANES], cy[BATCH_LANES], cz[BATCH_LANES];
+		for (unsigned int l = 0; l < BATCH_LANES; l++)
+		{
+			float dx = ax[l] - bx[l];
+			float dy = ay[l] - by[l];
+			float dz = az[l] - bz[l];
+			float len = sqrt(dx * dx + dy * dy + dz * dz);
+			float inv = 1.0f / len;
+			float scale = 0.5f * (len - rest) * group.stiffness[l];
+			cx[l] = scale * (dx * inv);
+			cy[l] = scale * (dy * inv);
+			cz[l] = scale * (dz * inv);
+		}
+		copy(cx, cx + BATCH_LANES, &out[0][a * BATCH_LANES]);
+		copy(cy, cy + BATCH_LANES, &out[1][a * BATCH_LANES]);
+		copy(cz, cz + BATCH_LANES, &out[2][a * BATCH_LANES]);
+	}
+
+	// new position of particle p from its edges in edge order: the ones ending at p (from the upper left,
+	// above and left neighbor) pull by +correction, the ones starting at p by -correction
+	void gatherCorrections(LaneGroup& group, unsigned int p, unsigned int it, float dt)
+	{
+		unsigned int n = rows * cols;
+		unsigned int j = p % cols;
+		bool up = p >= cols, down = p + cols < n, left = j > 0, right = j < cols - 1;
+		const float* terms[6][3];
+		float signs[6];
+		unsigned int count = 0;
+		auto add = [&](SimVector<float>* corrections, unsigned int edge, float sign) {
+			for (unsigned int c = 0; c < 3; c++)
+				terms[count][c] = &corrections[c][edge * BATCH_LANES];
+			signs[count++] = sign;
+		};
+		if (up && left)
+			add(group.diag, p - cols - 1, 1.0f);
+		if (up)
+			add(group.down, p - cols, 1.0f);
+		if (left)
+			add(group.right, p - 1, 1.0f);
+		if (right)
+			add(group.right, p, -1.0f);
+		if (down)
+			add(group.down, p, -1.0f);
+		if (down && right)
+			add(group.diag, p, -1.0f);
+
+		if (isPinned(p))
+		{
+			for (unsigned int c = 0; c < 3; c++)
+				copy(&group.pos[c][p * BATCH_LANES], &group.pos[c][(p + 1) * BATCH_LANES], &group.next[c][p * BATCH_LANES]);
+			return;
+		}
+
+		// lanes past their iteration count keep their state, blended with weights 0 and 1 rather than
+		// selected since compilers vectorize the blend, exact as long as the values are finite
+		float active[BATCH_LANES];
+		for (unsigned int l = 0; l < BATCH_LANES; l++)
+			active[l] = it < group.iterations[l] ? 1.0f : 0.0f;
+
+		float inverseDt = 1.0f / dt;
+		for (unsigned int c = 0; c < 3; c++)
+		{
+			const float* pos = &group.pos[c][p * BATCH_LANES];
+			float* vel = &group.vel[c][p * BATCH_LANES];
+			float* next = &group.next[c][p * BATCH_LANES];
+			float sum[BATCH_LANES] = {};
+			for (unsigned int k = 0; k < count; k++)
+			{
+				const float* term = terms[k][c];
+				if (signs[k] > 0.0f)
+					for (unsigned int l = 0; l < BATCH_LANES; l++)
+						sum[l] += pos[l] + term[l];
+				else
+					for (unsigned int l = 0; l < BATCH_LANES; l++)
+						sum[l] += pos[l] - term[l];
+			}
+			float v[BATCH_LANES], x[BATCH_LANES];
+			for (unsigned int l = 0; l < BATCH_LANES; l++)
+			{
+				float moved = (0.2f * pos[l] + sum[l]) / (0.2f + (float)count);
+				v[l] = vel[l] + active[l] * (inverseDt * (moved - pos[l]));
+				x[l] = active[l] * moved + (1.0f - active[l]) * pos[l];
+			}
+			copy(v, v + BATCH_LANES, vel);
+			copy(x, x + BATCH_LANES, next);
+		}
+	}
+
+	void collide(LaneGroup& group, unsigned int p, float dt)
+	{
+		glm::vec3 origin = collider.getOrigin();
+		float radius = collider.getRadius();
+		float inverseDt = 1.0f / dt;
+		const float* px = &group.pos[0][p * BATCH_LANES];
+		const float* py = &group.pos[1][p * BATCH_LANES];
+		const float* pz = &group.pos[2][p * BATCH_LANES];
+		float surface[3][BATCH_LANES];
+		float inside[BATCH_LANES];
+		for (unsigned int l = 0; l < BATCH_LANES; l++)
+		{
+			float dx = px[l] - origin.x;
+			float dy = py[l] - origin.y;
+			float dz = pz[l] - origin.z;
+			float len = sqrt(dx * dx + dy * dy + dz * dz);
+			float inv = 1.0f / len;
+			inside[l] = len < radius ? 1.0f : 0.0f;
+			surface[0][l] = origin.x + (dx * inv) * radius;
+			surface[1][l] = origin.y + (dy * inv) * radius;
+			surface[2][l] = origin.z + (dz * inv) * radius;
+		}
+		for (unsigned int c = 0; c < 3; c++)
+		{
+			float* pos = &group.pos[c][p * BATCH_LANES];
+			float* vel = &group.vel[c][p * BATCH_LANES];
+			float v[BATCH_LANES], x[BATCH_LANES];
+			for (unsigned int l = 0; l < BATCH_LANES; l++)
+			{
+				v[l] = vel[l] + inside[l] * (inverseDt * (surface[c][l] - pos[l]));
+				x[l] = inside[l] * surface[c][l] + (1.0f - inside[l]) * pos[l];
+			}
+			copy(v, v + BATCH_LANES, vel);
+			copy(x, x + BATCH_LANES, pos);
+		}
+	}
+};
+#endif
@@ -0,0 +1,63 @@
+#ifndef BROADPHASE_H
+#define BROADPHASE_H
+
+#include <glm/glm.hpp>
+
+#include "sphere.h"
+
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+
+// bounding boxes of all colliders sorted along x, built once per step and then shared read-only
+// by every cloth, which only tests its particles against the colliders overlapping its own bounds
+class Broadphase {
+public:
+	void clear()
+	{
+		entries.clear();
+		maxWidth = 0.0f;
+	}
+
+	void add(Sphere* sphere)
+	{
+		glm::vec3 radius(sphere->getRadius());
+		entries.push_back({ sphere->getOrigin() - radius, sphere->getOrigin() + radius, sphere });
+		maxWidth = max(maxWidth, 2.0f * sphere->getRadius());
+	}
+
+	// call once all colliders are added
+	void build()
+	{
+		sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.lo.x < b.lo.x; });
+	}
+
+	// colliders whose box overlaps [lo, hi]
+	void query(glm::vec3 lo, glm::vec3 hi, vector<Sphere*>& result) const
+	{
+		result.clear();
+		// no box is wider than maxWidth, so the ones starting before lo.x - maxWidth end before lo.x
+		vector<Entry>::const_iterator first = lower_bound(entries.begin(), entries.end(), lo.x - maxWidth,
+			[](const Entry& entry, float x) { return entry.lo.x < x; });
+		for (vector<Entry>::const_iterator it = first; it != entries.end() && it->lo.x <= hi.x; ++it)
+			if (it->hi.x >= lo.x && it->lo.y <= hi.y && it->hi.y >= lo.y && it->lo.z <= hi.z && it->hi.z >= lo.z)
+				result.push_back(it->sphere);
+	}
+
+	unsigned int size() const
+	{
+		return entries.size();
+	}
+
+private:
+	struct Entry
+	{
+		glm::vec3 lo, hi;
+		Sphere* sphere;
+	};
+
+	vector<Entry> entries;
+	float maxWidth = 0.0f;
+};
+#endif
@@ -0,0 +1,168 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <glm/glm.hpp>
+
+#include "mesh.h"
+#include "ray.h"
+
+#include <vector>
+#include <algorithm>
+
+#define BVH_LEAF_SIZE 4
+
+struct BVHNode
+{
+	glm::vec3 box_min, box_max;
+	unsigned int first; // first triangle for leaf, right child for inner node (left child is next node)
+	unsigned int count; // number of triangles, 0 for inner node
+};
+
+// bounding volume hierarchy over a deforming triangle mesh,
+// topology is built once and boxes are refitted when vertices move
+class BVH {
+public:
+	BVH() = default;
+
+	template <typename Vertices>
+	void build(const Vertices& vertices, const vector<unsigned int>& indices)
+	{
+		nodes.clear();
+		tris.resize(indices.size() / 3);
+		for (unsigned int i = 0; i < tris.size(); i++)
+			tris[i] = i;
+		if (tris.empty())
+			return;
+
+		vector<glm::vec3> centroids(tris.size());
+		for (unsigned int i = 0; i < tris.size(); i++)
+			centroids[i] = (vertices[indices[3 * i]].Position + vertices[indices[3 * i + 1]].Position + vertices[indices[3 * i + 2]].Position) / 3.0f;
+		buildNode(vertices, indices, centroids, 0, tris.size());
+	}
+
+	// nothing built yet, or there were no triangles
+	bool empty() const
+	{
+		return nodes.empty();
+	}
+
+	// recompute boxes bottom-up, children are always stored after their parent
+	template <typename Vertices>
+	void refit(const Vertices& vertices, const vector<unsigned int>& indices)
+	{
+		for (int i = (int)nodes.size() - 1; i >= 0; i--)
+		{
+			BVHNode& node = nodes[i];
+			if (node.count > 0)
+				fitLeaf(vertices, indices, node);
+			else
+			{
+				const BVHNode& left = nodes[i + 1];
+				const BVHNode& right = nodes[node.first];
+				node.box_min = glm::min(left.box_min, right.box_min);
+				node.box_max = glm::max(left.box_max, right.box_max);
+			}
+		}
+	}
+
+	// nearest hit along the ray, gives triangle index, distance and barycentric (u, v)
+	template <typename Vertices>
+	bool intersect(const Vertices& vertices, const vector<unsigned int>& indices, const Ray& ray, unsigned int& tri, float& t, float& u, float& v) const
+	{
+		if (nodes.empty())
+			return false;
+
+		glm::vec3 inv_dir = 1.0f / ray.dir;
+		bool hit = false;
+		unsigned int stack[64];
+		unsigned int top = 0;
+		stack[top++] = 0;
+		while (top > 0)
+		{
+			const BVHNode& node = nodes[stack[--top]];
+			float enter = intersectBox(ray, inv_dir, node.box_min, node.box_max);
+			if (enter < 0.0f || (hit && enter > t))
+				continue;
+
+			if (node.count > 0)
+			{
+				for (unsigned int i = node.first; i < node.first + node.count; i++)
+				{
+					float ti = 0.0f, ui = 0.0f, vi = 0.0f;
+					glm::vec3 a = vertices[indices[3 * tris[i]]].Position;
+					glm::vec3 b = vertices[indices[3 * tris[i] + 1]].Position;
+					glm::vec3 c = vertices[indices[3 * tris[i] + 2]].Position;
+					if (intersectTriangle(ray, a, b, c, ti, ui, vi) && (!hit || ti < t))
+					{
+						hit = true;
+						tri = tris[i];
+						t = ti;
+						u = ui;
+						v = vi;
+					}
+				}
+			}
+			else
+			{
+				stack[top++] = node.first;
+				stack[top++] = (unsigned int)(&node - &nodes[0]) + 1;
+			}
+		}
+		return hit;
+	}
+
+private:
+	vector<BVHNode> nodes;
+	vector<unsigned int> tris; // triangle indices ordered by leaf
+
+	template <typename Vertices>
+	void buildNode(const Vertices& vertices, const vector<unsigned int>& indices, const vector<glm::vec3>& centroids, unsigned int first, unsigned int count)
+	{
+		unsigned int index = nodes.size();
+		nodes.push_back({ glm::vec3(0.0f), glm::vec3(0.0f), first, count });
+		if (count <= BVH_LEAF_SIZE)
+		{
+			fitLeaf(vertices, indices, nodes[index]);
+			return;
+		}
+
+		// split at the median centroid along the longest axis
+		glm::vec3 c_min = centroids[tris[first]];
+		glm::vec3 c_max = c_min;
+		for (unsigned int i = first; i < first + count; i++)
+		{
+			c_min = glm::min(c_min, centroids[tris[i]]);
+			c_max = glm::max(c_max, centroids[tris[i]]);
+		}
+		glm::vec3 extent = c_max - c_min;
+		int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+		unsigned int mid = first + count / 2;
+		nth_element(tris.begin() + first, tris.begin() + mid, tris.begin() + first + count,
+			[&](unsigned int a, unsigned int b) { return centroids[a][axis] < centroids[b][axis]; });
+
+		buildNode(vertices, indices, centroids, first, mid - first);
+		unsigned int right = nodes.size();
+		buildNode(vertices, indices, centroids, mid, first + count - mid);
+
+		BVHNode& node = nodes[index];
+		node.first = right;
+		node.count = 0;
+		node.box_min = glm::min(nodes[index + 1].box_min, nodes[right].box_min);
+		node.box_max = glm::max(nodes[index + 1].box_max, nodes[right].box_max);
+	}
+
+	template <typename Vertices>
+	void fitLeaf(const Vertices& vertices, const vector<unsigned int>& indices, BVHNode& node)
+	{
+		node.box_min = vertices[indices[3 * tris[node.first]]].Position;
+		node.box_max = node.box_min;
+		for (unsigned int i = node.first; i < node.first + node.count; i++)
+			for (unsigned int k = 0; k < 3; k++)
+			{
+				glm::vec3 p = vertices[indices[3 * tris[i] + k]].Position;
+				node.box_min = glm::min(node.box_min, p);
+				node.box_max = glm::max(node.box_max, p);
+			}
+	}
+};
+#endif
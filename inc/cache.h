@@ -0,0 +1,646 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <glm/glm.hpp>
+
+#include "cloth.h"
+#include "lockfree.h"
+#include "mapped_file.h"
+#include "memory_tracker.h"
+
+#include <atomic>
+#include <cfloat>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// simulation cache file, all values in the byte order of the machine that wrote it and every chunk 4 byte aligned:
+//   header: "PBDC", version, CACHE_BYTE_ORDER as written by that machine, cloth count, keyframe interval
+//   per cloth: particle count, index count, the triangle indices
+//   one chunk per frame: type, payload size, frame number, frame of its keyframe, step it was recorded at, then per cloth
+//     keyframe: bounds min and extent as 6 floats, positions quantized to 16 bits inside them
+//     delta frame: one width per block of CACHE_BLOCK particles (0, 1 or 2 bytes per coordinate), then for
+//     every block with a width the quantized differences to the position predicted from the last two frames
+//   index chunk with the file offset of every frame, then a footer with the offset of the index and "PBDE"
+// steps count every append() including dropped frames, so a reader holds the frame before a gap
+#define CACHE_VERSION 3
+#define CACHE_BYTE_ORDER 0x01020304u // reads back as another value on a machine of the other byte order
+#define CACHE_KEYFRAME_INTERVAL 30 // frames, a seek decodes at most this many
+#define CACHE_BLOCK 64
+#define CACHE_BOUNDS_MARGIN 0.25f // keyframe bounds are widened by this much of their size on every side
+#define CACHE_QUEUE 64 // frames the writer thread may fall behind before frames are dropped
+
+enum CacheChunkType
+{
+	CACHE_FRAME = 1,
+	CACHE_INDEX = 2
+};
+
+// positions of all cloths handed from append() to the writer thread
+struct CacheFrame
+{
+	unsigned int step;
+	vector<glm::vec3> positions;
+};
+
+// quantized positions of every cloth at one frame, what both writer and reader keep between frames
+struct CacheState
+{
+	vector<unsigned short> quantized; // 3 per particle
+	vector<unsigned short> previous; // the frame before, the same as quantized at a keyframe
+	glm::vec3 boundsMin, boundsExtent; // of the keyframe the frame builds on
+
+	// value j of the next frame if the particle keeps its velocity, wraps around like the differences do
+	unsigned short predict(unsigned int j) const
+	{
+		return (unsigned short)(2 * quantized[j] - previous[j]);
+	}
+
+	void advance(unsigned int j, unsigned short value)
+	{
+		previous[j] = quantized[j];
+		quantized[j] = value;
+	}
+};
+
+// records frames of a set of cloths to a cache file. append() only copies the positions, quantizing,
+// delta encoding and writing happen on a thread of the writer
+class CacheWriter {
+public:
+	CacheWriter() = default;
+
+	CacheWriter(const CacheWriter&) = delete;
+	CacheWriter& operator=(const CacheWriter&) = delete;
+
+	~CacheWriter()
+	{
+		close();
+	}
+
+	// write the header with the topology of the cloths and start the writer thread
+	bool open(const char* path, const vector<Cloth*>& cloths, unsigned int keyframeInterval = CACHE_KEYFRAME_INTERVAL)
+	{
+		MEMORY_SUBSYSTEM(MEMORY_IO);
+		close();
+		file = fopen(path, "wb");
+		if (!file)
+		{
+			std::cout << "ERROR::CACHE::FILE_NOT_CREATED: " << path << std::endl;
+			return false;
+		}
+		this->path = path;
+		failed = false;
+		this->keyframeInterval = max(keyframeInterval, 1u);
+		written = 0;
+		frames = 0;
+		offsets.clear();
+		dropped = 0;
+		steps = 0;
+
+		unsigned int header[5] = { 0, CACHE_VERSION, CACHE_BYTE_ORDER, (unsigned int)cloths.size(), this->keyframeInterval };
+		memcpy(header, "PBDC", 4);
+		write(header, sizeof(header));
+		particles.clear();
+		states.assign(cloths.size(), CacheState());
+		unsigned int total = 0;
+		for (unsigned int c = 0; c < cloths.size(); c++)
+		{
+			const vector<unsigned int>& indices = cloths[c]->getIndices();
+			unsigned int counts[2] = { cloths[c]->particleCount(), (unsigned int)indices.size() };
+			write(counts, sizeof(counts));
+			write(indices.data(), indices.size() * sizeof(unsigned int));
+			particles.push_back(counts[0]);
+			total += counts[0];
+		}
+		if (failed)
+		{
+			std::cout << "ERROR::CACHE::FILE_NOT_WRITTEN: " << path << std::endl;
+			fclose(file);
+			file = NULL;
+			return false;
+		}
+
+		CacheFrame* stale;
+		while (spare.pop(stale) || filled.pop(stale))
+			;
+		buffers.clear();
+		for (unsigned int i = 0; i < CACHE_QUEUE; i++)
+		{
+			buffers.push_back(unique_ptr<CacheFrame>(new CacheFrame()));
+			buffers.back()->positions.resize(total);
+			spare.push(buffers.back().get());
+		}
+		stopping = false;
+		worker = std::thread(&CacheWriter::run, this);
+		return true;
+	}
+
+	// positions of all cloths as the next frame, never waits for the writer thread.
+	// false if it fell CACHE_QUEUE frames behind and the frame was dropped
+	bool append(const vector<Cloth*>& cloths)
+	{
+		MEMORY_SUBSYSTEM(MEMORY_IO);
+		CacheFrame* buffer;
+		unsigned int step = steps++;
+		if (!file || !spare.pop(buffer))
+		{
+			dropped++;
+			return false;
+		}
+		buffer->step = step;
+		unsigned int at = 0;
+		for (unsigned int c = 0; c < cloths.size(); c++)
+		{
+			const SimVector<Vertex>& vertices = cloths[c]->getVertices();
+			for (unsigned int i = 0; i < vertices.size(); i++)
+				buffer->positions[at++] = vertices[i].Position;
+		}
+		filled.push(buffer);
+		wake.notify_one();
+		return true;
+	}
+
+	// write the frames still queued and the index, the file can be read afterwards unless hasFailed()
+	void close()
+	{
+		if (!file)
+			return;
+		{
+			lock_guard<mutex> guard(sleepLock);
+			stopping = true;
+		}
+		wake.notify_one();
+		worker.join();
+
+		uint64_t indexOffset = written;
+		unsigned int chunk[3] = { CACHE_INDEX, (unsigned int)(4 + offsets.size() * sizeof(uint64_t)), (unsigned int)offsets.size() };
+		write(chunk, sizeof(chunk));
+		write(offsets.data(), offsets.size() * sizeof(uint64_t));
+		char footer[12];
+		memcpy(footer, &indexOffset, 8);
+		memcpy(footer + 8, "PBDE", 4);
+		write(footer, sizeof(footer));
+		if (fclose(file) != 0)
+			failed = true;
+		file = NULL;
+		if (failed)
+			std::cout << "ERROR::CACHE::FILE_NOT_WRITTEN: " << path << std::endl;
+	}
+
+	unsigned int frameCount()
+	{
+		return frames;
+	}
+
+	unsigned int droppedFrames()
+	{
+		return dropped;
+	}
+
+	// whether a write failed, the file is incomplete then
+	bool hasFailed()
+	{
+		return failed;
+	}
+
+private:
+	FILE* file = NULL;
+	string path;
+	atomic<bool> failed{ false }; // set by the writer thread, the offsets of the index are wrong after it
+	unsigned int keyframeInterval = CACHE_KEYFRAME_INTERVAL;
+	uint64_t written = 0;
+	vector<uint64_t> offsets; // of every frame chunk
+	atomic<unsigned int> frames{ 0 };
+	atomic<unsigned int> dropped{ 0 };
+	unsigned int steps = 0; // append() calls, only made by the recording thread
+
+	vector<unsigned int> particles; // of every cloth
+	vector<CacheState> states; // last frame written
+	vector<unsigned char> payload;
+
+	std::thread worker;
+	vector<unique_ptr<CacheFrame>> buffers;
+	SPSCQueue<CacheFrame*, CACHE_QUEUE> spare, filled; // buffers flow from spare to filled and back
+	mutex sleepLock;
+	condition_variable wake;
+	bool stopping = false;
+
+	void write(const void* data, size_t bytes)
+	{
+		if (fwrite(data, 1, bytes, file) != bytes)
+			failed = true;
+		written += bytes;
+	}
+
+	void run()
+	{
+		MEMORY_SUBSYSTEM(MEMORY_IO);
+		while (true)
+		{
+			CacheFrame* buffer;
+			if (filled.pop(buffer))
+			{
+				encode(*buffer);
+				spare.push(buffer);
+				continue;
+			}
+			unique_lock<mutex> guard(sleepLock);
+			if (stopping)
+			{
+				// append() may have pushed one more frame before close()
+				guard.unlock();
+				while (filled.pop(buffer))
+					encode(*buffer);
+				return;
+			}
+			// append() notifies without the lock, so don't rely on every notification arriving
+			wake.wait_for(guard, chrono::milliseconds(5));
+		}
+	}
+
+	void encode(const CacheFrame& recorded)
+	{
+		const vector<glm::vec3>& positions = recorded.positions;
+		unsigned int frame = frames;
+		bool keyframe = frame % keyframeInterval == 0;
+		unsigned int at = 0;
+		for (unsigned int c = 0; c < particles.size() && !keyframe; c++)
+		{
+			glm::vec3 lo = states[c].boundsMin, hi = states[c].boundsMin + states[c].boundsExtent;
+			for (unsigned int i = at; i < at + particles[c] && !keyframe; i++)
+				keyframe = glm::any(glm::lessThan(positions[i], lo)) || glm::any(glm::greaterThan(positions[i], hi));
+			at += particles[c];
+		}
+		if (keyframe)
+			keyframeAt = frame;
+
+		payload.clear();
+		unsigned int numbers[3] = { frame, keyframeAt, recorded.step };
+		put(numbers, sizeof(numbers));
+		at = 0;
+		for (unsigned int c = 0; c < particles.size(); c++)
+		{
+			if (keyframe)
+				encodeKeyframe(states[c], &positions[at], particles[c]);
+			else
+				encodeDelta(states[c], &positions[at], particles[c]);
+			at += particles[c];
+		}
+
+		offsets.push_back(written);
+		unsigned int chunk[2] = { CACHE_FRAME, (unsigned int)payload.size() };
+		write(chunk, sizeof(chunk));
+		write(payload.data(), payload.size());
+		frames = frame + 1;
+	}
+
+	unsigned int keyframeAt = 0;
+
+	void put(const void* data, size_t bytes)
+	{
+		const unsigned char* p = (const unsigned char*)data;
+		payload.insert(payload.end(), p, p + bytes);
+	}
+
+	void pad()
+	{
+		while (payload.size() % 4)
+			payload.push_back(0);
+	}
+
+	static unsigned short quantize(float x, float lo, float extent)
+	{
+		float t = (x - lo) / extent * 65535.0f + 0.5f;
+		return (unsigned short)glm::clamp(t, 0.0f, 65535.0f);
+	}
+
+	void encodeKeyframe(CacheState& state, const glm::vec3* positions, unsigned int count)
+	{
+		glm::vec3 lo(FLT_MAX), hi(-FLT_MAX);
+		for (unsigned int i = 0; i < count; i++)
+		{
+			lo = glm::min(lo, positions[i]);
+			hi = glm::max(hi, positions[i]);
+		}
+		if (count == 0)
+			lo = hi = glm::vec3(0.0f);
+		glm::vec3 margin = (hi - lo) * CACHE_BOUNDS_MARGIN + glm::vec3(1e-3f);
+		state.boundsMin = lo - margin;
+		state.boundsExtent = hi - lo + 2.0f * margin;
+		state.quantized.resize(3 * count);
+		for (unsigned int i = 0; i < count; i++)
+			for (unsigned int k = 0; k < 3; k++)
+				state.quantized[3 * i + k] = quantize(positions[i][k], state.boundsMin[k], state.boundsExtent[k]);
+		state.previous = state.quantized;
+
+		put(&state.boundsMin, sizeof(glm::vec3));
+		put(&state.boundsExtent, sizeof(glm::vec3));
+		put(state.quantized.data(), state.quantized.size() * sizeof(unsigned short));
+		pad();
+	}
+
+	void encodeDelta(CacheState& state, const glm::vec3* positions, unsigned int count)
+	{
+		unsigned int blocks = (count + CACHE_BLOCK - 1) / CACHE_BLOCK;
+		size_t widths = payload.size();
+		payload.resize(widths + blocks);
+		pad();
+		unsigned short quantized[3 * CACHE_BLOCK];
+		for (unsigned int b = 0; b < blocks; b++)
+		{
+			unsigned int begin = b * CACHE_BLOCK, end = min(begin + CACHE_BLOCK, count);
+			int largest = 0;
+			for (unsigned int i = begin; i < end; i++)
+				for (unsigned int k = 0; k < 3; k++)
+				{
+					unsigned short q = quantize(positions[i][k], state.boundsMin[k], state.boundsExtent[k]);
+					quantized[3 * (i - begin) + k] = q;
+					largest = max(largest, abs((int)(short)(q - state.predict(3 * i + k))));
+				}
+			unsigned char width = largest == 0 ? 0 : largest < 128 ? 1 : 2;
+			payload[widths + b] = width;
+			for (unsigned int j = 0; j < 3 * (end - begin); j++)
+			{
+				// differences wrap around 16 bits, the reader adds them the same way
+				unsigned short diff = (unsigned short)(quantized[j] - state.predict(3 * begin + j));
+				if (width == 1)
+					payload.push_back((unsigned char)(signed char)(short)diff);
+				else if (width == 2)
+					put(&diff, sizeof(diff));
+				state.advance(3 * begin + j, quantized[j]);
+			}
+		}
+		pad();
+	}
+};
+
+// plays a cache file back from memory mapped by the OS, topology and frames are used in place.
+// seek() decodes from the keyframe before a frame, or just the next delta when playing forward
+class CacheReader {
+public:
+	CacheReader() = default;
+
+	CacheReader(const CacheReader&) = delete;
+	CacheReader& operator=(const CacheReader&) = delete;
+
+	~CacheReader()
+	{
+		close();
+	}
+
+	bool open(const char* path)
+	{
+		MEMORY_SUBSYSTEM(MEMORY_IO);
+		close();
+		if (!file.open(path))
+		{
+			std::cout << "ERROR::CACHE::FILE_NOT_READ: " << path << std::endl;
+			return false;
+		}
+		data = file.data();
+		size = file.size();
+		// the version would read wrong in the other byte order as well, so that is told apart first
+		bool cache = size >= 20 && memcmp(data, "PBDC", 4) == 0;
+		if (cache && load<unsigned int>(8) != CACHE_BYTE_ORDER && load<unsigned int>(4) != CACHE_VERSION)
+		{
+			std::cout << "ERROR::CACHE::OTHER_BYTE_ORDER: " << path << std::endl;
+			close();
+			return false;
+		}
+		if (!cache || load<unsigned int>(4) != CACHE_VERSION || load<unsigned int>(8) != CACHE_BYTE_ORDER)
+		{
+			std::cout << "ERROR::CACHE::NOT_A_CACHE_FILE: " << path << std::endl;
+			close();
+			return false;
+		}
+		unsigned int cloths = load<unsigned int>(12);
+		keyframeInterval = load<unsigned int>(16);
+		size_t at = 20;
+		for (unsigned int c = 0; c < cloths && at + 8 <= size; c++)
+		{
+			ClothInfo info;
+			info.particles = load<unsigned int>(at);
+			info.indexCount = load<unsigned int>(at + 4);
+			info.indices = (const unsigned int*)(data + at + 8);
+			at += 8 + (size_t)info.indexCount * sizeof(unsigned int);
+			infos.push_back(info);
+		}
+		if (infos.size() != cloths || at > size)
+		{
+			std::cout << "ERROR::CACHE::TRUNCATED_HEADER: " << path << std::endl;
+			close();
+			return false;
+		}
+
+		// the index written by close(), or the frames found one by one if the recording was cut off
+		if (!readIndex())
+		{
+			frameOffsets.clear();
+			while (at + 20 <= size && load<unsigned int>(at) == CACHE_FRAME)
+			{
+				size_t next = at + 8 + load<unsigned int>(at + 4);
+				if (next > size)
+					break;
+				frameOffsets.push_back(at);
+				at = next;
+			}
+		}
+		states.assign(infos.size(), CacheState());
+		current = UINT_MAX;
+		return true;
+	}
+
+	void close()
+	{
+		file.close();
+		data = NULL;
+		size = 0;
+		infos.clear();
+		frameOffsets.clear();
+		states.clear();
+		current = UINT_MAX;
+	}
+
+	unsigned int frameCount()
+	{
+		return frameOffsets.size();
+	}
+
+	// steps the recording covers, more than the frames if some were dropped
+	unsigned int stepCount()
+	{
+		return frameOffsets.empty() ? 0 : frameStep(frameOffsets.size() - 1) + 1;
+	}
+
+	// step a frame was recorded at
+	unsigned int frameStep(unsigned int frame)
+	{
+		return load<unsigned int>(frameOffsets[frame] + 16);
+	}
+
+	unsigned int clothCount()
+	{
+		return infos.size();
+	}
+
+	unsigned int particleCount(unsigned int cloth)
+	{
+		return infos[cloth].particles;
+	}
+
+	// triangle indices of a cloth, pointing into the mapped file
+	const unsigned int* getIndices(unsigned int cloth, unsigned int& count)
+	{
+		count = infos[cloth].indexCount;
+		return infos[cloth].indices;
+	}
+
+	// make frame the current one, false if there is no such frame
+	bool seek(unsigned int frame)
+	{
+		if (frame >= frameOffsets.size())
+			return false;
+		if (frame == current)
+			return true;
+		MEMORY_SUBSYSTEM(MEMORY_IO);
+		unsigned int keyframe = load<unsigned int>(frameOffsets[frame] + 12);
+		unsigned int from = keyframe;
+		if (current != UINT_MAX && current < frame && current >= keyframe)
+			from = current + 1;
+		for (unsigned int f = from; f <= frame; f++)
+			decode(f);
+		current = frame;
+		return true;
+	}
+
+	// make the last frame recorded at or before step the current one, which holds it over dropped frames
+	bool seekStep(unsigned int step)
+	{
+		unsigned int lo = 0, hi = frameOffsets.size();
+		while (lo < hi)
+		{
+			unsigned int mid = (lo + hi) / 2;
+			if (frameStep(mid) <= step)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return lo > 0 && seek(lo - 1);
+	}
+
+	// positions of a cloth at the current frame
+	void positions(unsigned int cloth, vector<Vertex>& vertices)
+	{
+		MEMORY_SUBSYSTEM(MEMORY_IO);
+		const CacheState& state = states[cloth];
+		vertices.resize(infos[cloth].particles);
+		glm::vec3 scale = state.boundsExtent / 65535.0f;
+		for (unsigned int i = 0; i < vertices.size(); i++)
+		{
+			glm::vec3 q(state.quantized[3 * i], state.quantized[3 * i + 1], state.quantized[3 * i + 2]);
+			vertices[i].Position = state.boundsMin + q * scale;
+		}
+	}
+
+private:
+	struct ClothInfo
+	{
+		unsigned int particles;
+		unsigned int indexCount;
+		const unsigned int* indices;
+	};
+
+	MappedFile file;
+	const char* data = NULL;
+	size_t size = 0;
+	unsigned int keyframeInterval = CACHE_KEYFRAME_INTERVAL;
+	vector<ClothInfo> infos;
+	vector<uint64_t> frameOffsets;
+	vector<CacheState> states;
+	unsigned int current = UINT_MAX;
+
+	template <typename T>
+	T load(size_t at)
+	{
+		T value;
+		memcpy(&value, data + at, sizeof(T));
+		return value;
+	}
+
+	bool readIndex()
+	{
+		if (size < 12 || memcmp(data + size - 4, "PBDE", 4) != 0)
+			return false;
+		uint64_t index = load<uint64_t>(size - 12);
+		if (index + 12 > size || load<unsigned int>(index) != CACHE_INDEX)
+			return false;
+		unsigned int count = load<unsigned int>(index + 8);
+		if (index + 12 + (uint64_t)count * sizeof(uint64_t) > size)
+			return false;
+		frameOffsets.resize(count);
+		memcpy(frameOffsets.data(), data + index + 12, count * sizeof(uint64_t));
+		return true;
+	}
+
+	// apply one frame to the states, a keyframe replaces them
+	void decode(unsigned int frame)
+	{
+		size_t at = frameOffsets[frame];
+		bool keyframe = load<unsigned int>(at + 12) == load<unsigned int>(at + 8);
+		at += 20;
+		for (unsigned int c = 0; c < infos.size(); c++)
+		{
+			CacheState& state = states[c];
+			unsigned int count = infos[c].particles;
+			if (keyframe)
+			{
+				state.boundsMin = load<glm::vec3>(at);
+				state.boundsExtent = load<glm::vec3>(at + 12);
+				state.quantized.resize(3 * count);
+				memcpy(state.quantized.data(), data + at + 24, state.quantized.size() * sizeof(unsigned short));
+				state.previous = state.quantized;
+				at = align(at + 24 + state.quantized.size() * sizeof(unsigned short));
+				continue;
+			}
+
+			unsigned int blocks = (count + CACHE_BLOCK - 1) / CACHE_BLOCK;
+			const unsigned char* widths = (const unsigned char*)data + at;
+			at = align(at + blocks);
+			for (unsigned int b = 0; b < blocks; b++)
+			{
+				unsigned int begin = b * CACHE_BLOCK, end = min(begin + CACHE_BLOCK, count);
+				for (unsigned int j = 3 * begin; j < 3 * end; j++)
+				{
+					unsigned short diff = 0;
+					if (widths[b] == 1)
+						diff = (unsigned short)(short)(signed char)data[at++];
+					else if (widths[b] == 2)
+					{
+						diff = load<unsigned short>(at);
+						at += 2;
+					}
+					state.advance(j, (unsigned short)(state.predict(j) + diff));
+				}
+			}
+			at = align(at);
+		}
+	}
+
+	static size_t align(size_t at)
+	{
+		return (at + 3) / 4 * 4;
+	}
+};
+#endif
@@ -8,18 +8,94 @@
 
 #include "mesh.h"
 #include "sphere.h"
+#include "ray.h"
+#include "bvh.h"
+#include "reorder.h"
+#include "arena.h"
+#include "scheduler.h"
+#include "broadphase.h"
+#include "profiler.h"
+#include "memory_tracker.h"
 
 #include <vector>
+#include <memory>
+#include <cfloat>
+#include <climits>
+#include <cstring>
+#include <chrono>
+#include <functional>
 
 #define g glm::vec3(0.0f, -9.8f, 0.0f)
 #define damping 0.99f
 #define iteration 32 // more iterations more stiffness
 
+// tiled solver: tile of TILE_SIZE x TILE_SIZE particles plus a halo of TILE_DEPTH,
+// 72 x 72 particles at ~50 bytes each stay in a 256 KB L2 for TILE_DEPTH iterations
+#define TILE_SIZE 64
+#define TILE_DEPTH 4
+
+// smallest range of particles or edges handed to one task of the scheduler
+#define PARTICLE_GRAIN 1024
+
+// sleeping: particles are tracked in blocks of SLEEP_BLOCK consecutive indices, a block is quiet after
+// SLEEP_FRAMES steps with a mean kinetic energy per particle below SLEEP_ENERGY (about 1 mm/s) and a
+// largest edge stretch that changed by less than SLEEP_RESIDUAL meters (10 um) from step to step
+#define SLEEP_BLOCK 64
+#define SLEEP_FRAMES 30
+#define SLEEP_ENERGY 5e-7f
+#define SLEEP_RESIDUAL 1e-5f
+#define SLEEP_MARGIN 0.01f // colliders moving closer than this to a sleeping block wake it
+
+// snapshots: a header and then every section of state padded to SNAPSHOT_ALIGNMENT bytes
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_ALIGNMENT 16
+
 typedef glm::vec3 Normal;
 typedef glm::vec3 Velocity;
 typedef glm::vec3 Acceleration;
 typedef glm::vec3 Force;
 
+enum Solver
+{
+	SOLVER_EDGES, // Jacobi sweeps over the edge list, any cloth
+	SOLVER_TILED, // same Jacobi iterations done tile by tile while the tile is in cache, grid cloth only
+	SOLVER_STENCIL // Jacobi iterations as row stencils on the grid index, no edge list, grid cloth only
+};
+
+// structure of arrays for vectorized row loops
+struct Vec3Array
+{
+	vector<float> x, y, z;
+
+	void resize(unsigned int n)
+	{
+		x.resize(n);
+		y.resize(n);
+		z.resize(n);
+	}
+
+	void zero()
+	{
+		fill(x.begin(), x.end(), 0.0f);
+		fill(y.begin(), y.end(), 0.0f);
+		fill(z.begin(), z.end(), 0.0f);
+	}
+};
+
+// per thread buffers of the tiled solver, a tile plus its halo
+struct TileScratch
+{
+	vector<glm::vec3> pos[2];
+	vector<Velocity> vels;
+	vector<glm::vec3> sum;
+};
+
+// per thread buffers of the stencil solver, corrections of the edges of the current and previous row
+struct StencilScratch
+{
+	Vec3Array right, down[2], diag[2];
+};
+
 struct Edge
 {
 	unsigned int indice_x, indice_y;
@@ -46,6 +122,37 @@ struct Edge
 	}
 };
 
+// seconds spent building a cloth in its constructor
+struct BuildTiming
+{
+	double reorder = 0.0;   // particle order for cache locality, meshes only
+	double edges = 0.0;     // collecting the triangle edges and removing duplicates
+	double mesh = 0.0;      // render mesh and wireframe lines
+	double adjacency = 0.0; // vertex to triangle and edge lists, sleeping blocks and grid rest lengths
+	double arena = 0.0;     // moving the state into its arena
+	double total = 0.0;
+};
+
+// start of a cloth snapshot, everything else is at fixed offsets given by the counts
+struct ClothSnapshot
+{
+	char magic[4]; // "PBDS"
+	unsigned int version;
+	unsigned int size; // bytes of the whole snapshot
+	unsigned int particles, edges, blocks;
+	unsigned int solver;
+	unsigned int sleeping;
+	unsigned int iterations;
+	unsigned int contacts; // colliders seen in the last step, after the other sections
+};
+
+// a collider seen in the last step, by its index among the colliders of the snapshot
+struct ContactSnapshot
+{
+	unsigned int collider;
+	glm::vec4 place; // origin and radius
+};
+
 class Cloth{
 public:
 	// no default constructor
@@ -54,6 +161,7 @@ public:
 	// constructor
 	Cloth(unsigned int rows, unsigned int cols) // greater resolution less stiffness
 	{
+		MEMORY_SCOPE(MEMORY_CLOTH_STATE, this);
 		this->rows = rows;
 		this->cols = cols;
 		for(unsigned int i = 0; i < rows; i++)
@@ -65,10 +173,13 @@ public:
 				v.Position.z = (float)j / (float)cols - 0.5f;
 				vertices.push_back(v);
 				vels.push_back({ 0.0f, 0.0f, 0.0f });
+				pinned.push_back(0);
 				//forces.push_back({ 0.0f, 0.0f, 0.0f });
 			}
-		vector<unsigned int> indices;
-		vector<Edge> duplicate_edges;
+		// two fixed corners
+		pinned[0] = 1;
+		pinned[(rows - 1) * cols] = 1;
+
 		for(unsigned int i = 0; i < rows - 1; i++)
 			for (unsigned int j = 0; j < cols - 1; j++)
 			{
@@ -76,26 +187,36 @@ public:
 				indices.push_back(i * cols + j);
 				indices.push_back(i * cols + j + 1);
 				indices.push_back((i + 1) * cols + j + 1);
-				normals.push_back(Normal(0.0f, 1.0f, 0.0f));
-				duplicate_edges.push_back({ i * cols + j, i * cols + j + 1 });
-				duplicate_edges.push_back({ i * cols + j, (i + 1) * cols + j + 1 });
-				duplicate_edges.push_back({ i * cols + j + 1, (i + 1) * cols + j + 1 });
 
 				// triangle2
 				indices.push_back(i * cols + j);
 				indices.push_back((i + 1) * cols + j);
 				indices.push_back((i + 1) * cols + j + 1);
-				normals.push_back(Normal(0.0f, 1.0f, 0.0f));
-				duplicate_edges.push_back({ i * cols + j, (i + 1) * cols + j });
-				duplicate_edges.push_back({ i * cols + j, (i + 1) * cols + j + 1 });
-				duplicate_edges.push_back({ (i + 1) * cols + j, (i + 1) * cols + j + 1 });
 			}
 
-		vector<Texture> textures; // now is empty
-		mesh = Mesh(vertices, indices, textures);
+		buildTopology();
+	}
 
-		// remove duplicated edge
-		edgeDuplicateRemoval(duplicate_edges);
+	// cloth from an arbitrary triangle mesh, particles are reordered for cache locality,
+	// indices given to pin() and returned by toExternal() still refer to the source order
+	Cloth(vector<Vertex> vertices, vector<unsigned int> indices, ParticleOrder order = ORDER_RCM)
+	{
+		MEMORY_SCOPE(MEMORY_CLOTH_STATE, this);
+		this->rows = 0;
+		this->cols = 0;
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		permutation = reorderParticles(vertices, indices, order);
+		buildTiming.reorder = seconds(start);
+		inversePermutation.resize(permutation.size());
+		for (unsigned int i = 0; i < permutation.size(); i++)
+			inversePermutation[permutation[i]] = i;
+
+		this->vertices.assign(vertices.begin(), vertices.end());
+		this->indices = indices;
+		vels.resize(vertices.size(), Velocity(0.0f));
+		pinned.resize(vertices.size(), 0);
+
+		buildTopology();
 	}
 
 	// render the cloth
@@ -104,49 +225,983 @@ public:
 		mesh.Draw(shader);
 	}
 
+	// render the wireframe, every constraint edge once
+	void DrawLines(Shader& shader)
+	{
+		mesh.DrawLines(shader);
+	}
+
 	// update the cloth
 	void update(float deltaTime, Sphere* sphere)
 	{
-		dt = deltaTime;
-		for (unsigned int i = 0; i < vertices.size(); i++)
+		contacts.assign(1, sphere);
+		step(deltaTime, NULL);
+	}
+
+	// update the cloth against the colliders of a shared broadphase that overlap it
+	void update(float deltaTime, const Broadphase& broadphase)
+	{
+		step(deltaTime, &broadphase);
+	}
+
+	// run the simulation phases on a thread pool, NULL runs them on the calling thread
+	void setScheduler(Scheduler* scheduler)
+	{
+		MEMORY_SCOPE(MEMORY_SOLVER_SCRATCH, this);
+		this->scheduler = scheduler;
+		unsigned int threads = scheduler ? scheduler->threadCount() : 1;
+		tileScratch.resize(threads);
+		stencilScratch.resize(threads);
+	}
+
+	// choose the constraint solver, the grid solvers fall back to edges for cloth not built as a grid
+	void setSolver(Solver solver)
+	{
+		this->solver = solver;
+	}
+
+	// let connected parts of the cloth that came to rest skip integration, constraints and collision until a
+	// collider moves near them or a particle is grabbed. only the edge solver skips them, the grid solvers
+	// keep everything awake
+	void setSleeping(bool sleeping)
+	{
+		this->sleeping = sleeping;
+	}
+
+	// constraint iterations per step, more of them make the cloth stiffer and the step slower
+	void setIterations(unsigned int iterations)
+	{
+		solverIterations = iterations;
+	}
+
+	unsigned int getIterations()
+	{
+		return solverIterations;
+	}
+
+	// hook(done) after every constraint iteration of a step with the number done so far, the tiled solver
+	// calls it once per TILE_DEPTH of them. constraintError() called from it measures that iterate
+	void setIterationHook(function<void(unsigned int)> hook)
+	{
+		iterationHook = hook;
+	}
+
+	// stretch of the edges relative to their rest length, root mean square and largest
+	void constraintError(float& rms, float& largest)
+	{
+		double sum = 0.0;
+		largest = 0.0f;
+		for (unsigned int i = 0; i < edges.size(); i++)
 		{
-			if (i == 0 || i == (rows - 1) * cols)
-				continue;
-			vels[i] = vels[i] + g * dt;
-			vels[i] = vels[i] * damping;
-			vertices[i].Position = vertices[i].Position + vels[i] * dt;
+			float error = fabs(glm::distance(position(edges[i].indice_x), position(edges[i].indice_y)) - lengths[i]) / lengths[i];
+			sum += (double)error * error;
+			largest = max(largest, error);
+		}
+		rms = edges.empty() ? 0.0f : (float)sqrt(sum / edges.size());
+	}
+
+	// particles in blocks that are awake
+	unsigned int awakeParticles()
+	{
+		unsigned int count = 0;
+		for (unsigned int b = 0; b < blockQuiet.size(); b++)
+			if (!isAsleep(b))
+				count += blockEnd(b) - blockBegin(b);
+		return count;
+	}
+
+	// updates done so far
+	unsigned int stepCount()
+	{
+		return steps;
+	}
+
+	// step in which positions or normals of every block of SLEEP_BLOCK particles last changed, 0 if never
+	const vector<unsigned int>& getBlockChanges()
+	{
+		return blockChanged;
+	}
+
+	// whether a block changed after step since
+	bool changedSince(unsigned int since)
+	{
+		for (unsigned int b = 0; b < blockChanged.size(); b++)
+			if (blockChanged[b] > since)
+				return true;
+		return false;
+	}
+
+	// bytes snapshot() appends
+	size_t snapshotSize()
+	{
+		return snapshotSize(lastContacts.size());
+	}
+
+	// append the complete state to blob: positions, velocities, pins, solver and iteration count and sleeping state.
+	// the topology isn't included, a snapshot restores into a cloth built from the same mesh. colliders
+	// are stored as indices into colliders, the current contacts if NULL
+	void snapshot(vector<char>& blob, const vector<Sphere*>* colliders = NULL)
+	{
+		MEMORY_SCOPE(MEMORY_IO, this);
+		if (!colliders)
+			colliders = &contacts;
+		size_t at = blob.size();
+		blob.resize(at + snapshotSize(), 0);
+		ClothSnapshot header = { { 'P', 'B', 'D', 'S' }, SNAPSHOT_VERSION, (unsigned int)snapshotSize(),
+			particleCount(), (unsigned int)edges.size(), (unsigned int)blockAsleep.size(), (unsigned int)solver, sleeping,
+			solverIterations, (unsigned int)lastContacts.size() };
+		memcpy(&blob[at], &header, sizeof(header));
+		at += align(sizeof(ClothSnapshot));
+		forEachSection([&](void* data, size_t bytes) {
+			memcpy(&blob[at], data, bytes);
+			at += align(bytes);
+		});
+		for (unsigned int k = 0; k < lastContacts.size(); k++, at += sizeof(ContactSnapshot))
+		{
+			ContactSnapshot contact = { (unsigned int)(find(colliders->begin(), colliders->end(), lastContacts[k].first) - colliders->begin()),
+				lastContacts[k].second };
+			memcpy(&blob[at], &contact, sizeof(contact));
+		}
+	}
+
+	// whether the snapshot is from a cloth with the same topology
+	bool canRestore(const char* blob, size_t size)
+	{
+		ClothSnapshot header;
+		if (size < sizeof(header))
+			return false;
+		memcpy(&header, blob, sizeof(header));
+		return memcmp(header.magic, "PBDS", 4) == 0 && header.version == SNAPSHOT_VERSION && header.size <= size &&
+			header.size == snapshotSize(header.contacts) && header.particles == particleCount() && header.edges == edges.size() &&
+			header.blocks == blockAsleep.size();
+	}
+
+	// go back to a snapshot, false if it is from a cloth of another topology. the sections are copied
+	// as they are, so the snapshot can be used straight from a mapped file. colliders as for snapshot()
+	bool restore(const char* blob, size_t size, const vector<Sphere*>* colliders = NULL)
+	{
+		if (!canRestore(blob, size))
+			return false;
+		if (!colliders)
+			colliders = &contacts;
+		ClothSnapshot header;
+		memcpy(&header, blob, sizeof(header));
+		solver = (Solver)header.solver;
+		sleeping = header.sleeping != 0;
+		solverIterations = header.iterations;
+		size_t at = align(sizeof(ClothSnapshot));
+		forEachSection([&](void* data, size_t bytes) {
+			memcpy(data, blob + at, bytes);
+			at += align(bytes);
+		});
+		// colliders that are gone count as moved away, the next step wakes the islands near them
+		lastContacts.clear();
+		for (unsigned int k = 0; k < header.contacts; k++, at += sizeof(ContactSnapshot))
+		{
+			ContactSnapshot contact;
+			memcpy(&contact, blob + at, sizeof(contact));
+			if (contact.collider < colliders->size())
+				lastContacts.push_back({ (*colliders)[contact.collider], contact.place });
 		}
-		for (unsigned int i = 0; i < iteration; i++)
-			pbdConstraint();
-		handleCollision(sphere);
-		// update mesh
+
+		// sleeping particles keep their position in both buffers and every block counts as changed so
+		// the renderer uploads all of them again
+		memcpy(nextVertices.data(), vertices.data(), vertices.size() * sizeof(Vertex));
+		grabbed = -1;
+		steps++;
+		blockChanged.assign(blockChanged.size(), steps);
+		return true;
+	}
+
+	// upload simulated positions for rendering, the mesh belongs to the render thread
+	void updateMesh(const vector<Vertex>& vertices)
+	{
+		MEMORY_SCOPE(MEMORY_MESH, this);
 		mesh.updateVertices(vertices);
 	}
 
+	const SimVector<Vertex>& getVertices()
+	{
+		return vertices;
+	}
+
+	// triangles in the simulation order of the particles
+	const vector<unsigned int>& getIndices()
+	{
+		return indices;
+	}
+
+	// vertex normals of the current positions, only computed on request as the solver never needs them.
+	// blocks that didn't change since the last call keep theirs
+	void computeNormals()
+	{
+		changedBlocks.clear();
+		for (unsigned int b = 0; b < blockChanged.size(); b++)
+			if (normalsAt == UINT_MAX || blockChanged[b] > normalsAt)
+				changedBlocks.push_back(b);
+		normalsAt = steps;
+		if (changedBlocks.size() == blockChanged.size())
+		{
+			parallelFor("face normals", faceNormals.size(), PARTICLE_GRAIN, [this](unsigned int begin, unsigned int end) {
+				computeFaceNormals(begin, end);
+			});
+			parallelFor("vertex normals", normals.size(), PARTICLE_GRAIN, [this](unsigned int begin, unsigned int end) {
+				gatherVertexNormals(begin, end);
+			});
+			return;
+		}
+
+		// a triangle is computed with the block of its first corner, islands change as a whole so
+		// its other corners changed too
+		parallelFor("face normals", changedBlocks.size(), PARTICLE_GRAIN / SLEEP_BLOCK, [this](unsigned int begin, unsigned int end) {
+			for (unsigned int k = begin; k < end; k++)
+				for (unsigned int i = blockBegin(changedBlocks[k]); i < blockEnd(changedBlocks[k]); i++)
+					for (unsigned int t = vertexTriOffsets[i]; t < vertexTriOffsets[i + 1]; t++)
+						if (indices[3 * vertexTris[t]] == i)
+							computeFaceNormals(vertexTris[t], vertexTris[t] + 1);
+		});
+		parallelFor("vertex normals", changedBlocks.size(), PARTICLE_GRAIN / SLEEP_BLOCK, [this](unsigned int begin, unsigned int end) {
+			for (unsigned int k = begin; k < end; k++)
+				gatherVertexNormals(blockBegin(changedBlocks[k]), blockEnd(changedBlocks[k]));
+		});
+	}
+
+	const SimVector<Normal>& getNormals()
+	{
+		return normals;
+	}
+
+	void updateMeshNormals(const vector<Normal>& normals)
+	{
+		MEMORY_SCOPE(MEMORY_MESH, this);
+		mesh.updateNormals(normals);
+	}
+
+	// positions and normals (if wanted) in the compact render format, see packVertices(). packed already
+	// holding the cloth of step since with the same bounds only gets the blocks changed after it, -1 packs all
+	void packVertices(vector<PackedVertex>& packed, glm::vec3& boundsMin, glm::vec3& boundsExtent, bool withNormals, int since = -1)
+	{
+		MEMORY_SCOPE(MEMORY_MESH, this);
+		glm::vec3 boxMin, boxMax;
+		computeBounds(boxMin, boxMax);
+		glm::vec3 extent = glm::max(boxMax - boxMin, glm::vec3(1e-6f));
+		bool all = since < 0 || packed.size() != vertices.size() || boxMin != boundsMin || extent != boundsExtent;
+		changedBlocks.clear();
+		for (unsigned int b = 0; b < blockChanged.size() && !all; b++)
+			if (blockChanged[b] > (unsigned int)since)
+				changedBlocks.push_back(b);
+		boundsMin = boxMin;
+		boundsExtent = extent;
+
+		packed.resize(vertices.size());
+		SimVector<Normal> none;
+		const SimVector<Normal>& source = withNormals ? normals : none;
+		if (all)
+			parallelFor("pack", vertices.size(), PARTICLE_GRAIN, [&](unsigned int begin, unsigned int end) {
+				packVertexRange(vertices, source, packed, boundsMin, boundsExtent, begin, end);
+			});
+		else
+			parallelFor("pack", changedBlocks.size(), PARTICLE_GRAIN / SLEEP_BLOCK, [&](unsigned int begin, unsigned int end) {
+				for (unsigned int k = begin; k < end; k++)
+					packVertexRange(vertices, source, packed, boundsMin, boundsExtent, blockBegin(changedBlocks[k]), blockEnd(changedBlocks[k]));
+			});
+	}
+
+	void updateMeshPacked(const vector<PackedVertex>& packed, glm::vec3 boundsMin, glm::vec3 boundsExtent)
+	{
+		MEMORY_SCOPE(MEMORY_MESH, this);
+		mesh.updatePackedVertices(packed, boundsMin, boundsExtent);
+	}
+
+	// upload only particle ranges given as begin, end pairs, see changedRanges()
+	void updateMeshRanges(const vector<Vertex>& vertices, const vector<unsigned int>& ranges)
+	{
+		MEMORY_SCOPE(MEMORY_MESH, this);
+		mesh.updateVertexRanges(vertices, ranges);
+	}
+
+	void updateMeshNormalRanges(const vector<Normal>& normals, const vector<unsigned int>& ranges)
+	{
+		MEMORY_SCOPE(MEMORY_MESH, this);
+		mesh.updateNormalRanges(normals, ranges);
+	}
+
+	void updateMeshPackedRanges(const vector<PackedVertex>& packed, glm::vec3 boundsMin, glm::vec3 boundsExtent, const vector<unsigned int>& ranges)
+	{
+		MEMORY_SCOPE(MEMORY_MESH, this);
+		mesh.updatePackedRanges(packed, boundsMin, boundsExtent, ranges);
+	}
+
+	// particle ranges as begin, end pairs of the blocks in blockChanged (see getBlockChanges()) that
+	// changed after step since, for uploading from a copy on another thread
+	static void changedRanges(const vector<unsigned int>& blockChanged, unsigned int since, unsigned int particles, vector<unsigned int>& ranges)
+	{
+		ranges.clear();
+		for (unsigned int b = 0; b < blockChanged.size(); b++)
+		{
+			if (blockChanged[b] <= since)
+				continue;
+			unsigned int begin = b * SLEEP_BLOCK, end = min((b + 1) * SLEEP_BLOCK, particles);
+			if (!ranges.empty() && ranges.back() == begin)
+				ranges.back() = end;
+			else
+			{
+				ranges.push_back(begin);
+				ranges.push_back(end);
+			}
+		}
+	}
+
+	// nearest particle of the triangle hit by the ray, -1 if the cloth is missed
+	int pick(const Ray& ray, float& t)
+	{
+		// built on the first pick, large meshes load faster and most cloths are never picked
+		MEMORY_SCOPE(MEMORY_CLOTH_STATE, this);
+		if (bvh.empty())
+			bvh.build(vertices, indices);
+		else
+			bvh.refit(vertices, indices);
+		unsigned int tri = 0;
+		float u = 0.0f, v = 0.0f;
+		if (!bvh.intersect(vertices, indices, ray, tri, t, u, v))
+			return -1;
+		float w = 1.0f - u - v;
+		if (w >= u && w >= v)
+			return indices[3 * tri];
+		return u >= v ? indices[3 * tri + 1] : indices[3 * tri + 2];
+	}
+
+	// hold a particle in place until release(), it is moved with drag()
+	void grab(int index)
+	{
+		release();
+		grabbed = index;
+		grab_target = vertices[index].Position;
+	}
+
+	void drag(glm::vec3 dir)
+	{
+		grab_target += dir;
+	}
+
+	void release()
+	{
+		grabbed = -1;
+	}
+
+	// fix a particle given by its index in the source mesh
+	void pin(unsigned int external)
+	{
+		pinned[toInternal(external)] = 1;
+	}
+
+	unsigned int toInternal(unsigned int external)
+	{
+		return inversePermutation.empty() ? external : inversePermutation[external];
+	}
+
+	unsigned int toExternal(unsigned int internal)
+	{
+		return permutation.empty() ? internal : permutation[internal];
+	}
+
+	// simulated L1 misses of one constraint sweep over the particle positions
+	unsigned int cacheMissesPerIteration()
+	{
+		vector<unsigned int> endpoints;
+		for (unsigned int i = 0; i < edges.size(); i++)
+		{
+			endpoints.push_back(edges[i].indice_x);
+			endpoints.push_back(edges[i].indice_y);
+		}
+		return estimateCacheMisses(endpoints, sizeof(Vertex));
+	}
+
+	// pinned is never swapped like the position buffers, so other threads may ask while the cloth steps
+	unsigned int particleCount()
+	{
+		return pinned.size();
+	}
+
+	// bounding box of the particles
+	void computeBounds(glm::vec3& lo, glm::vec3& hi)
+	{
+		// bounds of every chunk, merged afterwards
+		unsigned int chunks = (vertices.size() + PARTICLE_GRAIN - 1) / PARTICLE_GRAIN;
+		SimVector<glm::vec3> chunkLo(chunks, glm::vec3(FLT_MAX), scratch.get());
+		SimVector<glm::vec3> chunkHi(chunks, glm::vec3(-FLT_MAX), scratch.get());
+		parallelFor("bounds", chunks, 1, [&](unsigned int begin, unsigned int end) {
+			for (unsigned int c = begin; c < end; c++)
+				for (unsigned int i = c * PARTICLE_GRAIN; i < min((c + 1) * PARTICLE_GRAIN, (unsigned int)vertices.size()); i++)
+				{
+					chunkLo[c] = glm::min(chunkLo[c], vertices[i].Position);
+					chunkHi[c] = glm::max(chunkHi[c], vertices[i].Position);
+				}
+		});
+		lo = glm::vec3(FLT_MAX);
+		hi = glm::vec3(-FLT_MAX);
+		for (unsigned int c = 0; c < chunks; c++)
+		{
+			lo = glm::min(lo, chunkLo[c]);
+			hi = glm::max(hi, chunkHi[c]);
+		}
+	}
+
+	bool isPinned(unsigned int i)
+	{
+		return pinned[i] || (int)i == grabbed;
+	}
+
+	const BuildTiming& getBuildTiming()
+	{
+		return buildTiming;
+	}
+
 	~Cloth()
 	{
 		mesh.Delete();
+#ifdef PBD_MEMORY
+		// the members are freed after this, still charged to the cloth
+		MemoryTracker::release(this);
+#endif
 	}
 
 private:
 	// cloth data
-	vector<Vertex> vertices;
-	vector<Velocity> vels;
-	vector<Edge> edges;
-	vector<float> lengths;
+	// simulation state, moved into one arena block once the topology is built
+	unique_ptr<Arena> state;
+	SimVector<Vertex> vertices;
+	SimVector<Velocity> vels;
+	SimVector<Edge> edges;
+	SimVector<float> lengths;
 	//vector<Force> forces;
-	vector<Normal> normals;
+	SimVector<Normal> normals; // per vertex
+	SimVector<Normal> faceNormals; // per triangle, scaled by twice the area
+	SimVector<unsigned int> vertexTriOffsets; // triangles around vertex i are vertexTris[vertexTriOffsets[i]..vertexTriOffsets[i + 1])
+	SimVector<unsigned int> vertexTris;
+	SimVector<unsigned int> vertexEdgeOffsets; // edges at vertex i are vertexEdges[vertexEdgeOffsets[i]..vertexEdgeOffsets[i + 1]) in edge order,
+	SimVector<unsigned int> vertexEdges; // stored as 2 * edge + 1 if the vertex is the second particle of the edge
+	SimVector<unsigned char> pinned;
+	vector<unsigned int> indices;
+	vector<unsigned int> permutation; // source index of every particle, empty if not reordered
+	vector<unsigned int> inversePermutation;
+	BVH bvh; // for picking
+	int grabbed = -1;
+	glm::vec3 grab_target;
 	Mesh mesh;
 	unsigned int rows, cols;
 	float dt;
+	Solver solver = SOLVER_EDGES;
+	unsigned int solverIterations = iteration;
+	function<void(unsigned int)> iterationHook;
+	const Vec3Array* stencilIterate = NULL; // positions of the stencil solver while it calls the iteration hook
+	Scheduler* scheduler = NULL;
+	vector<Sphere*> contacts; // colliders tested in this step
+	unsigned int steps = 0;
+	BuildTiming buildTiming;
+
+	// sleeping state per block of SLEEP_BLOCK particles. blocks connected by edges form an island that
+	// sleeps and wakes as a whole, a hanging cloth sags a little every step and is pulled back by its
+	// edges, so a frozen part of it would drag on the rest
+	bool sleeping = false;
+	vector<unsigned int> blockQuiet; // quiet steps in a row
+	vector<unsigned char> blockAsleep;
+	vector<float> blockResidual; // largest edge stretch after the last step
+	vector<glm::vec3> blockLo, blockHi; // bounds of sleeping blocks
+	vector<unsigned int> blockChanged;
+	unsigned int normalsAt = UINT_MAX; // step of the last computeNormals(), UINT_MAX before the first
+	vector<unsigned int> changedBlocks; // blocks computeNormals() and packVertices() update
+	vector<unsigned int> blockEdgeOffsets; // edges starting in block b are [blockEdgeOffsets[b], blockEdgeOffsets[b + 1])
+	vector<unsigned int> blockIsland;
+	vector<unsigned int> islandOffsets; // blocks of island k are islandBlocks[islandOffsets[k]..islandOffsets[k + 1])
+	vector<unsigned int> islandBlocks;
+	vector<unsigned int> awakeBlocks; // simulated in this step
+	vector<pair<Sphere*, glm::vec4>> lastContacts; // colliders of the last step with origin and radius
+	vector<pair<Sphere*, glm::vec4>> currentContacts; // the same for this step, swapped with lastContacts to keep both allocated
+
+	// per step temporaries, reset at the start of every update
+	unique_ptr<Arena> scratch{ new Arena() };
+
+	// positions after a Jacobi iteration
+	SimVector<Vertex> nextVertices;
+
+	// tiled solver data, rest length of the edge to the right, down and down-right neighbor of each particle
+	SimVector<float> restRight, restDown, restDiag;
+	SimVector<Velocity> nextVels;
+	vector<TileScratch> tileScratch = vector<TileScratch>(1);
+
+	// stencil solver data, positions of the current and next iteration
+	Vec3Array stencilPos[2];
+	vector<StencilScratch> stencilScratch = vector<StencilScratch>(1);
+
+	// run body(begin, end) over [0, count) on the scheduler, or at once without one
+	template <typename F>
+	void parallelFor(const char* name, unsigned int count, unsigned int grain, const F& body)
+	{
+		PROFILE_PHASE(name, vertices.size());
+		if (scheduler)
+			scheduler->parallelFor(name, 0, count, grain, body);
+		else
+			body(0, count);
+	}
+
+	static size_t align(size_t bytes)
+	{
+		return (bytes + SNAPSHOT_ALIGNMENT - 1) / SNAPSHOT_ALIGNMENT * SNAPSHOT_ALIGNMENT;
+	}
+
+	size_t snapshotSize(unsigned int contactCount)
+	{
+		size_t size = align(sizeof(ClothSnapshot));
+		forEachSection([&size](void*, size_t bytes) {
+			size += align(bytes);
+		});
+		return size + align(contactCount * sizeof(ContactSnapshot));
+	}
+
+	// visit(data, bytes) for every part of the state in a snapshot
+	template <typename F>
+	void forEachSection(const F& visit)
+	{
+		visit(vertices.data(), vertices.size() * sizeof(Vertex));
+		visit(vels.data(), vels.size() * sizeof(Velocity));
+		visit(pinned.data(), pinned.size());
+		visit(blockQuiet.data(), blockQuiet.size() * sizeof(unsigned int));
+		visit(blockAsleep.data(), blockAsleep.size());
+		visit(blockResidual.data(), blockResidual.size() * sizeof(float));
+		visit(blockLo.data(), blockLo.size() * sizeof(glm::vec3));
+		visit(blockHi.data(), blockHi.size() * sizeof(glm::vec3));
+	}
+
+	// current position of particle i, also while the stencil solver iterates on its own arrays
+	glm::vec3 position(unsigned int i)
+	{
+		if (stencilIterate)
+			return glm::vec3(stencilIterate->x[i], stencilIterate->y[i], stencilIterate->z[i]);
+		return vertices[i].Position;
+	}
+
+	unsigned int workerIndex()
+	{
+		return scheduler ? scheduler->workerIndex() : 0;
+	}
+
+	// one time step, colliders are the contacts unless a broadphase is given to find them
+	void step(float deltaTime, const Broadphase* broadphase)
+	{
+		PROFILE_PHASE("cloth step", vertices.size());
+		MEMORY_SCOPE(MEMORY_SOLVER_SCRATCH, this);
+		dt = deltaTime;
+		steps++;
+		scratch->reset();
+		if (grabbed >= 0)
+		{
+			vertices[grabbed].Position = grab_target;
+			vels[grabbed] = glm::vec3(0.0f);
+			wakeIsland(blockIsland[grabbed / SLEEP_BLOCK]);
+		}
+		collectBlocks();
+		forEachAwake("integrate", [this](unsigned int i) {
+			if (isPinned(i))
+				return;
+			vels[i] = vels[i] + g * dt;
+			vels[i] = vels[i] * damping;
+			vertices[i].Position = vertices[i].Position + vels[i] * dt;
+		});
+		if (solver == SOLVER_TILED && rows > 0)
+			pbdConstraintTiled(solverIterations);
+		else if (solver == SOLVER_STENCIL && rows > 0)
+			pbdConstraintStencil(solverIterations);
+		else
+		{
+			SimVector<glm::vec3> corrections(edges.size(), scratch.get());
+			for (unsigned int i = 0; i < solverIterations; i++)
+			{
+				PROFILE_PHASE("solver iteration", vertices.size());
+				pbdConstraint(corrections);
+				if (iterationHook)
+					iterationHook(i + 1);
+			}
+		}
+		if (broadphase)
+		{
+			glm::vec3 lo, hi;
+			computeBounds(lo, hi);
+			broadphase->query(lo, hi, contacts);
+		}
+		if (canSleep())
+			wakeByContacts();
+		handleCollision();
+		updateSleep();
+	}
+
+	bool canSleep()
+	{
+		return sleeping && (rows == 0 || solver == SOLVER_EDGES);
+	}
+
+	bool isAsleep(unsigned int b)
+	{
+		return blockAsleep[b];
+	}
+
+	unsigned int blockBegin(unsigned int b)
+	{
+		return b * SLEEP_BLOCK;
+	}
+
+	unsigned int blockEnd(unsigned int b)
+	{
+		return min((b + 1) * SLEEP_BLOCK, (unsigned int)vertices.size());
+	}
+
+	// body(i) for every particle of the awake blocks
+	template <typename F>
+	void forEachAwake(const char* name, const F& body)
+	{
+		parallelFor(name, awakeBlocks.size(), PARTICLE_GRAIN / SLEEP_BLOCK, [&](unsigned int begin, unsigned int end) {
+			for (unsigned int k = begin; k < end; k++)
+				for (unsigned int i = blockBegin(awakeBlocks[k]); i < blockEnd(awakeBlocks[k]); i++)
+					body(i);
+		});
+	}
+
+	// the blocks simulated in this step, islands are closed under edges so their edges are all awake too
+	void collectBlocks()
+	{
+		bool all = !canSleep();
+		awakeBlocks.clear();
+		for (unsigned int b = 0; b < blockAsleep.size(); b++)
+		{
+			if (all && blockAsleep[b])
+				wakeIsland(blockIsland[b]);
+			if (!blockAsleep[b])
+				awakeBlocks.push_back(b);
+		}
+	}
+
+	void wakeIsland(unsigned int island)
+	{
+		for (unsigned int k = islandOffsets[island]; k < islandOffsets[island + 1]; k++)
+		{
+			blockAsleep[islandBlocks[k]] = 0;
+			blockQuiet[islandBlocks[k]] = 0;
+		}
+	}
+
+	// a collider that appeared, moved or went away wakes the sleeping islands near its old and new place,
+	// they are collided in this step already and simulated from the next one
+	void wakeByContacts()
+	{
+		vector<pair<Sphere*, glm::vec4>>& current = currentContacts;
+		current.clear();
+		for (unsigned int k = 0; k < contacts.size(); k++)
+			current.push_back({ contacts[k], glm::vec4(contacts[k]->getOrigin(), contacts[k]->getRadius()) });
+
+		bool woken = false;
+		auto wakeNear = [&](const vector<pair<Sphere*, glm::vec4>>& moved, const vector<pair<Sphere*, glm::vec4>>& other) {
+			for (unsigned int k = 0; k < moved.size(); k++)
+			{
+				if (find(other.begin(), other.end(), moved[k]) != other.end())
+					continue;
+				glm::vec3 origin(moved[k].second);
+				float reach = moved[k].second.w + SLEEP_MARGIN;
+				for (unsigned int b = 0; b < blockAsleep.size(); b++)
+				{
+					glm::vec3 nearest = glm::clamp(origin, blockLo[b], blockHi[b]);
+					if (blockAsleep[b] && glm::length(nearest - origin) <= reach)
+					{
+						wakeIsland(blockIsland[b]);
+						woken = true;
+					}
+				}
+			}
+		};
+		wakeNear(current, lastContacts);
+		wakeNear(lastContacts, current);
+		lastContacts.swap(current);
+		if (woken)
+			collectBlocks();
+	}
+
+	// remember which blocks changed, then count quiet steps of the awake blocks and put islands
+	// to sleep once all their blocks are quiet
+	void updateSleep()
+	{
+		for (unsigned int k = 0; k < awakeBlocks.size(); k++)
+			blockChanged[awakeBlocks[k]] = steps;
+		if (!canSleep())
+			return;
+
+		parallelFor("sleep check", awakeBlocks.size(), 1, [&](unsigned int begin, unsigned int end) {
+			for (unsigned int k = begin; k < end; k++)
+			{
+				unsigned int b = awakeBlocks[k];
+				float energy = 0.0f;
+				for (unsigned int i = blockBegin(b); i < blockEnd(b); i++)
+					energy += 0.5f * glm::dot(vels[i], vels[i]);
+				energy /= blockEnd(b) - blockBegin(b);
+				float residual = 0.0f;
+				for (unsigned int e = blockEdgeOffsets[b]; e < blockEdgeOffsets[b + 1]; e++)
+				{
+					float len = glm::length(vertices[edges[e].indice_x].Position - vertices[edges[e].indice_y].Position);
+					residual = max(residual, fabs(len - lengths[e]));
+				}
+				bool quiet = energy < SLEEP_ENERGY && fabs(residual - blockResidual[b]) < SLEEP_RESIDUAL;
+				blockResidual[b] = residual;
+				blockQuiet[b] = quiet ? min(blockQuiet[b] + 1, (unsigned int)SLEEP_FRAMES) : 0;
+			}
+		});
+
+		for (unsigned int island = 0; island + 1 < islandOffsets.size(); island++)
+		{
+			bool quiet = true;
+			for (unsigned int k = islandOffsets[island]; k < islandOffsets[island + 1]; k++)
+				quiet = quiet && !blockAsleep[islandBlocks[k]] && blockQuiet[islandBlocks[k]] >= SLEEP_FRAMES;
+			if (quiet)
+				for (unsigned int k = islandOffsets[island]; k < islandOffsets[island + 1]; k++)
+					fallAsleep(islandBlocks[k]);
+		}
+	}
+
+	// sleeping particles hold still in both position buffers so the solver can leave them alone
+	void fallAsleep(unsigned int b)
+	{
+		blockAsleep[b] = 1;
+		blockLo[b] = glm::vec3(FLT_MAX);
+		blockHi[b] = glm::vec3(-FLT_MAX);
+		for (unsigned int i = blockBegin(b); i < blockEnd(b); i++)
+		{
+			vels[i] = Velocity(0.0f);
+			nextVertices[i].Position = vertices[i].Position;
+			blockLo[b] = glm::min(blockLo[b], vertices[i].Position);
+			blockHi[b] = glm::max(blockHi[b], vertices[i].Position);
+		}
+	}
+
+	// edge ranges of the blocks, edges are sorted by their first particle, and the islands of blocks
+	// connected by edges
+	void buildBlocks()
+	{
+		unsigned int count = (vertices.size() + SLEEP_BLOCK - 1) / SLEEP_BLOCK;
+		blockQuiet.assign(count, 0);
+		blockAsleep.assign(count, 0);
+		blockResidual.assign(count, 0.0f);
+		blockLo.assign(count, glm::vec3(0.0f));
+		blockHi.assign(count, glm::vec3(0.0f));
+		blockChanged.assign(count, 0);
+
+		blockEdgeOffsets.assign(count + 1, 0);
+		for (unsigned int i = 0; i < edges.size(); i++)
+			blockEdgeOffsets[edges[i].indice_x / SLEEP_BLOCK + 1]++;
+		for (unsigned int b = 0; b < count; b++)
+			blockEdgeOffsets[b + 1] += blockEdgeOffsets[b];
+
+		// union find over the blocks, then number the roots
+		vector<unsigned int> parent(count);
+		for (unsigned int b = 0; b < count; b++)
+			parent[b] = b;
+		auto root = [&parent](unsigned int b) {
+			while (parent[b] != b)
+				b = parent[b] = parent[parent[b]];
+			return b;
+		};
+		for (unsigned int i = 0; i < edges.size(); i++)
+			parent[root(edges[i].indice_x / SLEEP_BLOCK)] = root(edges[i].indice_y / SLEEP_BLOCK);
+
+		vector<unsigned int> number(count, UINT_MAX);
+		blockIsland.resize(count);
+		unsigned int islands = 0;
+		for (unsigned int b = 0; b < count; b++)
+		{
+			unsigned int r = root(b);
+			if (number[r] == UINT_MAX)
+				number[r] = islands++;
+			blockIsland[b] = number[r];
+		}
+		islandOffsets.assign(islands + 1, 0);
+		for (unsigned int b = 0; b < count; b++)
+			islandOffsets[blockIsland[b] + 1]++;
+		for (unsigned int k = 0; k < islands; k++)
+			islandOffsets[k + 1] += islandOffsets[k];
+		vector<unsigned int> fill(islandOffsets.begin(), islandOffsets.end() - 1);
+		islandBlocks.resize(count);
+		for (unsigned int b = 0; b < count; b++)
+			islandBlocks[fill[blockIsland[b]]++] = b;
+	}
+
+	// edges, rest lengths, render mesh and adjacency from the triangles
+	static double seconds(chrono::steady_clock::time_point since)
+	{
+		return chrono::duration<double>(chrono::steady_clock::now() - since).count();
+	}
+
+	void buildTopology()
+	{
+		chrono::steady_clock::time_point start = chrono::steady_clock::now(), phase = start;
+		vector<Edge> duplicate_edges;
+		for (unsigned int i = 0; i < indices.size(); i += 3)
+			for (unsigned int k = 0; k < 3; k++)
+			{
+				unsigned int a = indices[i + k];
+				unsigned int b = indices[i + (k + 1) % 3];
+				duplicate_edges.push_back({ min(a, b), max(a, b) });
+			}
+
+		// remove duplicated edge, this also sorts edges by their first particle
+		edgeDuplicateRemoval(duplicate_edges);
+		buildTiming.edges = seconds(phase);
+		phase = chrono::steady_clock::now();
+
+		{
+			MEMORY_SUBSYSTEM(MEMORY_MESH);
+			vector<Texture> textures; // now is empty
+			mesh = Mesh(vector<Vertex>(vertices.begin(), vertices.end()), indices, textures, true);
+
+			// wireframe draws the constraint edges
+			vector<unsigned int> lines;
+			for (unsigned int i = 0; i < edges.size(); i++)
+			{
+				lines.push_back(edges[i].indice_x);
+				lines.push_back(edges[i].indice_y);
+			}
+			mesh.setLines(lines);
+		}
+		buildTiming.mesh = seconds(phase);
+		phase = chrono::steady_clock::now();
+
+		buildVertexTriangles();
+		buildVertexEdges();
+		buildBlocks();
+		faceNormals.resize(indices.size() / 3);
+		normals.resize(vertices.size(), Normal(0.0f, 1.0f, 0.0f));
+		nextVertices.resize(vertices.size());
+
+		// buffers of the grid solvers
+		if (rows > 0)
+		{
+			buildGridRestLengths();
+			nextVels.resize(vels.size());
+		}
+		buildTiming.adjacency = seconds(phase);
+		phase = chrono::steady_clock::now();
+
+		moveToArena();
+		buildTiming.arena = seconds(phase);
+		buildTiming.total = buildTiming.reorder + seconds(start);
+	}
+
+	// copy all state into a single 64 byte aligned block, on huge pages when it spans at least one
+	void moveToArena()
+	{
+		size_t bytes = 0;
+		auto add = [&bytes](const auto& v) {
+			bytes += (v.size() * sizeof(v[0]) + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+		};
+		add(vertices); add(vels); add(edges); add(lengths); add(normals); add(faceNormals);
+		add(vertexTriOffsets); add(vertexTris); add(vertexEdgeOffsets); add(vertexEdges); add(pinned);
+		add(restRight); add(restDown); add(restDiag); add(nextVertices); add(nextVels);
+
+		state.reset(new Arena(bytes, bytes >= HUGE_PAGE_SIZE));
+		Arena* arena = state.get();
+		vertices = arenaCopy<Vertex>(vertices, arena);
+		vels = arenaCopy<Velocity>(vels, arena);
+		edges = arenaCopy<Edge>(edges, arena);
+		lengths = arenaCopy<float>(lengths, arena);
+		normals = arenaCopy<Normal>(normals, arena);
+		faceNormals = arenaCopy<Normal>(faceNormals, arena);
+		vertexTriOffsets = arenaCopy<unsigned int>(vertexTriOffsets, arena);
+		vertexTris = arenaCopy<unsigned int>(vertexTris, arena);
+		vertexEdgeOffsets = arenaCopy<unsigned int>(vertexEdgeOffsets, arena);
+		vertexEdges = arenaCopy<unsigned int>(vertexEdges, arena);
+		pinned = arenaCopy<unsigned char>(pinned, arena);
+		restRight = arenaCopy<float>(restRight, arena);
+		restDown = arenaCopy<float>(restDown, arena);
+		restDiag = arenaCopy<float>(restDiag, arena);
+		nextVertices = arenaCopy<Vertex>(nextVertices, arena);
+		nextVels = arenaCopy<Velocity>(nextVels, arena);
+	}
+
+	// vertex to triangle adjacency in compressed rows, lets normals be gathered per vertex without scattering
+	void buildVertexTriangles()
+	{
+		vertexTriOffsets.assign(vertices.size() + 1, 0);
+		for (unsigned int i = 0; i < indices.size(); i++)
+			vertexTriOffsets[indices[i] + 1]++;
+		for (unsigned int i = 0; i < vertices.size(); i++)
+			vertexTriOffsets[i + 1] += vertexTriOffsets[i];
+
+		vector<unsigned int> fill(vertexTriOffsets.begin(), vertexTriOffsets.end() - 1);
+		vertexTris.resize(indices.size());
+		for (unsigned int i = 0; i < indices.size(); i++)
+			vertexTris[fill[indices[i]]++] = i / 3;
+	}
+
+	// vertex to edge adjacency, lets every particle gather its constraint corrections without scattering
+	void buildVertexEdges()
+	{
+		vertexEdgeOffsets.assign(vertices.size() + 1, 0);
+		for (unsigned int i = 0; i < edges.size(); i++)
+		{
+			vertexEdgeOffsets[edges[i].indice_x + 1]++;
+			vertexEdgeOffsets[edges[i].indice_y + 1]++;
+		}
+		for (unsigned int i = 0; i < vertices.size(); i++)
+			vertexEdgeOffsets[i + 1] += vertexEdgeOffsets[i];
+
+		vector<unsigned int> fill(vertexEdgeOffsets.begin(), vertexEdgeOffsets.end() - 1);
+		vertexEdges.resize(2 * edges.size());
+		for (unsigned int i = 0; i < edges.size(); i++)
+		{
+			vertexEdges[fill[edges[i].indice_x]++] = 2 * i;
+			vertexEdges[fill[edges[i].indice_y]++] = 2 * i + 1;
+		}
+	}
+
+	// both passes write only their own range so they can be split across threads
+	void computeFaceNormals(unsigned int begin, unsigned int end)
+	{
+		for (unsigned int i = begin; i < end; i++)
+		{
+			glm::vec3 a = vertices[indices[3 * i]].Position;
+			glm::vec3 b = vertices[indices[3 * i + 1]].Position;
+			glm::vec3 c = vertices[indices[3 * i + 2]].Position;
+			faceNormals[i] = glm::cross(b - a, c - a);
+		}
+	}
+
+	void gatherVertexNormals(unsigned int begin, unsigned int end)
+	{
+		for (unsigned int i = begin; i < end; i++)
+		{
+			Normal n(0.0f);
+			for (unsigned int k = vertexTriOffsets[i]; k < vertexTriOffsets[i + 1]; k++)
+				n += faceNormals[vertexTris[k]];
+			float len = glm::length(n);
+			normals[i] = len > 0.0f ? n / len : Normal(0.0f, 1.0f, 0.0f);
+		}
+	}
 
 	void edgeDuplicateRemoval(vector<Edge>& duplicate_edges)
 	{
-		quickSort(duplicate_edges, 0, duplicate_edges.size() - 1);
+		// bucket the edges by their first particle, then sort the few second particles of every bucket
+		vector<unsigned int> offsets(vertices.size() + 1, 0);
 		for (unsigned int i = 0; i < duplicate_edges.size(); i++)
+			offsets[duplicate_edges[i].indice_x + 1]++;
+		for (unsigned int i = 0; i < vertices.size(); i++)
+			offsets[i + 1] += offsets[i];
+		vector<unsigned int> seconds(duplicate_edges.size());
+		vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+		for (unsigned int i = 0; i < duplicate_edges.size(); i++)
+			seconds[fill[duplicate_edges[i].indice_x]++] = duplicate_edges[i].indice_y;
+		for (unsigned int x = 0; x < vertices.size(); x++)
 		{
-			if (i == 0 || duplicate_edges[i] != duplicate_edges[i - 1])
-				edges.push_back(duplicate_edges[i]);
+			sort(seconds.begin() + offsets[x], seconds.begin() + offsets[x + 1]);
+			for (unsigned int i = offsets[x]; i < offsets[x + 1]; i++)
+			{
+				if (i == offsets[x] || seconds[i] != seconds[i - 1])
+					edges.push_back({ x, seconds[i] });
+			}
 		}
 		for (unsigned int i = 0; i < edges.size(); i++)
 		{
@@ -156,84 +1211,325 @@ private:
 		}
 	}
 
-	void quickSort(vector<Edge>& duplicate_edges, int l, int r)
+	// one Jacobi iteration in two phases, the correction of every edge and then every particle summing
+	// the corrections of its edges in edge order, the same sums as scattering over the edge list.
+	// only edges of awake islands are solved and sleeping particles keep their position in both buffers
+	void pbdConstraint(SimVector<glm::vec3>& corrections)
 	{
-		if (l >= r)
-			return;
+		parallelFor("edge corrections", awakeBlocks.size(), PARTICLE_GRAIN / SLEEP_BLOCK, [&](unsigned int begin, unsigned int end) {
+			for (unsigned int k = begin; k < end; k++)
+				for (unsigned int i = blockEdgeOffsets[awakeBlocks[k]]; i < blockEdgeOffsets[awakeBlocks[k] + 1]; i++)
+				{
+					glm::vec3 px = vertices[edges[i].indice_x].Position;
+					glm::vec3 py = vertices[edges[i].indice_y].Position;
+					corrections[i] = 0.5f * (glm::length(px - py) - lengths[i]) * glm::normalize(px - py);
+				}
+		});
 
-		int st = 0;
-		int ed = r - l;
-		int mid = (r + l) / 2;
-		swap(duplicate_edges[l], duplicate_edges[mid]);
+		forEachAwake("edge gather", [&](unsigned int i) {
+			glm::vec3 p = vertices[i].Position;
+			if (isPinned(i))
+			{
+				nextVertices[i].Position = p;
+				return;
+			}
 
-		{
-			vector<Edge> temp(r - l + 1);
-			//cout << l << " " << duplicate_edges.size() << endl;
-			Edge val = duplicate_edges[l];
-			for (unsigned int i = l + 1; i <= r; i++)
+			glm::vec3 pos_sum(0.0f);
+			for (unsigned int k = vertexEdgeOffsets[i]; k < vertexEdgeOffsets[i + 1]; k++)
 			{
-				//cout << ed << " " << st << " " << i << " " << temp.size() << endl;
-				if (duplicate_edges[i] >= val)
-					temp[ed--] = duplicate_edges[i];
+				unsigned int e = vertexEdges[k];
+				if (e & 1)
+					pos_sum += p + corrections[e >> 1];
 				else
-					temp[st++] = duplicate_edges[i];
+					pos_sum += p - corrections[e >> 1];
 			}
-			//cout << st << " " << temp.size() << endl;
-			temp[st] = val;
-			for (unsigned int i = 0; i < r - l + 1; i++)
+			unsigned int cnt = vertexEdgeOffsets[i + 1] - vertexEdgeOffsets[i];
+			glm::vec3 next = (0.2f * p + pos_sum) / (0.2f + (float)cnt);
+			vels[i] = vels[i] + (1.0f / dt) * (next - p);
+			nextVertices[i].Position = next;
+		});
+		vertices.swap(nextVertices);
+	}
+
+	void buildGridRestLengths()
+	{
+		restRight.assign(vertices.size(), 0.0f);
+		restDown.assign(vertices.size(), 0.0f);
+		restDiag.assign(vertices.size(), 0.0f);
+		for (unsigned int i = 0; i < edges.size(); i++)
+		{
+			unsigned int d = edges[i].indice_y - edges[i].indice_x;
+			if (d == 1)
+				restRight[edges[i].indice_x] = lengths[i];
+			else if (d == cols)
+				restDown[edges[i].indice_x] = lengths[i];
+			else
+				restDiag[edges[i].indice_x] = lengths[i];
+		}
+	}
+
+	// Jacobi iterations with temporal blocking: every tile is loaded with a halo of TILE_DEPTH particles and
+	// iterated TILE_DEPTH times in cache, the halo shrinks by one ring per iteration so the tile interior
+	// ends up exactly as after TILE_DEPTH sweeps over the whole cloth
+	void pbdConstraintTiled(unsigned int iterations)
+	{
+		nextVertices.resize(vertices.size());
+		nextVels.resize(vels.size());
+		for (unsigned int done = 0; done < iterations; done += TILE_DEPTH)
+		{
+			PROFILE_PHASE("solver iterations", vertices.size()); // TILE_DEPTH of them at once
+			unsigned int depth = min((unsigned int)TILE_DEPTH, iterations - done);
+			// tiles only read the last positions and write their own interior, so they run in any order
+			unsigned int tileCols = (cols + TILE_SIZE - 1) / TILE_SIZE;
+			unsigned int tileRows = (rows + TILE_SIZE - 1) / TILE_SIZE;
+			parallelFor("tiles", tileRows * tileCols, 1, [&](unsigned int begin, unsigned int end) {
+				TileScratch& tile = tileScratch[workerIndex()];
+				for (unsigned int t = begin; t < end; t++)
+					solveTile(t / tileCols * TILE_SIZE, t % tileCols * TILE_SIZE, depth, tile);
+			});
+			vertices.swap(nextVertices);
+			vels.swap(nextVels);
+			if (iterationHook)
+				iterationHook(done + depth);
+		}
+	}
+
+	void solveTile(unsigned int ti, unsigned int tj, unsigned int depth, TileScratch& tile)
+	{
+		// tile plus halo, clamped to the grid
+		unsigned int i0 = ti - min(ti, depth);
+		unsigned int j0 = tj - min(tj, depth);
+		unsigned int i1 = min(ti + TILE_SIZE + depth, rows);
+		unsigned int j1 = min(tj + TILE_SIZE + depth, cols);
+		unsigned int h = i1 - i0;
+		unsigned int w = j1 - j0;
+
+		tile.pos[0].resize(h * w);
+		tile.pos[1].resize(h * w);
+		tile.vels.resize(h * w);
+		tile.sum.resize(h * w);
+		for (unsigned int li = 0; li < h; li++)
+			for (unsigned int lj = 0; lj < w; lj++)
 			{
-				//cout << i + l << " " << i << " " << temp.size() << endl;
-				duplicate_edges[i + l] = temp[i];
+				tile.pos[0][li * w + lj] = vertices[(i0 + li) * cols + j0 + lj].Position;
+				tile.vels[li * w + lj] = vels[(i0 + li) * cols + j0 + lj];
 			}
+
+		for (unsigned int k = 1; k <= depth; k++)
+		{
+			vector<glm::vec3>& cur = tile.pos[(k - 1) % 2];
+			vector<glm::vec3>& next = tile.pos[k % 2];
+			// particles whose neighbors are still valid, halo sides shrink but grid borders don't
+			unsigned int a0 = i0 == 0 ? 0 : k;
+			unsigned int a1 = i1 == rows ? h : h - k;
+			unsigned int b0 = j0 == 0 ? 0 : k;
+			unsigned int b1 = j1 == cols ? w : w - k;
+
+			// every edge once in row-major order, so each particle sums its terms in the same order as the edge sweep
+			fill(tile.sum.begin(), tile.sum.end(), glm::vec3(0.0f));
+			for (unsigned int li = a0 > 0 ? a0 - 1 : 0; li < a1; li++)
+				for (unsigned int lj = b0 > 0 ? b0 - 1 : 0; lj < b1; lj++)
+				{
+					unsigned int gidx = (i0 + li) * cols + j0 + lj;
+					unsigned int l = li * w + lj;
+					if (lj + 1 < w)
+						tileEdge(tile, cur, l, l + 1, restRight[gidx]);
+					if (li + 1 < h)
+						tileEdge(tile, cur, l, l + w, restDown[gidx]);
+					if (li + 1 < h && lj + 1 < w)
+						tileEdge(tile, cur, l, l + w + 1, restDiag[gidx]);
+				}
+
+			for (unsigned int li = a0; li < a1; li++)
+				for (unsigned int lj = b0; lj < b1; lj++)
+				{
+					unsigned int gi = i0 + li;
+					unsigned int gj = j0 + lj;
+					unsigned int l = li * w + lj;
+					glm::vec3 p = cur[l];
+					if (isPinned(gi * cols + gj))
+					{
+						next[l] = p;
+						continue;
+					}
+
+					// number of grid edges at this particle
+					unsigned int cnt = (gi > 0) + (gj > 0) + (gi < rows - 1) + (gj < cols - 1) + (gi > 0 && gj > 0) + (gi < rows - 1 && gj < cols - 1);
+					next[l] = (0.2f * p + tile.sum[l]) / (0.2f + (float)cnt);
+					tile.vels[l] = tile.vels[l] + (1.0f / dt) * (next[l] - p);
+				}
 		}
-		
-		quickSort(duplicate_edges, l, l + st - 1);
-		quickSort(duplicate_edges, l + st + 1, r);
+
+		// write back the tile interior
+		vector<glm::vec3>& result = tile.pos[depth % 2];
+		for (unsigned int gi = ti; gi < min(ti + TILE_SIZE, rows); gi++)
+			for (unsigned int gj = tj; gj < min(tj + TILE_SIZE, cols); gj++)
+			{
+				unsigned int l = (gi - i0) * w + gj - j0;
+				nextVertices[gi * cols + gj].Position = result[l];
+				nextVels[gi * cols + gj] = tile.vels[l];
+			}
 	}
 
-	void pbdConstraint()
+	// projected positions of both ends of a tile edge
+	static void tileEdge(TileScratch& tile, const vector<glm::vec3>& pos, unsigned int x, unsigned int y, float len)
 	{
-		vector<glm::vec3> pos_sum(rows * cols);
-		vector<unsigned int> cnt(rows * cols, 0);
+		glm::vec3 correction = 0.5f * (glm::length(pos[x] - pos[y]) - len) * glm::normalize(pos[x] - pos[y]);
+		tile.sum[x] += pos[x] - correction;
+		tile.sum[y] += pos[y] + correction;
+	}
 
-		for (unsigned int i = 0; i < edges.size(); i++)
+	// the grid has edges to the right, down and down-right neighbor with rest lengths given by the spacing,
+	// each row computes the corrections of its edges in contiguous loops and every particle sums
+	// the ones of its own row and the row above, nothing is looked up through an edge list
+	void pbdConstraintStencil(unsigned int iterations)
+	{
+		unsigned int n = vertices.size();
+		float restRightLen = 1.0f / (float)cols;
+		float restDownLen = 1.0f / (float)rows;
+		float restDiagLen = sqrt(restRightLen * restRightLen + restDownLen * restDownLen);
+
+		stencilPos[0].resize(n);
+		stencilPos[1].resize(n);
+		parallelFor("stencil load", n, PARTICLE_GRAIN, [this](unsigned int begin, unsigned int end) {
+			for (unsigned int i = begin; i < end; i++)
+			{
+				stencilPos[0].x[i] = vertices[i].Position.x;
+				stencilPos[0].y[i] = vertices[i].Position.y;
+				stencilPos[0].z[i] = vertices[i].Position.z;
+			}
+		});
+		// corrections are stored one slot to the right, slot 0 and cols stay zero for the borders
+		for (unsigned int t = 0; t < stencilScratch.size(); t++)
 		{
-			Edge edge = edges[i];
-			float len = lengths[i];
+			StencilScratch& row = stencilScratch[t];
+			row.right.resize(cols + 1);
+			row.right.zero();
+			for (unsigned int k = 0; k < 2; k++)
+			{
+				row.down[k].resize(cols);
+				row.diag[k].resize(cols + 1);
+				row.diag[k].zero();
+			}
+		}
 
-			Vertex vx = vertices[edge.indice_x];
-			Vertex vy = vertices[edge.indice_y];
+		// a band of rows starts by computing the corrections of the row above it, so bands are independent
+		unsigned int bandGrain = max(1u, PARTICLE_GRAIN / cols);
+		for (unsigned int it = 0; it < iterations; it++)
+		{
+			PROFILE_PHASE("solver iteration", vertices.size());
+			const Vec3Array& cur = stencilPos[it % 2];
+			Vec3Array& next = stencilPos[(it + 1) % 2];
+			parallelFor("stencil rows", rows, bandGrain, [&](unsigned int begin, unsigned int end) {
+				StencilScratch& row = stencilScratch[workerIndex()];
+				if (begin == 0)
+				{
+					row.down[0].zero();
+					row.diag[0].zero();
+				}
+				else
+				{
+					unsigned int above = (begin - 1) * cols;
+					stencilCorrections(cur, above, above + cols, cols, restDownLen, row.down[begin % 2], 0);
+					stencilCorrections(cur, above, above + cols + 1, cols - 1, restDiagLen, row.diag[begin % 2], 1);
+				}
+				for (unsigned int i = begin; i < end; i++)
+					stencilRow(cur, next, i, restRightLen, restDownLen, restDiagLen, row);
+			});
+			if (iterationHook)
+			{
+				stencilIterate = &next;
+				iterationHook(it + 1);
+				stencilIterate = NULL;
+			}
+		}
 
-			pos_sum[edge.indice_x] += vx.Position - 0.5f * (glm::length(vx.Position - vy.Position) - len) * glm::normalize(vx.Position - vy.Position);
-			pos_sum[edge.indice_y] += vy.Position + 0.5f * (glm::length(vx.Position - vy.Position) - len) * glm::normalize(vx.Position - vy.Position);
-		
-			cnt[edge.indice_x] ++;
-			cnt[edge.indice_y] ++;
+		// velocities change by the total displacement of all iterations
+		const Vec3Array& result = stencilPos[iterations % 2];
+		parallelFor("stencil store", n, PARTICLE_GRAIN, [&](unsigned int begin, unsigned int end) {
+			for (unsigned int i = begin; i < end; i++)
+			{
+				glm::vec3 p(result.x[i], result.y[i], result.z[i]);
+				vels[i] = vels[i] + (1.0f / dt) * (p - vertices[i].Position);
+				vertices[i].Position = p;
+			}
+		});
+	}
+
+	void stencilRow(const Vec3Array& cur, Vec3Array& next, unsigned int i, float restRightLen, float restDownLen, float restDiagLen, StencilScratch& row)
+	{
+		Vec3Array& downAbove = row.down[i % 2];
+		Vec3Array& diagAbove = row.diag[i % 2];
+		Vec3Array& down = row.down[(i + 1) % 2];
+		Vec3Array& diag = row.diag[(i + 1) % 2];
+		Vec3Array& right = row.right;
+		unsigned int start = i * cols;
+		stencilCorrections(cur, start, start + 1, cols - 1, restRightLen, right, 1);
+		if (i < rows - 1)
+		{
+			stencilCorrections(cur, start, start + cols, cols, restDownLen, down, 0);
+			stencilCorrections(cur, start, start + cols + 1, cols - 1, restDiagLen, diag, 1);
+		}
+		else
+		{
+			down.zero();
+			diag.zero();
 		}
 
-		for (unsigned int i = 0; i < vertices.size(); i++)
+		// edges starting at a particle pull it by -correction, edges ending at it by +correction
+		float top = i > 0 ? 1.0f : 0.0f;
+		float bottom = i < rows - 1 ? 1.0f : 0.0f;
+		for (unsigned int j = 0; j < cols; j++)
 		{
-			if (i == 0 || i == (rows - 1) * cols)
-				continue;
-			vels[i] = vels[i] + (1.0f / dt) * ((0.2f * vertices[i].Position + pos_sum[i]) / (0.2f + (float)cnt[i]) - vertices[i].Position);
-			vertices[i].Position = (0.2f * vertices[i].Position + pos_sum[i]) / (0.2f + (float)cnt[i]);
+			unsigned int idx = start + j;
+			float left = j > 0 ? 1.0f : 0.0f;
+			float rightSide = j < cols - 1 ? 1.0f : 0.0f;
+			float cnt = top + bottom + left + rightSide + top * left + bottom * rightSide;
+			float weight = isPinned(idx) ? 0.0f : 1.0f / (0.2f + cnt);
+			next.x[idx] = cur.x[idx] + weight * (right.x[j] - right.x[j + 1] + downAbove.x[j] - down.x[j] + diagAbove.x[j] - diag.x[j + 1]);
+			next.y[idx] = cur.y[idx] + weight * (right.y[j] - right.y[j + 1] + downAbove.y[j] - down.y[j] + diagAbove.y[j] - diag.y[j + 1]);
+			next.z[idx] = cur.z[idx] + weight * (right.z[j] - right.z[j + 1] + downAbove.z[j] - down.z[j] + diagAbove.z[j] - diag.z[j + 1]);
 		}
 	}
 
-	void handleCollision(Sphere* sphere)
+	// correction of edges from particle a + k to b + k for k < count, written to out[offset + k]
+	static void stencilCorrections(const Vec3Array& pos, unsigned int a, unsigned int b, unsigned int count, float rest, Vec3Array& out, unsigned int offset)
 	{
-		glm::vec3 origin = sphere->getOrigin();
-		float radius = sphere->getRadius();
-		for (unsigned int i = 0; i < vertices.size(); i++)
+		for (unsigned int k = 0; k < count; k++)
 		{
-			glm::vec3 pos = vertices[i].Position;
-			glm::vec3 origin2pos = pos - origin;
-			if (glm::length(origin2pos) < radius)
-			{
-				vertices[i].Position = origin + glm::normalize(origin2pos) * radius;
-				vels[i] = vels[i] + (1.0f / dt) * (vertices[i].Position - pos);
-			}
+			float dx = pos.x[a + k] - pos.x[b + k];
+			float dy = pos.y[a + k] - pos.y[b + k];
+			float dz = pos.z[a + k] - pos.z[b + k];
+			float len = sqrt(dx * dx + dy * dy + dz * dz);
+			float scale = 0.5f * (len - rest) / len;
+			out.x[offset + k] = scale * dx;
+			out.y[offset + k] = scale * dy;
+			out.z[offset + k] = scale * dz;
 		}
 	}
+
+	void handleCollision()
+	{
+		if (contacts.empty())
+			return;
+		parallelFor("collision", awakeBlocks.size(), PARTICLE_GRAIN / SLEEP_BLOCK, [&](unsigned int begin, unsigned int end) {
+			for (unsigned int b = begin; b < end; b++)
+				for (unsigned int k = 0; k < contacts.size(); k++)
+				{
+					glm::vec3 origin = contacts[k]->getOrigin();
+					float radius = contacts[k]->getRadius();
+					for (unsigned int i = blockBegin(awakeBlocks[b]); i < blockEnd(awakeBlocks[b]); i++)
+					{
+						glm::vec3 pos = vertices[i].Position;
+						glm::vec3 origin2pos = pos - origin;
+						if (glm::length(origin2pos) < radius)
+						{
+							vertices[i].Position = origin + glm::normalize(origin2pos) * radius;
+							vels[i] = vels[i] + (1.0f / dt) * (vertices[i].Position - pos);
+						}
+					}
+				}
+		});
+	}
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,331 @@
+#ifndef EXPORTER_H
+#define EXPORTER_H
+
+#include <glm/glm.hpp>
+
+#include "cloth.h"
+#include "lockfree.h"
+#include "memory_tracker.h"
+
+#include <atomic>
+#include <charconv>
+#include <cmath>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+#define EXPORT_QUEUE 8 // frames waiting for the disk before append() waits as well
+// longest coordinate writeFixed() writes: sign, 12 integer digits, '.' and 6 decimals, the to_chars()
+// fallback for larger values, infinities and NaN writes at most 15 ("-1.17549435e-38")
+#define OBJ_COORDINATE_CHARS 20
+#define OBJ_LINE_CHARS (1 + 3 * (1 + OBJ_COORDINATE_CHARS) + 1) // "v", three times space and coordinate, newline
+
+enum ExportFormat
+{
+	EXPORT_PLY, // binary, in the byte order of the machine
+	EXPORT_OBJ
+};
+
+// writes frames of a set of cloths to one mesh file per cloth and frame, named
+// <prefix>_<cloth>_<frame>.ply or .obj, on an I/O thread. particles are written in the order of the
+// source mesh so every file of a sequence matches the mesh the cloth was built from. the faces never
+// change and are encoded once, a frame only adds the positions and goes to disk in a few large writes
+class FrameExporter {
+public:
+	FrameExporter() = default;
+
+	FrameExporter(const FrameExporter&) = delete;
+	FrameExporter& operator=(const FrameExporter&) = delete;
+
+	~FrameExporter()
+	{
+		close();
+	}
+
+	bool open(const char* prefix, const vector<Cloth*>& cloths, ExportFormat format = EXPORT_PLY)
+	{
+		MEMORY_SUBSYSTEM(MEMORY_IO);
+		close();
+		this->prefix = prefix;
+		this->format = format;
+		frames = 0;
+		failed = false;
+
+		topologies.assign(cloths.size(), Topology());
+		unsigned int total = 0;
+		for (unsigned int c = 0; c < cloths.size(); c++)
+		{
+			Topology& topology = topologies[c];
+			Cloth* cloth = cloths[c];
+			topology.particles = cloth->particleCount();
+			topology.external.resize(topology.particles);
+			topology.internal.resize(topology.particles);
+			for (unsigned int i = 0; i < topology.particles; i++)
+			{
+				topology.external[i] = cloth->toExternal(i);
+				topology.internal[topology.external[i]] = i;
+			}
+			encodeFaces(topology, cloth->getIndices());
+			total += topology.particles;
+		}
+
+		vector<glm::vec3>* stale;
+		while (spare.pop(stale) || filled.pop(stale))
+			;
+		buffers.clear();
+		for (unsigned int i = 0; i < EXPORT_QUEUE; i++)
+		{
+			buffers.push_back(unique_ptr<vector<glm::vec3>>(new vector<glm::vec3>(total)));
+			spare.push(buffers.back().get());
+		}
+		stopping = false;
+		running = true;
+		worker = std::thread(&FrameExporter::run, this);
+		return true;
+	}
+
+	// positions of all cloths as the next frame, only waits while EXPORT_QUEUE frames are still being written
+	void append(const vector<Cloth*>& cloths)
+	{
+		if (!running)
+			return;
+		MEMORY_SUBSYSTEM(MEMORY_IO);
+		vector<glm::vec3>* buffer;
+		if (!spare.pop(buffer))
+		{
+			unique_lock<mutex> guard(lock);
+			freed.wait(guard, [&] { return spare.pop(buffer); });
+		}
+		unsigned int at = 0;
+		for (unsigned int c = 0; c < cloths.size(); c++)
+		{
+			const SimVector<Vertex>& vertices = cloths[c]->getVertices();
+			for (unsigned int i = 0; i < vertices.size(); i++)
+				(*buffer)[at++] = vertices[i].Position;
+		}
+		filled.push(buffer);
+		wake.notify_one();
+	}
+
+	// write the frames still queued
+	void close()
+	{
+		if (!running)
+			return;
+		{
+			lock_guard<mutex> guard(lock);
+			stopping = true;
+		}
+		wake.notify_one();
+		worker.join();
+		running = false;
+	}
+
+	// frames written so far
+	unsigned int frameCount()
+	{
+		return frames;
+	}
+
+	// whether a file could not be written
+	bool hasFailed()
+	{
+		return failed;
+	}
+
+private:
+	struct Topology
+	{
+		unsigned int particles;
+		vector<unsigned int> external; // source index of every particle
+		vector<unsigned int> internal; // particle of every source index
+		string header; // ply header, or nothing for obj
+		string faces; // everything after the positions
+	};
+
+	string prefix;
+	ExportFormat format = EXPORT_PLY;
+	vector<Topology> topologies;
+	atomic<unsigned int> frames{ 0 };
+	atomic<bool> failed{ false };
+	bool running = false;
+
+	std::thread worker;
+	vector<unique_ptr<vector<glm::vec3>>> buffers;
+	SPSCQueue<vector<glm::vec3>*, EXPORT_QUEUE> spare, filled; // buffers flow from spare to filled and back
+	mutex lock;
+	condition_variable wake, freed;
+	bool stopping = false;
+	vector<char> positions;
+
+	void run()
+	{
+		MEMORY_SUBSYSTEM(MEMORY_IO);
+		while (true)
+		{
+			vector<glm::vec3>* buffer;
+			if (filled.pop(buffer))
+			{
+				write(*buffer);
+				spare.push(buffer);
+				{
+					lock_guard<mutex> guard(lock);
+				}
+				freed.notify_one();
+				continue;
+			}
+			unique_lock<mutex> guard(lock);
+			if (stopping)
+			{
+				guard.unlock();
+				while (filled.pop(buffer))
+					write(*buffer);
+				return;
+			}
+			// append() notifies without the lock, so don't rely on every notification arriving
+			wake.wait_for(guard, chrono::milliseconds(5));
+		}
+	}
+
+	static bool littleEndian()
+	{
+		unsigned int one = 1;
+		unsigned char first;
+		memcpy(&first, &one, 1);
+		return first == 1;
+	}
+
+	void encodeFaces(Topology& topology, const vector<unsigned int>& indices)
+	{
+		unsigned int triangles = indices.size() / 3;
+		topology.header.clear();
+		topology.faces.clear();
+		if (format == EXPORT_PLY)
+		{
+			topology.header = string("ply\nformat ") + (littleEndian() ? "binary_little_endian" : "binary_big_endian") + " 1.0\n" +
+				"element vertex " + to_string(topology.particles) + "\n" +
+				"property float x\nproperty float y\nproperty float z\n" +
+				"element face " + to_string(triangles) + "\n" +
+				"property list uchar int vertex_indices\nend_header\n";
+			topology.faces.resize((size_t)triangles * 13);
+			char* out = &topology.faces[0];
+			for (unsigned int t = 0; t < triangles; t++)
+			{
+				*out++ = 3;
+				for (unsigned int k = 0; k < 3; k++)
+				{
+					int index = topology.external[indices[3 * t + k]];
+					memcpy(out, &index, 4);
+					out += 4;
+				}
+			}
+			return;
+		}
+
+		char line[48];
+		for (unsigned int t = 0; t < triangles; t++)
+		{
+			char* out = line;
+			*out++ = 'f';
+			for (unsigned int k = 0; k < 3; k++)
+			{
+				*out++ = ' ';
+				out = to_chars(out, line + sizeof(line), topology.external[indices[3 * t + k]] + 1).ptr;
+			}
+			*out++ = '\n';
+			topology.faces.append(line, out);
+		}
+	}
+
+	void write(const vector<glm::vec3>& frame)
+	{
+		unsigned int at = 0;
+		for (unsigned int c = 0; c < topologies.size(); c++)
+		{
+			const Topology& topology = topologies[c];
+			encodePositions(topology, &frame[at]);
+			at += topology.particles;
+
+			char name[32];
+			snprintf(name, sizeof(name), "_%u_%06u", c, (unsigned int)frames);
+			string path = prefix + name + (format == EXPORT_PLY ? ".ply" : ".obj");
+			FILE* file = fopen(path.c_str(), "wb");
+			if (!file)
+			{
+				if (!failed)
+					std::cout << "ERROR::EXPORT::FILE_NOT_CREATED: " << path << std::endl;
+				failed = true;
+				continue;
+			}
+			// three large writes, the stdio buffer would only copy them once more
+			setvbuf(file, NULL, _IONBF, 0);
+			bool written = fwrite(topology.header.data(), 1, topology.header.size(), file) == topology.header.size() &&
+				fwrite(positions.data(), 1, positions.size(), file) == positions.size() &&
+				fwrite(topology.faces.data(), 1, topology.faces.size(), file) == topology.faces.size();
+			if (fclose(file) != 0 || !written)
+			{
+				if (!failed)
+					std::cout << "ERROR::EXPORT::FILE_NOT_WRITTEN: " << path << std::endl;
+				failed = true;
+			}
+		}
+		frames++;
+	}
+
+	// six decimals like most exporters write, formatted as integers as that is a lot faster than float text
+	static char* writeFixed(char* out, char* end, float value)
+	{
+		if (!(fabs(value) < 1e12f))
+			return to_chars(out, end, value).ptr;
+		long long micro = llround((double)value * 1e6);
+		if (micro < 0)
+		{
+			*out++ = '-';
+			micro = -micro;
+		}
+		out = to_chars(out, end, micro / 1000000).ptr;
+		*out++ = '.';
+		long long fraction = micro % 1000000;
+		for (int d = 5; d >= 0; d--, fraction /= 10)
+			out[d] = (char)('0' + fraction % 10);
+		return out + 6;
+	}
+
+	// positions in source order, raw floats for ply or v lines for obj
+	void encodePositions(const Topology& topology, const glm::vec3* frame)
+	{
+		if (format == EXPORT_PLY)
+		{
+			positions.resize((size_t)topology.particles * sizeof(glm::vec3));
+			for (unsigned int i = 0; i < topology.particles; i++)
+				memcpy(&positions[(size_t)topology.external[i] * sizeof(glm::vec3)], &frame[i], sizeof(glm::vec3));
+			return;
+		}
+
+		positions.resize((size_t)topology.particles * OBJ_LINE_CHARS);
+		char* out = positions.data();
+		char* end = out + positions.size();
+		for (unsigned int e = 0; e < topology.particles; e++)
+		{
+			const glm::vec3& p = frame[topology.internal[e]];
+			*out++ = 'v';
+			for (unsigned int k = 0; k < 3; k++)
+			{
+				*out++ = ' ';
+				out = writeFixed(out, end, p[k]);
+			}
+			*out++ = '\n';
+		}
+		positions.resize(out - positions.data());
+	}
+};
+#endif
@@ -0,0 +1,230 @@
+#ifndef INPUT_LOG_H
+#define INPUT_LOG_H
+
+#include <glm/glm.hpp>
+
+#include "world.h"
+#include "interaction.h"
+#include "memory_tracker.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+using namespace std;
+
+// input log file, native byte order:
+//   header: "PBDI", version, time step, steps recorded, event count, bytes of the start and the saved snapshot, cloth count
+//   World::snapshot() of the state the recording started from, then the one kept by SAVE at that time if any
+//   every event with the step it was handled before
+//   per cloth: particle count and the positions after the last step, to check replays against
+#define INPUT_LOG_VERSION 1
+
+struct InputLogHeader
+{
+	char magic[4]; // "PBDI"
+	unsigned int version;
+	float timeStep;
+	unsigned int steps;
+	unsigned int events;
+	unsigned int snapshotSize;
+	unsigned int savedSize;
+	unsigned int cloths;
+};
+
+// an input event as handled by the simulation thread, steps count from the start of the recording
+struct InputRecord
+{
+	unsigned int step;
+	unsigned int type;
+	glm::vec3 origin, dir, forward;
+
+	InputEvent event() const
+	{
+		InputEvent result((InputEvent::Type)type);
+		// assigned rather than constructed, a ray normalizes its direction again which may change the last bit
+		result.ray.origin = origin;
+		result.ray.dir = dir;
+		result.forward = forward;
+		return result;
+	}
+};
+
+// interaction with a world recorded step by step, so a session can be replayed at the same fixed time step
+// without a window. the world is stepped the same way as long as it has the same cloths and colliders
+class InputLog {
+public:
+	// start recording from the current state of the world and the interaction with it, which must not be dragging
+	void begin(World& world, Interaction& interaction, float timeStep)
+	{
+		MEMORY_SUBSYSTEM(MEMORY_IO);
+		this->timeStep = timeStep;
+		steps = 0;
+		events.clear();
+		finalPositions.clear();
+		world.snapshot(start);
+		saved = interaction.getSnapshot();
+	}
+
+	// an event handled before the next step
+	void add(const InputEvent& event)
+	{
+		MEMORY_SUBSYSTEM(MEMORY_IO);
+		events.push_back({ steps, (unsigned int)event.type, event.ray.origin, event.ray.dir, event.forward });
+	}
+
+	// the world took a step
+	void stepped()
+	{
+		steps++;
+	}
+
+	// stop recording, the positions of all particles are kept for comparing replays
+	void end(World& world)
+	{
+		MEMORY_SUBSYSTEM(MEMORY_IO);
+		finalPositions.clear();
+		for (unsigned int c = 0; c < world.clothCount(); c++)
+		{
+			const SimVector<Vertex>& vertices = world.getCloth(c)->getVertices();
+			vector<glm::vec3> positions(vertices.size());
+			for (unsigned int i = 0; i < vertices.size(); i++)
+				positions[i] = vertices[i].Position;
+			finalPositions.push_back(positions);
+		}
+	}
+
+	bool save(const char* path)
+	{
+		FILE* file = fopen(path, "wb");
+		if (!file)
+		{
+			std::cout << "ERROR::INPUT::FILE_NOT_CREATED: " << path << std::endl;
+			return false;
+		}
+		InputLogHeader header = { { 'P', 'B', 'D', 'I' }, INPUT_LOG_VERSION, timeStep, steps, (unsigned int)events.size(),
+			(unsigned int)start.size(), (unsigned int)saved.size(), (unsigned int)finalPositions.size() };
+		bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+		written = written && fwrite(start.data(), 1, start.size(), file) == start.size();
+		written = written && fwrite(saved.data(), 1, saved.size(), file) == saved.size();
+		written = written && fwrite(events.data(), sizeof(InputRecord), events.size(), file) == events.size();
+		for (unsigned int c = 0; c < finalPositions.size(); c++)
+		{
+			unsigned int particles = finalPositions[c].size();
+			written = written && fwrite(&particles, sizeof(particles), 1, file) == 1;
+			written = written && fwrite(finalPositions[c].data(), sizeof(glm::vec3), particles, file) == particles;
+		}
+		if (fclose(file) != 0)
+			written = false;
+		if (!written)
+			std::cout << "ERROR::INPUT::FILE_NOT_WRITTEN: " << path << std::endl;
+		return written;
+	}
+
+	bool load(const char* path)
+	{
+		MEMORY_SUBSYSTEM(MEMORY_IO);
+		FILE* file = fopen(path, "rb");
+		if (!file)
+		{
+			std::cout << "ERROR::INPUT::FILE_NOT_READ: " << path << std::endl;
+			return false;
+		}
+		InputLogHeader header;
+		bool read = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, "PBDI", 4) == 0 &&
+			header.version == INPUT_LOG_VERSION;
+		if (read)
+		{
+			timeStep = header.timeStep;
+			steps = header.steps;
+			start.resize(header.snapshotSize);
+			saved.resize(header.savedSize);
+			events.resize(header.events);
+			read = fread(start.data(), 1, start.size(), file) == start.size() &&
+				fread(saved.data(), 1, saved.size(), file) == saved.size() &&
+				fread(events.data(), sizeof(InputRecord), events.size(), file) == events.size();
+			finalPositions.assign(read ? header.cloths : 0, vector<glm::vec3>());
+			for (unsigned int c = 0; c < finalPositions.size() && read; c++)
+			{
+				unsigned int particles;
+				read = fread(&particles, sizeof(particles), 1, file) == 1;
+				finalPositions[c].resize(read ? particles : 0);
+				read = read && fread(finalPositions[c].data(), sizeof(glm::vec3), particles, file) == particles;
+			}
+		}
+		fclose(file);
+		if (!read)
+			std::cout << "ERROR::INPUT::INVALID_FILE: " << path << std::endl;
+		return read;
+	}
+
+	// put the world back to where the recording started, false if it has other cloths or colliders
+	bool restore(World& world)
+	{
+		return world.restore(start.data(), start.size());
+	}
+
+	// restore the start and step the world through the recording with the recorded events, body(step) after
+	// every step. false if the world has other cloths or colliders
+	template <typename F>
+	bool replay(World& world, const F& body)
+	{
+		if (!restore(world))
+			return false;
+		Interaction interaction(&world);
+		interaction.setSnapshot(saved);
+		unsigned int next = 0;
+		for (unsigned int s = 0; s < steps; s++)
+		{
+			for (; next < events.size() && events[next].step == s; next++)
+				interaction.handle(events[next].event());
+			world.step(timeStep);
+			body(s);
+		}
+		return true;
+	}
+
+	// largest distance of a particle from where it was at the end of the recording, -1 for another world
+	float deviation(World& world)
+	{
+		if (finalPositions.size() != world.clothCount())
+			return -1.0f;
+		float largest = 0.0f;
+		for (unsigned int c = 0; c < finalPositions.size(); c++)
+		{
+			const SimVector<Vertex>& vertices = world.getCloth(c)->getVertices();
+			if (vertices.size() != finalPositions[c].size())
+				return -1.0f;
+			for (unsigned int i = 0; i < vertices.size(); i++)
+				largest = max(largest, glm::length(vertices[i].Position - finalPositions[c][i]));
+		}
+		return largest;
+	}
+
+	float getTimeStep()
+	{
+		return timeStep;
+	}
+
+	unsigned int stepCount()
+	{
+		return steps;
+	}
+
+	// ordered by step
+	const vector<InputRecord>& getEvents()
+	{
+		return events;
+	}
+
+private:
+	float timeStep = 1.0f / 60.0f;
+	unsigned int steps = 0;
+	vector<char> start;
+	vector<char> saved; // for RESTORE events
+	vector<InputRecord> events;
+	vector<vector<glm::vec3>> finalPositions;
+};
+#endif
@@ -0,0 +1,130 @@
+#ifndef INTERACTION_H
+#define INTERACTION_H
+
+#include <glm/glm.hpp>
+
+#include "cloth.h"
+#include "sphere.h"
+#include "world.h"
+#include "ray.h"
+#include "profiler.h"
+
+#include <cfloat>
+#include <vector>
+
+// input sent from the window callbacks to the simulation thread
+struct InputEvent
+{
+	enum Type { PICK, DRAG, RELEASE, SAVE, RESTORE } type; // SAVE and RESTORE keep one snapshot of the world
+	Ray ray;           // cursor ray
+	glm::vec3 forward; // camera direction, dragging happens in the plane facing it
+
+	InputEvent() : type(RELEASE), ray(glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, -1.0f)), forward(0.0f, 0.0f, -1.0f) {}
+	InputEvent(Type type, Ray ray, glm::vec3 forward) : type(type), ray(ray), forward(forward) {}
+	explicit InputEvent(Type type) : InputEvent() { this->type = type; }
+};
+
+// what input events do to a world: picking the nearest collider or particle along the cursor ray,
+// dragging it in the plane facing the camera, and keeping or going back to a snapshot. used by the
+// simulation thread and by headless replays of recorded input, so both move the world the same way
+class Interaction {
+public:
+	Interaction(World* world) : world(world) {}
+
+	void handle(const InputEvent& event)
+	{
+		if (event.type == InputEvent::PICK)
+		{
+			// pick the nearest of all colliders and cloths along the ray
+			PROFILE_SCOPE("pick");
+			if (target == PARTICLE)
+				pickedCloth->release();
+			float nearest = FLT_MAX;
+			target = NONE;
+			for (unsigned int i = 0; i < world->colliderCount(); i++)
+			{
+				float t;
+				if (world->getCollider(i)->intersect(event.ray, t) && t < nearest)
+				{
+					nearest = t;
+					target = SPHERE;
+					pickedSphere = world->getCollider(i);
+				}
+			}
+			int particle = -1;
+			for (unsigned int i = 0; i < world->clothCount(); i++)
+			{
+				float t;
+				int hit = world->getCloth(i)->pick(event.ray, t);
+				if (hit >= 0 && t < nearest)
+				{
+					nearest = t;
+					target = PARTICLE;
+					pickedCloth = world->getCloth(i);
+					particle = hit;
+				}
+			}
+			if (target == PARTICLE)
+				pickedCloth->grab(particle);
+			if (target != NONE)
+				lastPoint = event.ray.at(nearest);
+			planeNormal = event.forward;
+		}
+		else if (event.type == InputEvent::DRAG && target != NONE)
+		{
+			// move along with the cursor in the plane through the hit point
+			float denom = glm::dot(event.ray.dir, planeNormal);
+			if (fabs(denom) < 1e-6f)
+				return;
+			glm::vec3 point = event.ray.at(glm::dot(lastPoint - event.ray.origin, planeNormal) / denom);
+			if (target == PARTICLE)
+				pickedCloth->drag(point - lastPoint);
+			else
+				pickedSphere->update(point - lastPoint);
+			lastPoint = point;
+		}
+		else if (event.type == InputEvent::RELEASE)
+		{
+			if (target == PARTICLE)
+				pickedCloth->release();
+			target = NONE;
+		}
+		else if (event.type == InputEvent::SAVE)
+			world->snapshot(snapshot);
+		else if (event.type == InputEvent::RESTORE && !snapshot.empty())
+		{
+			// a restored cloth holds no particle, so the drag ends
+			world->restore(snapshot.data(), snapshot.size());
+			target = NONE;
+		}
+	}
+
+	// whether a collider or particle is held
+	bool isDragging()
+	{
+		return target != NONE;
+	}
+
+	// the world kept by the last SAVE, empty if there was none
+	const vector<char>& getSnapshot()
+	{
+		return snapshot;
+	}
+
+	void setSnapshot(const vector<char>& snapshot)
+	{
+		this->snapshot = snapshot;
+	}
+
+private:
+	World* world;
+
+	// drag state
+	enum { NONE, SPHERE, PARTICLE } target = NONE;
+	Cloth* pickedCloth = NULL;
+	Sphere* pickedSphere = NULL;
+	glm::vec3 planeNormal;
+	glm::vec3 lastPoint;
+	vector<char> snapshot; // taken on SAVE
+};
+#endif
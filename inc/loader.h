@@ -0,0 +1,692 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <glm/glm.hpp>
+
+#include "mesh.h"
+#include "mapped_file.h"
+#include "scheduler.h"
+#include "memory_tracker.h"
+
+#include <algorithm>
+#include <charconv>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+using namespace std;
+
+#define LOADER_CHUNK (1 << 20) // bytes of text parsed by one task
+#define LOADER_VERTEX_GRAIN 16384 // binary vertices converted by one task
+
+// reads triangle meshes for Cloth(vertices, indices) from OBJ or PLY files (ascii, binary little or big endian).
+// the file is mapped into memory and text is parsed in chunks of whole lines on the scheduler, polygons are
+// split into fans. vertices at exactly the same position are welded, as exporters split them along uv seams
+// and normal creases, which would tear the cloth apart there
+class MeshLoader {
+public:
+	// NULL parses on the calling thread
+	MeshLoader(Scheduler* scheduler = NULL) : scheduler(scheduler) {}
+
+	// false with an error printed if the file can't be read, the format is recognized by the "ply" magic
+	bool load(const char* path, vector<Vertex>& vertices, vector<unsigned int>& indices)
+	{
+		MEMORY_SUBSYSTEM(MEMORY_IO);
+		MappedFile file;
+		if (!file.open(path))
+		{
+			std::cout << "ERROR::LOADER::FILE_NOT_READ: " << path << std::endl;
+			return false;
+		}
+		chunks.clear();
+		const char* data = file.data();
+		const char* end = data + file.size();
+		bool ply = file.size() >= 4 && memcmp(data, "ply", 3) == 0 && (data[3] == '\n' || data[3] == '\r');
+		if (!(ply ? parsePly(data, end) : parseObj(data, end)) || !gather(vertices, indices))
+		{
+			std::cout << "ERROR::LOADER::" << error << ": " << path << std::endl;
+			return false;
+		}
+		weld(vertices, indices);
+		if (indices.empty())
+		{
+			std::cout << "ERROR::LOADER::NO_TRIANGLES: " << path << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	// merge vertices at exactly the same position and drop the triangles that collapse, vertices are
+	// renumbered in the order triangles first use them so unreferenced ones are dropped as well
+	static void weld(vector<Vertex>& vertices, vector<unsigned int>& indices)
+	{
+		unsigned int count = vertices.size();
+		unsigned int buckets = 1;
+		while (buckets < 2 * count)
+			buckets <<= 1;
+		vector<unsigned int> table(buckets, UINT_MAX);
+		vector<unsigned int> remap(count);
+		for (unsigned int i = 0; i < count; i++)
+		{
+			glm::vec3 p = vertices[i].Position + glm::vec3(0.0f); // -0 hashes like 0
+			unsigned int bits[3];
+			memcpy(bits, &p, sizeof(bits));
+			unsigned int h = (bits[0] * 73856093u) ^ (bits[1] * 19349663u) ^ (bits[2] * 83492791u);
+			h ^= h >> 16;
+			for (h &= buckets - 1; ; h = (h + 1) & (buckets - 1))
+			{
+				if (table[h] == UINT_MAX)
+				{
+					table[h] = i;
+					remap[i] = i;
+					break;
+				}
+				if (vertices[table[h]].Position == vertices[i].Position)
+				{
+					remap[i] = table[h];
+					break;
+				}
+			}
+		}
+
+		vector<unsigned int> number(count, UINT_MAX);
+		vector<Vertex> welded;
+		unsigned int kept = 0;
+		for (unsigned int t = 0; t + 2 < indices.size(); t += 3)
+		{
+			unsigned int a = remap[indices[t]], b = remap[indices[t + 1]], c = remap[indices[t + 2]];
+			if (a == b || b == c || a == c)
+				continue;
+			for (unsigned int v : { a, b, c })
+			{
+				if (number[v] == UINT_MAX)
+				{
+					number[v] = welded.size();
+					welded.push_back(vertices[v]);
+				}
+				indices[kept++] = number[v];
+			}
+		}
+		indices.resize(kept);
+		vertices.swap(welded);
+	}
+
+private:
+	// what one task parsed, concatenated in file order afterwards
+	struct Chunk
+	{
+		const char* begin;
+		const char* end;
+		unsigned int firstLine = 0; // ascii ply, number of the first line after the header
+		vector<glm::vec3> positions;
+		vector<int> triangles; // 0 based, or relative to the end of positions for the slots in relative
+		vector<unsigned int> relative; // obj indices counted back from the last vertex
+		const char* failed = NULL; // where parsing stopped
+	};
+
+	enum PlyType { PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64, PLY_UNKNOWN };
+
+	struct PlyProperty
+	{
+		string name;
+		PlyType type;
+		PlyType countType; // for lists
+		bool list;
+	};
+
+	struct PlyElement
+	{
+		string name;
+		unsigned int count;
+		vector<PlyProperty> properties;
+		unsigned int firstLine; // ascii only
+	};
+
+	Scheduler* scheduler;
+	vector<Chunk> chunks;
+	const char* error = "";
+
+	template <typename F>
+	void forEachChunk(const char* name, const F& body)
+	{
+		auto run = [&](unsigned int begin, unsigned int end) {
+			MEMORY_SUBSYSTEM(MEMORY_IO);
+			for (unsigned int k = begin; k < end; k++)
+				body(chunks[k]);
+		};
+		if (scheduler)
+			scheduler->parallelFor(name, 0, chunks.size(), 1, run);
+		else
+			run(0, chunks.size());
+	}
+
+	// chunks of about LOADER_CHUNK bytes that start and end at line breaks
+	void splitLines(const char* begin, const char* end)
+	{
+		size_t count = (end - begin + LOADER_CHUNK - 1) / LOADER_CHUNK;
+		chunks.resize(max<size_t>(count, 1));
+		for (size_t k = 0; k < chunks.size(); k++)
+		{
+			const char* at = begin + k * LOADER_CHUNK;
+			if (k > 0)
+			{
+				const char* newline = (const char*)memchr(at - 1, '\n', end - at + 1);
+				at = newline ? newline + 1 : end;
+			}
+			chunks[k].begin = at;
+			if (k > 0)
+				chunks[k - 1].end = at;
+		}
+		chunks.back().end = end;
+	}
+
+	static const char* lineEnd(const char* p, const char* end)
+	{
+		const char* newline = (const char*)memchr(p, '\n', end - p);
+		return newline ? newline : end;
+	}
+
+	static const char* skipSpaces(const char* p, const char* end)
+	{
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+			p++;
+		return p;
+	}
+
+	static const char* skipToken(const char* p, const char* end)
+	{
+		while (p < end && *p != ' ' && *p != '\t' && *p != '\r')
+			p++;
+		return p;
+	}
+
+	// whether a decimal number that is out of range is too small rather than too large, from the power of ten of
+	// its first significant digit
+	static bool underflows(const char* p, const char* end)
+	{
+		if (p < end && *p == '-')
+			p++;
+		long long power = -1;
+		bool significant = false, fraction = false;
+		for (; p < end && ((*p >= '0' && *p <= '9') || *p == '.'); p++)
+		{
+			if (*p == '.')
+				fraction = true;
+			else if (significant || *p != '0')
+			{
+				significant = true;
+				if (!fraction)
+					power++;
+			}
+			else if (fraction)
+				power--;
+		}
+		if (p < end && (*p == 'e' || *p == 'E'))
+		{
+			p++;
+			bool negative = p < end && *p == '-';
+			if (p < end && (*p == '-' || *p == '+'))
+				p++;
+			long long exponent = 0;
+			for (; p < end && *p >= '0' && *p <= '9'; p++)
+				exponent = min(exponent * 10 + (*p - '0'), (long long)INT_MAX);
+			power += negative ? -exponent : exponent;
+		}
+		return power < 0;
+	}
+
+	// next number of the line, NULL if there is none or it doesn't fit
+	template <typename T>
+	static const char* parseNumber(const char* p, const char* end, T& value)
+	{
+		p = skipSpaces(p, end);
+		if (p < end && *p == '+')
+			p++;
+		from_chars_result result = from_chars(p, end, value);
+		if (result.ec == errc::result_out_of_range && is_floating_point<T>::value && underflows(p, result.ptr))
+			value = T(0); // denormals
+		else if (result.ec != errc())
+			return NULL;
+		return result.ptr;
+	}
+
+	// polygon as a fan around its first corner
+	static void addFan(Chunk& chunk, const int* corners, unsigned int count)
+	{
+		for (unsigned int i = 2; i < count; i++)
+		{
+			chunk.triangles.push_back(corners[0]);
+			chunk.triangles.push_back(corners[i - 1]);
+			chunk.triangles.push_back(corners[i]);
+		}
+	}
+
+	bool parseObj(const char* data, const char* end)
+	{
+		splitLines(data, end);
+		forEachChunk("parse obj", [](Chunk& chunk) {
+			vector<int> corners;
+			vector<bool> relative;
+			for (const char* p = chunk.begin; p < chunk.end && !chunk.failed; )
+			{
+				const char* line = lineEnd(p, chunk.end);
+				p = skipSpaces(p, line);
+				if (line - p > 1 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+				{
+					glm::vec3 position;
+					const char* at = p + 1;
+					for (unsigned int k = 0; k < 3 && at; k++)
+						at = parseNumber(at, line, position[k]);
+					if (!at)
+						chunk.failed = p;
+					chunk.positions.push_back(position);
+				}
+				else if (line - p > 1 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+				{
+					// v, v/vt, v/vt/vn or v//vn, only the position index is used
+					corners.clear();
+					relative.clear();
+					const char* at = skipSpaces(p + 1, line);
+					while (at < line)
+					{
+						int index;
+						const char* next = parseNumber(at, line, index);
+						if (!next || index == 0)
+						{
+							chunk.failed = p;
+							break;
+						}
+						corners.push_back(index > 0 ? index - 1 : (int)chunk.positions.size() + index);
+						relative.push_back(index < 0);
+						at = skipSpaces(skipToken(next, line), line);
+					}
+					for (unsigned int i = 2; i < corners.size(); i++)
+						for (unsigned int corner : { 0u, i - 1, i })
+						{
+							if (relative[corner])
+								chunk.relative.push_back(chunk.triangles.size());
+							chunk.triangles.push_back(corners[corner]);
+						}
+				}
+				p = line + 1;
+			}
+		});
+		for (unsigned int k = 0; k < chunks.size(); k++)
+			if (chunks[k].failed)
+			{
+				error = "OBJ_PARSE_ERROR";
+				return false;
+			}
+		return true;
+	}
+
+	static PlyType plyType(const string& name)
+	{
+		static const char* names[][2] = {
+			{ "char", "int8" }, { "uchar", "uint8" }, { "short", "int16" }, { "ushort", "uint16" },
+			{ "int", "int32" }, { "uint", "uint32" }, { "float", "float32" }, { "double", "float64" }
+		};
+		for (unsigned int t = 0; t < PLY_UNKNOWN; t++)
+			if (name == names[t][0] || name == names[t][1])
+				return (PlyType)t;
+		return PLY_UNKNOWN;
+	}
+
+	static unsigned int plySize(PlyType type)
+	{
+		static const unsigned int sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8, 0 };
+		return sizes[type];
+	}
+
+	static double plyValue(const char* p, PlyType type, bool swap)
+	{
+		unsigned char bytes[8];
+		unsigned int size = plySize(type);
+		memcpy(bytes, p, size);
+		if (swap)
+			reverse(bytes, bytes + size);
+		switch (type)
+		{
+		case PLY_INT8: { int8_t v; memcpy(&v, bytes, 1); return v; }
+		case PLY_UINT8: { uint8_t v; memcpy(&v, bytes, 1); return v; }
+		case PLY_INT16: { int16_t v; memcpy(&v, bytes, 2); return v; }
+		case PLY_UINT16: { uint16_t v; memcpy(&v, bytes, 2); return v; }
+		case PLY_INT32: { int32_t v; memcpy(&v, bytes, 4); return v; }
+		case PLY_UINT32: { uint32_t v; memcpy(&v, bytes, 4); return v; }
+		case PLY_FLOAT32: { float v; memcpy(&v, bytes, 4); return v; }
+		case PLY_FLOAT64: { double v; memcpy(&v, bytes, 8); return v; }
+		default: return 0.0;
+		}
+	}
+
+	bool parsePly(const char* data, const char* end)
+	{
+		// header, one keyword line at a time
+		vector<PlyElement> elements;
+		string format;
+		const char* p = data;
+		while (true)
+		{
+			if (p >= end)
+			{
+				error = "PLY_HEADER_NOT_TERMINATED";
+				return false;
+			}
+			const char* line = lineEnd(p, end);
+			vector<string> words;
+			for (const char* at = skipSpaces(p, line); at < line; at = skipSpaces(at, line))
+			{
+				const char* word = at;
+				at = skipToken(at, line);
+				words.push_back(string(word, at));
+			}
+			p = line + 1;
+			if (words.empty())
+				continue;
+			if (words[0] == "end_header")
+				break;
+			if (words[0] == "format" && words.size() > 1)
+				format = words[1];
+			else if (words[0] == "element" && words.size() > 2)
+				elements.push_back({ words[1], (unsigned int)strtoul(words[2].c_str(), NULL, 10), {}, 0 });
+			else if (words[0] == "property" && !elements.empty())
+			{
+				PlyProperty property;
+				property.list = words.size() > 4 && words[1] == "list";
+				property.countType = property.list ? plyType(words[2]) : PLY_UNKNOWN;
+				property.type = plyType(words[property.list ? 3 : 1]);
+				property.name = words.back();
+				if (property.type == PLY_UNKNOWN || (property.list && property.countType == PLY_UNKNOWN))
+				{
+					error = "PLY_UNKNOWN_PROPERTY_TYPE";
+					return false;
+				}
+				elements.back().properties.push_back(property);
+			}
+		}
+
+		if (format == "ascii")
+			return parsePlyAscii(elements, p, end);
+		if (format == "binary_little_endian" || format == "binary_big_endian")
+			return parsePlyBinary(elements, p, end, format == "binary_big_endian");
+		error = "PLY_UNKNOWN_FORMAT";
+		return false;
+	}
+
+	static int findProperty(const PlyElement& element, const char* name)
+	{
+		for (unsigned int i = 0; i < element.properties.size(); i++)
+			if (element.properties[i].name == name)
+				return i;
+		return -1;
+	}
+
+	static int faceIndices(const PlyElement& element)
+	{
+		int property = findProperty(element, "vertex_indices");
+		if (property < 0)
+			property = findProperty(element, "vertex_index");
+		return property >= 0 && element.properties[property].list ? property : -1;
+	}
+
+	bool parsePlyAscii(vector<PlyElement>& elements, const char* data, const char* end)
+	{
+		// lines are numbered first so every chunk knows which element its lines belong to
+		unsigned int lines = 0;
+		for (unsigned int e = 0; e < elements.size(); e++)
+		{
+			elements[e].firstLine = lines;
+			lines += elements[e].count;
+		}
+		splitLines(data, end);
+		forEachChunk("count ply lines", [](Chunk& chunk) {
+			chunk.firstLine = count(chunk.begin, chunk.end, '\n');
+		});
+		unsigned int line = 0;
+		for (unsigned int k = 0; k < chunks.size(); k++)
+		{
+			unsigned int count = chunks[k].firstLine;
+			chunks[k].firstLine = line;
+			line += count;
+		}
+
+		forEachChunk("parse ply", [&](Chunk& chunk) {
+			unsigned int number = chunk.firstLine;
+			unsigned int e = 0;
+			vector<int> corners;
+			for (const char* p = chunk.begin; p < chunk.end && !chunk.failed; number++)
+			{
+				const char* line = lineEnd(p, chunk.end);
+				while (e < elements.size() && number >= elements[e].firstLine + elements[e].count)
+					e++;
+				if (e == elements.size())
+					break;
+				const PlyElement& element = elements[e];
+				bool vertex = element.name == "vertex", face = element.name == "face";
+				int indices = face ? faceIndices(element) : -1;
+				glm::vec3 position(0.0f);
+				const char* at = p;
+				for (unsigned int i = 0; i < element.properties.size() && (vertex || face) && at; i++)
+				{
+					const PlyProperty& property = element.properties[i];
+					if (property.list)
+					{
+						unsigned int count = 0;
+						at = parseNumber(at, line, count);
+						corners.clear();
+						for (unsigned int j = 0; j < count && at; j++)
+						{
+							double index;
+							at = parseNumber(at, line, index);
+							corners.push_back((int)index);
+						}
+						if (at && (int)i == indices)
+							addFan(chunk, corners.data(), corners.size());
+						continue;
+					}
+					double value;
+					at = parseNumber(at, line, value);
+					if (vertex && property.name.size() == 1 && property.name[0] >= 'x' && property.name[0] <= 'z')
+						position[property.name[0] - 'x'] = (float)value;
+				}
+				if (!at)
+					chunk.failed = p;
+				if (vertex)
+					chunk.positions.push_back(position);
+				p = line + 1;
+			}
+		});
+		for (unsigned int k = 0; k < chunks.size(); k++)
+			if (chunks[k].failed)
+			{
+				error = "PLY_PARSE_ERROR";
+				return false;
+			}
+		return true;
+	}
+
+	bool parsePlyBinary(const vector<PlyElement>& elements, const char* data, const char* end, bool swap)
+	{
+		const char* p = data;
+		for (unsigned int e = 0; e < elements.size(); e++)
+		{
+			const PlyElement& element = elements[e];
+			bool lists = false;
+			unsigned int stride = 0;
+			for (unsigned int i = 0; i < element.properties.size(); i++)
+			{
+				lists = lists || element.properties[i].list;
+				stride += plySize(element.properties[i].type);
+			}
+
+			if (!lists)
+			{
+				if ((size_t)(end - p) < (size_t)element.count * stride)
+				{
+					error = "PLY_TRUNCATED";
+					return false;
+				}
+				if (element.name == "vertex")
+				{
+					// fixed size records, converted in parallel ranges
+					int offsets[3];
+					PlyType types[3];
+					for (unsigned int k = 0; k < 3; k++)
+					{
+						const char name[2] = { (char)('x' + k), 0 };
+						int property = findProperty(element, name);
+						offsets[k] = -1;
+						for (int i = 0, offset = 0; i < (int)element.properties.size(); offset += plySize(element.properties[i++].type))
+							if (i == property)
+							{
+								offsets[k] = offset;
+								types[k] = element.properties[i].type;
+							}
+					}
+					size_t first = chunks.size();
+					for (unsigned int begin = 0; begin < element.count; begin += LOADER_VERTEX_GRAIN)
+					{
+						chunks.push_back(Chunk());
+						chunks.back().begin = p + (size_t)begin * stride;
+						chunks.back().end = p + (size_t)min(begin + LOADER_VERTEX_GRAIN, element.count) * stride;
+					}
+					auto run = [&](unsigned int begin, unsigned int end) {
+						for (unsigned int k = begin; k < end; k++)
+						{
+							Chunk& chunk = chunks[k];
+							for (const char* record = chunk.begin; record < chunk.end; record += stride)
+							{
+								glm::vec3 position(0.0f);
+								for (unsigned int c = 0; c < 3; c++)
+									if (offsets[c] >= 0)
+										position[c] = (float)plyValue(record + offsets[c], types[c], swap);
+								chunk.positions.push_back(position);
+							}
+						}
+					};
+					if (scheduler)
+						scheduler->parallelFor("convert ply vertices", first, chunks.size(), 1, run);
+					else
+						run(first, chunks.size());
+				}
+				p += (size_t)element.count * stride;
+				continue;
+			}
+
+			// variable size records can only be walked in order
+			bool vertex = element.name == "vertex";
+			int indices = element.name == "face" ? faceIndices(element) : -1;
+			chunks.push_back(Chunk());
+			Chunk& chunk = chunks.back();
+			chunk.begin = p;
+			vector<int> corners;
+			for (unsigned int r = 0; r < element.count && p; r++)
+			{
+				glm::vec3 position(0.0f);
+				for (unsigned int i = 0; i < element.properties.size() && p; i++)
+				{
+					const PlyProperty& property = element.properties[i];
+					unsigned int size = plySize(property.type);
+					if (!property.list)
+					{
+						if ((size_t)(end - p) < size)
+						{
+							p = NULL;
+							break;
+						}
+						if (vertex && property.name.size() == 1 && property.name[0] >= 'x' && property.name[0] <= 'z')
+							position[property.name[0] - 'x'] = (float)plyValue(p, property.type, swap);
+						p += size;
+						continue;
+					}
+					unsigned int countSize = plySize(property.countType);
+					if ((size_t)(end - p) < countSize)
+					{
+						p = NULL;
+						break;
+					}
+					unsigned int count = (unsigned int)plyValue(p, property.countType, swap);
+					p += countSize;
+					if ((size_t)(end - p) < (size_t)count * size)
+					{
+						p = NULL;
+						break;
+					}
+					if ((int)i == indices)
+					{
+						corners.resize(count);
+						for (unsigned int j = 0; j < count; j++)
+							corners[j] = (int)plyValue(p + j * size, property.type, swap);
+						addFan(chunk, corners.data(), count);
+					}
+					p += (size_t)count * size;
+				}
+				if (vertex && p)
+					chunk.positions.push_back(position);
+			}
+			if (!p)
+			{
+				error = "PLY_TRUNCATED";
+				return false;
+			}
+			chunk.end = p;
+		}
+		return true;
+	}
+
+	// concatenate the chunks and resolve relative indices
+	bool gather(vector<Vertex>& vertices, vector<unsigned int>& indices)
+	{
+		vector<size_t> positionStart(chunks.size() + 1, 0), triangleStart(chunks.size() + 1, 0);
+		for (unsigned int k = 0; k < chunks.size(); k++)
+		{
+			positionStart[k + 1] = positionStart[k] + chunks[k].positions.size();
+			triangleStart[k + 1] = triangleStart[k] + chunks[k].triangles.size();
+		}
+		size_t count = positionStart.back();
+		if (count >= UINT_MAX)
+		{
+			error = "TOO_MANY_VERTICES";
+			return false;
+		}
+		vertices.resize(count);
+		indices.resize(triangleStart.back());
+		vector<unsigned char> bad(chunks.size(), 0);
+		auto run = [&](unsigned int begin, unsigned int end) {
+			for (unsigned int k = begin; k < end; k++)
+			{
+				Chunk& chunk = chunks[k];
+				for (size_t i = 0; i < chunk.positions.size(); i++)
+					vertices[positionStart[k] + i].Position = chunk.positions[i];
+				for (unsigned int i = 0; i < chunk.relative.size(); i++)
+					chunk.triangles[chunk.relative[i]] += (int)positionStart[k];
+				for (size_t i = 0; i < chunk.triangles.size(); i++)
+				{
+					int index = chunk.triangles[i];
+					bad[k] |= index < 0 || (size_t)index >= count;
+					indices[triangleStart[k] + i] = index;
+				}
+				vector<glm::vec3>().swap(chunk.positions);
+				vector<int>().swap(chunk.triangles);
+			}
+		};
+		if (scheduler)
+			scheduler->parallelFor("gather mesh", 0, chunks.size(), 1, run);
+		else
+			run(0, chunks.size());
+		for (unsigned int k = 0; k < chunks.size(); k++)
+			if (bad[k])
+			{
+				error = "INDEX_OUT_OF_RANGE";
+				return false;
+			}
+		return true;
+	}
+};
+#endif
@@ -0,0 +1,80 @@
+#ifndef LOCKFREE_H
+#define LOCKFREE_H
+
+#include <atomic>
+#include <cstddef>
+
+// single producer single consumer ring buffer, capacity must be a power of two
+template <typename T, size_t Capacity>
+class SPSCQueue {
+public:
+	static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+	// producer side, false if the queue is full
+	bool push(const T& item)
+	{
+		size_t tail = this->tail.load(std::memory_order_relaxed);
+		if (tail - head.load(std::memory_order_acquire) == Capacity)
+			return false;
+		items[tail & (Capacity - 1)] = item;
+		this->tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// consumer side, false if the queue is empty
+	bool pop(T& item)
+	{
+		size_t head = this->head.load(std::memory_order_relaxed);
+		if (head == tail.load(std::memory_order_acquire))
+			return false;
+		item = items[head & (Capacity - 1)];
+		this->head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	T items[Capacity];
+	alignas(64) std::atomic<size_t> head{ 0 };
+	alignas(64) std::atomic<size_t> tail{ 0 };
+};
+
+// one writer publishes complete values, one reader always gets the latest one,
+// neither side ever waits for the other
+template <typename T>
+class TripleBuffer {
+public:
+	// writer side, fill it and then publish()
+	T& writeBuffer()
+	{
+		return buffers[back];
+	}
+
+	void publish()
+	{
+		back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX;
+	}
+
+	// reader side, true if a newer value was published since last acquire()
+	bool acquire()
+	{
+		if (!(middle.load(std::memory_order_relaxed) & FRESH))
+			return false;
+		front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+		return true;
+	}
+
+	const T& readBuffer() const
+	{
+		return buffers[front];
+	}
+
+private:
+	static const unsigned int INDEX = 3;
+	static const unsigned int FRESH = 4;
+
+	T buffers[3];
+	unsigned int back = 0;
+	unsigned int front = 1;
+	std::atomic<unsigned int> middle{ 2 };
+};
+#endif
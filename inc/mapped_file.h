@@ -0,0 +1,97 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// read only view of a whole file mapped into memory by the OS, pages are read on first access
+class MappedFile {
+public:
+	MappedFile() = default;
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile()
+	{
+		close();
+	}
+
+	// false if the file can't be opened or is empty
+	bool open(const char* path)
+	{
+		close();
+#ifdef _WIN32
+		file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER length;
+		GetFileSizeEx(file, &length);
+		bytes = (size_t)length.QuadPart;
+		mapping = bytes > 0 ? CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+		memory = mapping ? (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+#else
+		int fd = ::open(path, O_RDONLY);
+		if (fd < 0)
+			return false;
+		struct stat info;
+		fstat(fd, &info);
+		bytes = (size_t)info.st_size;
+		void* view = bytes > 0 ? mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+		::close(fd);
+		memory = view != MAP_FAILED ? (const char*)view : NULL;
+#endif
+		if (!memory)
+			close();
+		return memory != NULL;
+	}
+
+	void close()
+	{
+#ifdef _WIN32
+		if (memory)
+			UnmapViewOfFile(memory);
+		if (mapping)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+		mapping = NULL;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (memory)
+			munmap((void*)memory, bytes);
+#endif
+		memory = NULL;
+		bytes = 0;
+	}
+
+	const char* data() const
+	{
+		return memory;
+	}
+
+	size_t size() const
+	{
+		return bytes;
+	}
+
+private:
+	const char* memory = NULL;
+	size_t bytes = 0;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#endif
+};
+#endif
@@ -0,0 +1,268 @@
+#ifndef MEMORY_TRACKER_H
+#define MEMORY_TRACKER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <iostream>
+
+using namespace std;
+
+// heap and page allocations counted per subsystem and per cloth, only when built with PBD_MEMORY
+// defined, which also replaces the global operator new and delete (src/memory_tracker.cpp).
+// otherwise MEMORY_SCOPE, MEMORY_SUBSYSTEM and MEMORY_FRAME expand to nothing
+#define MEMORY_OWNERS 256 // cloths with their own footprint, later ones count as nobody's
+
+enum MemorySubsystem
+{
+	MEMORY_OTHER,
+	MEMORY_CLOTH_STATE, // particles, topology and everything else built with a cloth
+	MEMORY_SOLVER_SCRATCH, // temporaries of a step
+	MEMORY_MESH, // CPU copies of the render data, published frames and the meshes
+	MEMORY_IO, // caches, exports, loaded files and snapshots
+	MEMORY_SUBSYSTEMS
+};
+
+// what an allocation is charged to, the calling thread's current tag when it is made
+struct MemoryTag
+{
+	unsigned char subsystem = MEMORY_OTHER;
+	unsigned char owner = 0; // slot of the cloth, 0 for none
+};
+
+#define MEMORY_CONCAT_(a, b) a##b
+#define MEMORY_CONCAT(a, b) MEMORY_CONCAT_(a, b)
+#ifdef PBD_MEMORY
+#define MEMORY_SCOPE(subsystem, owner) MemoryScope MEMORY_CONCAT(memoryScope, __LINE__)(subsystem, owner)
+#define MEMORY_SUBSYSTEM(subsystem) MemoryScope MEMORY_CONCAT(memoryScope, __LINE__)(subsystem)
+#define MEMORY_FRAME() MemoryTracker::frame()
+#else
+#define MEMORY_SCOPE(subsystem, owner)
+#define MEMORY_SUBSYSTEM(subsystem)
+#define MEMORY_FRAME()
+#endif
+
+class MemoryTracker {
+public:
+	struct Totals
+	{
+		unsigned long long allocations[MEMORY_SUBSYSTEMS] = {};
+		unsigned long long bytes[MEMORY_SUBSYSTEMS] = {}; // allocated, not counting frees
+
+		unsigned long long allAllocations() const
+		{
+			unsigned long long total = 0;
+			for (unsigned int s = 0; s < MEMORY_SUBSYSTEMS; s++)
+				total += allocations[s];
+			return total;
+		}
+	};
+
+	static const char* name(unsigned int subsystem)
+	{
+		static const char* names[MEMORY_SUBSYSTEMS] = { "other", "cloth state", "solver scratch", "mesh", "io" };
+		return names[subsystem];
+	}
+
+	// tag of the calling thread, trivial so operator new may use it at any time
+	static MemoryTag& current()
+	{
+		thread_local MemoryTag tag;
+		return tag;
+	}
+
+	// slot of a cloth, given one on first use. a slot is only reused once everything of its last cloth
+	// was freed, so late frees can't be taken off the next one
+	static unsigned char owner(const void* cloth)
+	{
+		if (!cloth)
+			return 0;
+		unsigned int k = 1;
+		for (; k < MEMORY_OWNERS && owners()[k].load(memory_order_acquire); k++)
+			if (owners()[k].load(memory_order_acquire) == cloth)
+				return (unsigned char)k;
+		for (unsigned int r = 1; r < k; r++)
+		{
+			const void* expected = retired();
+			if (owned()[r].live.load(memory_order_relaxed) == 0 &&
+				owners()[r].compare_exchange_strong(expected, cloth, memory_order_acq_rel))
+			{
+				owned()[r].peak.store(0, memory_order_relaxed);
+				return (unsigned char)r;
+			}
+		}
+		for (; k < MEMORY_OWNERS; k++)
+		{
+			const void* expected = NULL;
+			if (owners()[k].compare_exchange_strong(expected, cloth, memory_order_acq_rel) || expected == cloth)
+				return (unsigned char)k;
+		}
+		return 0;
+	}
+
+	// the cloth is destroyed, its slot goes to another one once its last bytes are freed
+	static void release(const void* cloth)
+	{
+		for (unsigned int k = 1; k < MEMORY_OWNERS && owners()[k].load(memory_order_acquire); k++)
+		{
+			const void* expected = cloth;
+			if (owners()[k].compare_exchange_strong(expected, retired(), memory_order_acq_rel))
+				return;
+		}
+	}
+
+	static void allocated(MemoryTag tag, size_t bytes)
+	{
+		Counters& counters = subsystems()[tag.subsystem];
+		counters.allocations.fetch_add(1, memory_order_relaxed);
+		counters.bytes.fetch_add(bytes, memory_order_relaxed);
+		raise(counters, bytes);
+		if (tag.owner)
+			raise(owned()[tag.owner], bytes);
+	}
+
+	static void freed(MemoryTag tag, size_t bytes)
+	{
+		subsystems()[tag.subsystem].live.fetch_sub((long long)bytes, memory_order_relaxed);
+		if (tag.owner)
+			owned()[tag.owner].live.fetch_sub((long long)bytes, memory_order_relaxed);
+	}
+
+	static Totals totals()
+	{
+		Totals result;
+		for (unsigned int s = 0; s < MEMORY_SUBSYSTEMS; s++)
+		{
+			result.allocations[s] = subsystems()[s].allocations.load(memory_order_relaxed);
+			result.bytes[s] = subsystems()[s].bytes.load(memory_order_relaxed);
+		}
+		return result;
+	}
+
+	// end of a simulation step, what it allocated becomes the last frame. one thread marks frames
+	static void frame()
+	{
+		Frames& f = frames();
+		Totals now = totals();
+		for (unsigned int s = 0; s < MEMORY_SUBSYSTEMS; s++)
+		{
+			f.last.allocations[s] = now.allocations[s] - f.previous.allocations[s];
+			f.last.bytes[s] = now.bytes[s] - f.previous.bytes[s];
+			f.most.allocations[s] = max(f.most.allocations[s], f.last.allocations[s]);
+			f.most.bytes[s] = max(f.most.bytes[s], f.last.bytes[s]);
+		}
+		if (f.last.allAllocations() > 0)
+			f.allocating++;
+		f.count++;
+		f.previous = now;
+	}
+
+	// per subsystem live and peak bytes, allocations in the last and the worst frame, and the peak of every living cloth
+	static void report(ostream& out)
+	{
+		Frames& f = frames();
+		char line[160];
+		snprintf(line, sizeof(line), "%-16s %12s %12s %14s %12s %14s %12s", "subsystem", "live KB", "peak KB", "allocations",
+			"last frame", "bytes", "worst frame");
+		out << line << std::endl;
+		for (unsigned int s = 0; s < MEMORY_SUBSYSTEMS; s++)
+		{
+			Counters& counters = subsystems()[s];
+			snprintf(line, sizeof(line), "%-16s %12.1f %12.1f %14llu %12llu %14llu %12llu", name(s),
+				counters.live.load(memory_order_relaxed) / 1024.0, counters.peak.load(memory_order_relaxed) / 1024.0,
+				counters.allocations.load(memory_order_relaxed), f.last.allocations[s], f.last.bytes[s], f.most.allocations[s]);
+			out << line << std::endl;
+		}
+		snprintf(line, sizeof(line), "%u of %u frames allocated", f.allocating, f.count);
+		out << line << std::endl;
+		for (unsigned int k = 1; k < MEMORY_OWNERS && owners()[k].load(memory_order_acquire); k++)
+		{
+			if (owners()[k].load(memory_order_acquire) == retired())
+				continue;
+			snprintf(line, sizeof(line), "cloth %u: live %.1f KB, peak %.1f KB", k, owned()[k].live.load(memory_order_relaxed) / 1024.0,
+				owned()[k].peak.load(memory_order_relaxed) / 1024.0);
+			out << line << std::endl;
+		}
+	}
+
+private:
+	struct Counters
+	{
+		atomic<unsigned long long> allocations{ 0 };
+		atomic<unsigned long long> bytes{ 0 };
+		atomic<long long> live{ 0 };
+		atomic<long long> peak{ 0 };
+	};
+
+	struct Frames
+	{
+		Totals previous, last, most;
+		unsigned int count = 0, allocating = 0;
+	};
+
+	// function statics of trivial types, usable from operator new before main()
+	static Counters* subsystems()
+	{
+		static Counters counters[MEMORY_SUBSYSTEMS];
+		return counters;
+	}
+
+	static Counters* owned()
+	{
+		static Counters counters[MEMORY_OWNERS];
+		return counters;
+	}
+
+	static atomic<const void*>* owners()
+	{
+		static atomic<const void*> slots[MEMORY_OWNERS];
+		return slots;
+	}
+
+	// marks the slot of a destroyed cloth
+	static const void* retired()
+	{
+		static const char mark = 0;
+		return &mark;
+	}
+
+	static Frames& frames()
+	{
+		static Frames f;
+		return f;
+	}
+
+	static void raise(Counters& counters, size_t bytes)
+	{
+		long long live = counters.live.fetch_add((long long)bytes, memory_order_relaxed) + (long long)bytes;
+		long long peak = counters.peak.load(memory_order_relaxed);
+		while (live > peak && !counters.peak.compare_exchange_weak(peak, live, memory_order_relaxed))
+			;
+	}
+};
+
+// charges the allocations of the calling thread to a subsystem and cloth until the end of the scope,
+// without a cloth the current one is kept
+class MemoryScope {
+public:
+	MemoryScope(MemorySubsystem subsystem, const void* cloth) : saved(MemoryTracker::current())
+	{
+		MemoryTag& tag = MemoryTracker::current();
+		tag.subsystem = (unsigned char)subsystem;
+		tag.owner = MemoryTracker::owner(cloth);
+	}
+
+	MemoryScope(MemorySubsystem subsystem) : saved(MemoryTracker::current())
+	{
+		MemoryTracker::current().subsystem = (unsigned char)subsystem;
+	}
+
+	~MemoryScope()
+	{
+		MemoryTracker::current() = saved;
+	}
+
+private:
+	MemoryTag saved;
+};
+#endif
@@ -7,11 +7,19 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 #include "shader.h"
+#include "mesh_optimizer.h"
 
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstddef>
 using namespace std;
 
+// changed vertices closer than this in the buffer are uploaded with one call, including the ones between
+#define UPLOAD_GAP 64
+
 struct Vertex {
     // position
     glm::vec3 Position;
@@ -22,6 +30,93 @@ struct Vertex {
     }
 };
 
+// compact render vertex: position quantized to 16 bits inside the mesh bounds and
+// normal octahedral encoded into two 8 bit snorms (about a degree off), 8 bytes instead of 24
+struct PackedVertex {
+    unsigned short Position[3];
+    signed char Normal[2];
+};
+
+// pack vertices [begin, end) into an already sized packed array with known bounds, ranges can be packed in parallel
+template <typename Vertices, typename Normals>
+void packVertexRange(const Vertices &vertices, const Normals &normals, vector<PackedVertex> &packed, glm::vec3 boundsMin, glm::vec3 boundsExtent, unsigned int begin, unsigned int end)
+{
+    glm::vec3 scale = 65535.0f / boundsExtent;
+    for (unsigned int i = begin; i < end; i++)
+    {
+        glm::vec3 q = (vertices[i].Position - boundsMin) * scale + 0.5f;
+        packed[i].Position[0] = (unsigned short)q.x;
+        packed[i].Position[1] = (unsigned short)q.y;
+        packed[i].Position[2] = (unsigned short)q.z;
+    }
+
+    bool hasNormals = normals.size() == vertices.size();
+    for (unsigned int i = begin; i < end; i++)
+    {
+        glm::vec3 n = hasNormals ? normals[i] : glm::vec3(0.0f, 0.0f, 1.0f);
+        n /= fabs(n.x) + fabs(n.y) + fabs(n.z);
+        float sx = n.x >= 0.0f ? 1.0f : -1.0f;
+        float sy = n.y >= 0.0f ? 1.0f : -1.0f;
+        float ox = n.z >= 0.0f ? n.x : (1.0f - fabs(n.y)) * sx;
+        float oy = n.z >= 0.0f ? n.y : (1.0f - fabs(n.x)) * sy;
+        packed[i].Normal[0] = hasNormals ? (signed char)(ox * 127.0f + 0.5f * sx) : 0;
+        packed[i].Normal[1] = hasNormals ? (signed char)(oy * 127.0f + 0.5f * sy) : 0;
+    }
+}
+
+// quantize positions relative to their bounding box and encode normals (left zero if normals is empty),
+// each stream is packed in its own branch-free loop so the compiler can vectorize it
+template <typename Vertices, typename Normals>
+void packVertices(const Vertices &vertices, const Normals &normals, vector<PackedVertex> &packed, glm::vec3 &boundsMin, glm::vec3 &boundsExtent)
+{
+    glm::vec3 lo(FLT_MAX), hi(-FLT_MAX);
+    for (unsigned int i = 0; i < vertices.size(); i++)
+    {
+        lo = glm::min(lo, vertices[i].Position);
+        hi = glm::max(hi, vertices[i].Position);
+    }
+    boundsMin = lo;
+    boundsExtent = glm::max(hi - lo, glm::vec3(1e-6f));
+
+    packed.resize(vertices.size());
+    packVertexRange(vertices, normals, packed, boundsMin, boundsExtent, 0, vertices.size());
+}
+
+// every edge of a triangle list once, two vertex indices per edge sorted by the first and then the second.
+// edges are bucketed by their smaller vertex, so only the few edges of every vertex need sorting
+inline vector<unsigned int> triangleEdges(const vector<unsigned int> &indices)
+{
+    unsigned int vertexCount = 0;
+    for (unsigned int i = 0; i < indices.size(); i++)
+        vertexCount = max(vertexCount, indices[i] + 1);
+    vector<unsigned int> offsets(vertexCount + 1, 0);
+    for (unsigned int i = 0; i < indices.size(); i++)
+        offsets[min(indices[i], indices[i - i % 3 + (i + 1) % 3]) + 1]++;
+    for (unsigned int i = 0; i < vertexCount; i++)
+        offsets[i + 1] += offsets[i];
+    vector<unsigned int> seconds(indices.size());
+    vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+    for (unsigned int i = 0; i < indices.size(); i++)
+    {
+        unsigned int a = indices[i];
+        unsigned int b = indices[i - i % 3 + (i + 1) % 3];
+        seconds[fill[min(a, b)]++] = max(a, b);
+    }
+
+    vector<unsigned int> lines;
+    for (unsigned int v = 0; v < vertexCount; v++)
+    {
+        sort(seconds.begin() + offsets[v], seconds.begin() + offsets[v + 1]);
+        for (unsigned int i = offsets[v]; i < offsets[v + 1]; i++)
+            if (i == offsets[v] || seconds[i] != seconds[i - 1])
+            {
+                lines.push_back(v);
+                lines.push_back(seconds[i]);
+            }
+    }
+    return lines;
+}
+
 struct Texture {
     unsigned int id;
     string type;
@@ -33,17 +128,34 @@ public:
     // default constructor
     Mesh() = default;
 
-    // constructor
-    Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures)
+    // constructor, optimize reorders triangles and vertices for the GPU caches,
+    // vertices passed to the update functions afterwards are still in the original order
+    Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures, bool optimize = false)
     {
         this->vertices = vertices;
         this->indices = indices;
         this->textures = textures;
 
+        if (optimize)
+            optimizeMesh();
+        // 16 bit indices whenever they can address all vertices
+        indexType = vertices.size() <= 65536 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+
         // now that we have all the required data, set the vertex buffers and its attribute pointers.
         setupMesh();
     }
 
+    // average cache miss ratio of the index buffer before and after optimization
+    float getACMRBefore()
+    {
+        return acmrBefore;
+    }
+
+    float getACMRAfter()
+    {
+        return acmrAfter;
+    }
+
     // render the mesh
     void Draw(Shader &shader) 
     {
@@ -73,33 +185,190 @@ public:
             glBindTexture(GL_TEXTURE_2D, textures[i].id);
         }
         
+        // tell the vertex shader how to decode positions and normals
+        setDecodeUniforms(shader);
+
         // draw mesh
         glBindVertexArray(VAO);
-        glDrawElements(GL_TRIANGLES, static_cast<unsigned int>(indices.size()), GL_UNSIGNED_INT, 0);
+        glDrawElements(GL_TRIANGLES, static_cast<unsigned int>(indices.size()), indexType, 0);
         glBindVertexArray(0);
 
         // always good practice to set everything back to defaults once configured.
         glActiveTexture(GL_TEXTURE0);
     }
 
-    void updateVertices(vector<Vertex> vertices)
+    // render the line index buffer (see setLines()) with GL_LINES, each edge is drawn once
+    void DrawLines(Shader &shader)
+    {
+        if (LBO == 0)
+        {
+            Draw(shader);
+            return;
+        }
+
+        setDecodeUniforms(shader);
+
+        glBindVertexArray(VAO);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, LBO);
+        glDrawElements(GL_LINES, lineCount * 2, indexType, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        glBindVertexArray(0);
+    }
+
+    // line topology for wireframe, two vertex indices per edge
+    void setLines(vector<unsigned int> lines)
+    {
+        lineCount = lines.size() / 2;
+        if (!inverseRemap.empty())
+            for (unsigned int i = 0; i < lines.size(); i++)
+                lines[i] = inverseRemap[lines[i]];
+        glBindVertexArray(VAO);
+        if (LBO == 0)
+            glGenBuffers(1, &LBO);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, LBO);
+        uploadIndices(lines);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        glBindVertexArray(0);
+    }
+
+    // render the mesh once per model matrix with a single instanced draw call
+    void DrawInstanced(Shader &shader, const vector<glm::mat4> &models)
+    {
+        if (models.empty())
+            return;
+
+        setDecodeUniforms(shader);
+        bindInstances(models);
+        glDrawElementsInstanced(GL_TRIANGLES, static_cast<unsigned int>(indices.size()), indexType, 0, static_cast<unsigned int>(models.size()));
+        glBindVertexArray(0);
+    }
+
+    // the wireframe once per model matrix, the triangles without line topology
+    void DrawLinesInstanced(Shader &shader, const vector<glm::mat4> &models)
+    {
+        if (LBO == 0)
+        {
+            DrawInstanced(shader, models);
+            return;
+        }
+        if (models.empty())
+            return;
+
+        setDecodeUniforms(shader);
+        bindInstances(models);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, LBO);
+        glDrawElementsInstanced(GL_LINES, lineCount * 2, indexType, 0, static_cast<unsigned int>(models.size()));
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        glBindVertexArray(0);
+    }
+
+    void updateVertices(const vector<Vertex> &vertices)
     {
         this->vertices = vertices;
+        if (!remap.empty())
+            for (unsigned int i = 0; i < remap.size(); i++)
+                this->vertices[i] = vertices[remap[i]];
         glBindVertexArray(VAO);
         glBindBuffer(GL_ARRAY_BUFFER, VBO);
         
-        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STREAM_DRAW);
+        glBufferData(GL_ARRAY_BUFFER, this->vertices.size() * sizeof(Vertex), &this->vertices[0], GL_STREAM_DRAW);
+        if (quantized)
+            setFloatAttributes();
         
         glBindBuffer(GL_ARRAY_BUFFER, 0);
         glBindVertexArray(0);
     }
 
+    // upload packed vertices (see packVertices()) instead of float positions and normals
+    void updatePackedVertices(const vector<PackedVertex> &packed, glm::vec3 boundsMin, glm::vec3 boundsExtent)
+    {
+        this->boundsMin = boundsMin;
+        this->boundsExtent = boundsExtent;
+        glBindVertexArray(VAO);
+        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+
+        const vector<PackedVertex> &data = remapped(packed, packedScratch);
+        glBufferData(GL_ARRAY_BUFFER, data.size() * sizeof(PackedVertex), &data[0], GL_STREAM_DRAW);
+        if (!quantized)
+        {
+            quantized = true;
+            glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(PackedVertex), (void*)offsetof(PackedVertex, Position));
+            glVertexAttribPointer(1, 2, GL_BYTE, GL_TRUE, sizeof(PackedVertex), (void*)offsetof(PackedVertex, Normal));
+            glEnableVertexAttribArray(1);
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindVertexArray(0);
+    }
+
+    // upload only the vertices in ranges, begin and end pairs in the original order, in the last full upload's format
+    void updateVertexRanges(const vector<Vertex> &vertices, const vector<unsigned int> &ranges)
+    {
+        if (quantized || this->vertices.size() != vertices.size())
+        {
+            updateVertices(vertices);
+            return;
+        }
+        uploadRanges(VBO, vertices, this->vertices, ranges);
+    }
+
+    // ranges of packed vertices, everything is uploaded again if the bounds moved
+    void updatePackedRanges(const vector<PackedVertex> &packed, glm::vec3 boundsMin, glm::vec3 boundsExtent, const vector<unsigned int> &ranges)
+    {
+        if (!quantized || boundsMin != this->boundsMin || boundsExtent != this->boundsExtent || packedScratch.size() != packed.size())
+        {
+            updatePackedVertices(packed, boundsMin, boundsExtent);
+            return;
+        }
+        uploadRanges(VBO, packed, packedScratch, ranges);
+    }
+
+    // normals of the vertices in ranges, the others keep what was uploaded before
+    void updateNormalRanges(const vector<glm::vec3> &normals, const vector<unsigned int> &ranges)
+    {
+        if (NBO == 0 || normalScratch.size() != normals.size())
+        {
+            updateNormals(normals);
+            return;
+        }
+        uploadRanges(NBO, normals, normalScratch, ranges);
+    }
+
+    // vertex normals live in their own buffer at location 1, only meshes drawn lit need them
+    void updateNormals(const vector<glm::vec3> &normals)
+    {
+        glBindVertexArray(VAO);
+        if (NBO == 0)
+        {
+            glGenBuffers(1, &NBO);
+            if (!quantized)
+            {
+                glBindBuffer(GL_ARRAY_BUFFER, NBO);
+                glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
+                glEnableVertexAttribArray(1);
+            }
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, NBO);
+
+        const vector<glm::vec3> &data = remapped(normals, normalScratch);
+        glBufferData(GL_ARRAY_BUFFER, data.size() * sizeof(glm::vec3), &data[0], GL_STREAM_DRAW);
+
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindVertexArray(0);
+    }
+
     // Deallocate memory
     void Delete()
     {
         glDeleteVertexArrays(1, &VAO);
         glDeleteBuffers(1, &VBO);
         glDeleteBuffers(1, &EBO);
+        if (NBO != 0)
+            glDeleteBuffers(1, &NBO);
+        if (LBO != 0)
+            glDeleteBuffers(1, &LBO);
+        if (instanceVBO != 0)
+            glDeleteBuffers(1, &instanceVBO);
     }
 
 private:
@@ -110,6 +379,21 @@ private:
     unsigned int VAO;
     // render data 
     unsigned int VBO, EBO;
+    unsigned int NBO = 0;
+    unsigned int LBO = 0; // line indices
+    unsigned int lineCount = 0;
+    unsigned int instanceVBO = 0;
+    // index format and vertex order after optimization
+    GLenum indexType = GL_UNSIGNED_INT;
+    vector<unsigned int> remap;        // original index of every GPU vertex, empty if not reordered
+    vector<unsigned int> inverseRemap; // GPU index of every original vertex
+    vector<glm::vec3> normalScratch;   // last uploaded normals and packed vertices in GPU order
+    vector<PackedVertex> packedScratch;
+    vector<unsigned int> dirty;
+    float acmrBefore = 0.0f, acmrAfter = 0.0f;
+    // packed vertex format and its decoding bounds
+    bool quantized = false;
+    glm::vec3 boundsMin, boundsExtent;
 
     // initializes all the buffer objects/arrays
     void setupMesh()
@@ -128,7 +412,7 @@ private:
         glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STREAM_DRAW);  
 
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+        uploadIndices(indices);
 
         // set the vertex attribute pointers
         // vertex Positions	
@@ -138,5 +422,129 @@ private:
         glBindBuffer(GL_ARRAY_BUFFER, 0);
         glBindVertexArray(0);
     }
+
+    // triangle order for the post-transform cache, then vertex order for fetch locality
+    void optimizeMesh()
+    {
+        acmrBefore = computeACMR(indices, vertices.size());
+        indices = optimizeVertexCache(indices, vertices.size());
+        acmrAfter = computeACMR(indices, vertices.size());
+
+        remap = optimizeVertexFetch(indices, vertices.size());
+        inverseRemap.resize(remap.size());
+        vector<Vertex> original = vertices;
+        for (unsigned int i = 0; i < remap.size(); i++)
+        {
+            vertices[i] = original[remap[i]];
+            inverseRemap[remap[i]] = i;
+        }
+    }
+
+    // upload to the bound element buffer in the mesh's index type
+    void uploadIndices(const vector<unsigned int> &data)
+    {
+        if (indexType == GL_UNSIGNED_SHORT)
+        {
+            vector<unsigned short> shorts(data.begin(), data.end());
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, shorts.size() * sizeof(unsigned short), &shorts[0], GL_STATIC_DRAW);
+        }
+        else
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, data.size() * sizeof(unsigned int), &data[0], GL_STATIC_DRAW);
+    }
+
+    // per-vertex data in GPU order, kept in scratch for later range uploads
+    template <typename T>
+    const vector<T> &remapped(const vector<T> &data, vector<T> &scratch)
+    {
+        if (remap.empty())
+        {
+            scratch = data;
+            return scratch;
+        }
+        scratch.resize(remap.size());
+        for (unsigned int i = 0; i < remap.size(); i++)
+            scratch[i] = data[remap[i]];
+        return scratch;
+    }
+
+    // copy the vertices in ranges into the GPU order copy of buffer and upload the changed runs of it
+    template <typename T>
+    void uploadRanges(unsigned int buffer, const vector<T> &data, vector<T> &copy, const vector<unsigned int> &ranges)
+    {
+        dirty.clear();
+        for (unsigned int r = 0; r + 1 < ranges.size(); r += 2)
+            for (unsigned int i = ranges[r]; i < ranges[r + 1]; i++)
+            {
+                unsigned int gpu = remap.empty() ? i : inverseRemap[i];
+                copy[gpu] = data[i];
+                dirty.push_back(gpu);
+            }
+        if (dirty.empty())
+            return;
+        if (!remap.empty())
+            sort(dirty.begin(), dirty.end());
+
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        unsigned int k = 0;
+        while (k < dirty.size())
+        {
+            unsigned int begin = dirty[k], end = dirty[k] + 1;
+            for (k++; k < dirty.size() && dirty[k] <= end + UPLOAD_GAP; k++)
+                end = dirty[k] + 1;
+            glBufferSubData(GL_ARRAY_BUFFER, begin * sizeof(T), (end - begin) * sizeof(T), &copy[begin]);
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    void setDecodeUniforms(Shader &shader)
+    {
+        shader.setBool("quantized", quantized);
+        if (quantized)
+        {
+            shader.setVec3("boundsMin", boundsMin);
+            shader.setVec3("boundsExtent", boundsExtent);
+        }
+    }
+
+    // back from packed to float positions, normals come from their own buffer again
+    // (expects VAO and VBO to be bound)
+    void setFloatAttributes()
+    {
+        quantized = false;
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
+        if (NBO != 0)
+        {
+            glBindBuffer(GL_ARRAY_BUFFER, NBO);
+            glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
+        }
+        else
+            glDisableVertexAttribArray(1);
+    }
+
+    // bind the VAO with the model matrices uploaded to the instance buffer
+    void bindInstances(const vector<glm::mat4> &models)
+    {
+        glBindVertexArray(VAO);
+        if (instanceVBO == 0)
+            setupInstances();
+        glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+        glBufferData(GL_ARRAY_BUFFER, models.size() * sizeof(glm::mat4), &models[0], GL_STREAM_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    // per-instance model matrices, a mat4 takes 4 attribute slots starting at location 4
+    // (expects VAO to be bound)
+    void setupInstances()
+    {
+        glGenBuffers(1, &instanceVBO);
+        glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+        for (unsigned int i = 0; i < 4; i++)
+        {
+            glVertexAttribPointer(4 + i, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4), (void*)(i * sizeof(glm::vec4)));
+            glEnableVertexAttribArray(4 + i);
+            glVertexAttribDivisor(4 + i, 1);
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,148 @@
+#ifndef MESH_OPTIMIZER_H
+#define MESH_OPTIMIZER_H
+
+#include <vector>
+
+using namespace std;
+
+#define VERTEX_CACHE_SIZE 16
+
+// average cache miss ratio: transformed vertices per triangle with a FIFO post-transform cache,
+// 0.5 is the ideal for a large regular grid and 3 means no reuse at all
+inline float computeACMR(const vector<unsigned int>& indices, unsigned int vertexCount, unsigned int cacheSize = VERTEX_CACHE_SIZE)
+{
+	if (indices.empty())
+		return 0.0f;
+
+	// a vertex is in the cache if it was loaded less than cacheSize misses ago
+	vector<unsigned int> loaded(vertexCount, 0);
+	unsigned int misses = 0;
+	for (unsigned int i = 0; i < indices.size(); i++)
+	{
+		unsigned int v = indices[i];
+		if (loaded[v] == 0 || misses - (loaded[v] - 1) >= cacheSize)
+		{
+			misses++;
+			loaded[v] = misses;
+		}
+	}
+	return (float)misses / (float)(indices.size() / 3);
+}
+
+// reorder triangles for the post-transform vertex cache,
+// Tipsify from Sander et al. "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw"
+inline vector<unsigned int> optimizeVertexCache(const vector<unsigned int>& indices, unsigned int vertexCount, unsigned int cacheSize = VERTEX_CACHE_SIZE)
+{
+	unsigned int triCount = indices.size() / 3;
+
+	// vertex to triangle adjacency
+	vector<unsigned int> offsets(vertexCount + 1, 0);
+	for (unsigned int i = 0; i < indices.size(); i++)
+		offsets[indices[i] + 1]++;
+	for (unsigned int i = 0; i < vertexCount; i++)
+		offsets[i + 1] += offsets[i];
+	vector<unsigned int> adjacency(indices.size());
+	vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+	for (unsigned int i = 0; i < indices.size(); i++)
+		adjacency[fill[indices[i]]++] = i / 3;
+
+	vector<unsigned int> live(vertexCount);
+	for (unsigned int i = 0; i < vertexCount; i++)
+		live[i] = offsets[i + 1] - offsets[i];
+	vector<unsigned int> timestamps(vertexCount, 0);
+	vector<bool> emitted(triCount, false);
+	vector<unsigned int> deadEnd;
+	vector<unsigned int> candidates;
+	vector<unsigned int> result;
+	result.reserve(indices.size());
+
+	unsigned int time = cacheSize + 1;
+	unsigned int cursor = 0;
+	int fanning = vertexCount > 0 ? 0 : -1;
+	while (fanning >= 0)
+	{
+		// emit all triangles around the fanning vertex
+		candidates.clear();
+		for (unsigned int k = offsets[fanning]; k < offsets[fanning + 1]; k++)
+		{
+			unsigned int t = adjacency[k];
+			if (emitted[t])
+				continue;
+			for (unsigned int c = 0; c < 3; c++)
+			{
+				unsigned int v = indices[3 * t + c];
+				result.push_back(v);
+				deadEnd.push_back(v);
+				candidates.push_back(v);
+				live[v]--;
+				if (time - timestamps[v] > cacheSize)
+					timestamps[v] = time++;
+			}
+			emitted[t] = true;
+		}
+
+		// next fanning vertex: the candidate that stays longest in cache with its remaining triangles
+		int next = -1;
+		int best = -1;
+		for (unsigned int i = 0; i < candidates.size(); i++)
+		{
+			unsigned int v = candidates[i];
+			if (live[v] == 0)
+				continue;
+			int priority = 0;
+			if (time - timestamps[v] + 2 * live[v] <= cacheSize)
+				priority = time - timestamps[v];
+			if (priority > best)
+			{
+				best = priority;
+				next = v;
+			}
+		}
+
+		// dead end: fall back to recently used vertices, then to input order
+		while (next < 0 && !deadEnd.empty())
+		{
+			unsigned int v = deadEnd.back();
+			deadEnd.pop_back();
+			if (live[v] > 0)
+				next = v;
+		}
+		while (next < 0 && cursor < vertexCount)
+		{
+			if (live[cursor] > 0)
+				next = cursor;
+			cursor++;
+		}
+		fanning = next;
+	}
+	return result;
+}
+
+// renumber vertices in order of first use so vertex fetch walks memory forward,
+// rewrites indices and returns the old index of every new vertex
+inline vector<unsigned int> optimizeVertexFetch(vector<unsigned int>& indices, unsigned int vertexCount)
+{
+	vector<unsigned int> newIndex(vertexCount, ~0u);
+	vector<unsigned int> remap;
+	remap.reserve(vertexCount);
+	for (unsigned int i = 0; i < indices.size(); i++)
+	{
+		unsigned int v = indices[i];
+		if (newIndex[v] == ~0u)
+		{
+			newIndex[v] = remap.size();
+			remap.push_back(v);
+		}
+		indices[i] = newIndex[v];
+	}
+
+	// unreferenced vertices go to the end
+	for (unsigned int v = 0; v < vertexCount; v++)
+		if (newIndex[v] == ~0u)
+		{
+			newIndex[v] = remap.size();
+			remap.push_back(v);
+		}
+	return remap;
+}
+#endif
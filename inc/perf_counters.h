@@ -0,0 +1,156 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// hardware events counted per thread
+enum PerfCounter
+{
+	COUNTER_CYCLES,
+	COUNTER_INSTRUCTIONS,
+	COUNTER_L1_MISSES, // level 1 data cache read misses
+	COUNTER_LLC_MISSES, // last level cache misses
+	COUNTER_BRANCH_MISSES,
+	COUNTER_COUNT
+};
+
+struct CounterValues
+{
+	unsigned long long values[COUNTER_COUNT] = {};
+
+	CounterValues& operator+=(const CounterValues& other)
+	{
+		for (unsigned int c = 0; c < COUNTER_COUNT; c++)
+			values[c] += other.values[c];
+		return *this;
+	}
+
+	CounterValues operator-(const CounterValues& other) const
+	{
+		CounterValues result;
+		for (unsigned int c = 0; c < COUNTER_COUNT; c++)
+			result.values[c] = values[c] - other.values[c];
+		return result;
+	}
+};
+
+// the hardware counters of the calling thread through perf_event_open, user space only. all of them are
+// one group so they count over the same time, events the CPU or the kernel doesn't offer are left out
+// and stay zero. on other systems nothing can be opened
+class PerfCounters {
+public:
+	PerfCounters() = default;
+
+	PerfCounters(const PerfCounters&) = delete;
+	PerfCounters& operator=(const PerfCounters&) = delete;
+
+	~PerfCounters()
+	{
+		close();
+	}
+
+	// start counting on the calling thread, false if no counter could be opened
+	bool open()
+	{
+		close();
+#ifdef __linux__
+		const unsigned int types[COUNTER_COUNT] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE };
+		const unsigned long long configs[COUNTER_COUNT] = {
+			PERF_COUNT_HW_CPU_CYCLES,
+			PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+			PERF_COUNT_HW_CACHE_MISSES,
+			PERF_COUNT_HW_BRANCH_MISSES
+		};
+		for (unsigned int c = 0; c < COUNTER_COUNT; c++)
+		{
+			perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = types[c];
+			attr.config = configs[c];
+			attr.disabled = leader < 0; // the group starts when the leader is enabled
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+			int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+			if (fd < 0)
+				continue;
+			if (leader < 0)
+				leader = fd;
+			fds[c] = fd;
+			slots[c] = opened++;
+		}
+		if (leader < 0)
+			return false;
+		ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	void close()
+	{
+#ifdef __linux__
+		for (unsigned int c = 0; c < COUNTER_COUNT; c++)
+		{
+			if (fds[c] >= 0 && fds[c] != leader)
+				::close(fds[c]);
+		}
+		if (leader >= 0)
+			::close(leader);
+#endif
+		for (unsigned int c = 0; c < COUNTER_COUNT; c++)
+		{
+			fds[c] = -1;
+			slots[c] = -1;
+		}
+		leader = -1;
+		opened = 0;
+	}
+
+	bool isOpen() const
+	{
+		return leader >= 0;
+	}
+
+	// whether the counter could be opened, the others always read zero
+	bool has(PerfCounter counter) const
+	{
+		return fds[counter] >= 0;
+	}
+
+	// counts since open(), scaled up if the kernel had to share the hardware with other groups
+	CounterValues read() const
+	{
+		CounterValues result;
+#ifdef __linux__
+		unsigned long long data[3 + COUNTER_COUNT];
+		if (leader < 0 || ::read(leader, data, sizeof(data)) < (ssize_t)((3 + opened) * sizeof(unsigned long long)))
+			return result;
+		double scale = data[2] > 0 && data[2] < data[1] ? (double)data[1] / (double)data[2] : 1.0;
+		for (unsigned int c = 0; c < COUNTER_COUNT; c++)
+		{
+			if (slots[c] >= 0)
+				result.values[c] = (unsigned long long)(data[3 + slots[c]] * scale);
+		}
+#endif
+		return result;
+	}
+
+private:
+	int fds[COUNTER_COUNT] = { -1, -1, -1, -1, -1 };
+	int slots[COUNTER_COUNT] = { -1, -1, -1, -1, -1 }; // position in a group read
+	int leader = -1;
+	unsigned int opened = 0;
+};
+#endif
@@ -0,0 +1,458 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "perf_counters.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// scoped timers for the hot paths, recorded only when built with PBD_PROFILE defined. otherwise
+// PROFILE_SCOPE, PROFILE_PHASE, PROFILE_FRAME and PROFILE_THREAD expand to nothing and cost nothing
+#define PROFILE_EVENTS 65536 // per thread, the oldest events are overwritten
+#define PROFILE_FRAMES 1024  // frames in a rolling frame time histogram
+#define PROFILE_HISTOGRAMS 8 // frame loops that can be tracked
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#ifdef PBD_PROFILE
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name)
+#define PROFILE_PHASE(name, particles) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(name, particles)
+#define PROFILE_FRAME(name) Profiler::instance().frame(name)
+#define PROFILE_THREAD(name) Profiler::instance().setThreadName(name)
+#else
+#define PROFILE_SCOPE(name)
+#define PROFILE_PHASE(name, particles)
+#define PROFILE_FRAME(name)
+#define PROFILE_THREAD(name)
+#endif
+
+// one timed scope, in nanoseconds since the profiler started
+struct ProfileEvent
+{
+	const char* name; // string literal, only the pointer is stored
+	long long start, duration;
+};
+
+// hardware counters of all scopes of one name, see Profiler::setCounting()
+struct PhaseCounters
+{
+	const char* name;
+	unsigned long long calls = 0;
+	unsigned long long particles = 0; // given to PROFILE_PHASE, for misses per particle
+	CounterValues counts;
+};
+
+// events of one thread. only that thread writes, export reads the slots and afterwards drops
+// the ones that may have been overwritten meanwhile, so neither side ever waits
+class ProfileRing {
+public:
+	ProfileRing(unsigned int tid) : tid(tid) {}
+
+	// hardware counters of this thread, opened on the first counted scope
+	bool openCounters()
+	{
+		if (!countersTried)
+		{
+			countersTried = true;
+			counters.open();
+		}
+		return counters.isOpen();
+	}
+
+	CounterValues readCounters()
+	{
+		return counters.read();
+	}
+
+	void addCounters(const char* name, unsigned long long particles, const CounterValues& counts)
+	{
+		lock_guard<mutex> guard(phaseLock);
+		unsigned int p = 0;
+		while (p < phases.size() && phases[p].name != name)
+			p++;
+		if (p == phases.size())
+		{
+			phases.push_back(PhaseCounters());
+			phases[p].name = name;
+		}
+		phases[p].calls++;
+		phases[p].particles += particles;
+		phases[p].counts += counts;
+	}
+
+	// counters of every scope name, while the thread keeps counting
+	vector<PhaseCounters> phaseCounters()
+	{
+		lock_guard<mutex> guard(phaseLock);
+		return phases;
+	}
+
+	void clearCounters()
+	{
+		lock_guard<mutex> guard(phaseLock);
+		phases.clear();
+	}
+
+	void push(const char* name, long long start, long long duration)
+	{
+		unsigned long long at = written.load(memory_order_relaxed);
+		Slot& slot = slots[at % PROFILE_EVENTS];
+		slot.name.store(name, memory_order_relaxed);
+		slot.start.store(start, memory_order_relaxed);
+		slot.duration.store(duration, memory_order_relaxed);
+		written.store(at + 1, memory_order_release);
+	}
+
+	// append the events still in the ring in the order they ended
+	void copy(vector<ProfileEvent>& events)
+	{
+		unsigned long long end = written.load(memory_order_acquire);
+		unsigned long long begin = end > PROFILE_EVENTS ? end - PROFILE_EVENTS : 0;
+		size_t first = events.size();
+		for (unsigned long long i = begin; i < end; i++)
+		{
+			const Slot& slot = slots[i % PROFILE_EVENTS];
+			events.push_back({ slot.name.load(memory_order_relaxed), slot.start.load(memory_order_relaxed), slot.duration.load(memory_order_relaxed) });
+		}
+		// the writer may already be filling the slot of event after, which is event after - PROFILE_EVENTS
+		atomic_thread_fence(memory_order_acquire);
+		unsigned long long after = written.load(memory_order_relaxed);
+		if (after + 1 > begin + PROFILE_EVENTS)
+		{
+			size_t lost = (size_t)min(after + 1 - begin - PROFILE_EVENTS, end - begin);
+			events.erase(events.begin() + first, events.begin() + first + lost);
+		}
+	}
+
+	const unsigned int tid;
+	string threadName;
+
+private:
+	struct Slot
+	{
+		atomic<const char*> name{ NULL };
+		atomic<long long> start{ 0 }, duration{ 0 };
+	};
+	Slot slots[PROFILE_EVENTS];
+	atomic<unsigned long long> written{ 0 };
+
+	PerfCounters counters;
+	bool countersTried = false;
+	mutex phaseLock; // only taken by the thread itself and by reports
+	vector<PhaseCounters> phases;
+};
+
+// time between consecutive frames of one loop over the last PROFILE_FRAMES frames
+class FrameHistogram {
+public:
+	// one thread marks the frames, any thread may read the percentiles
+	void mark(long long now)
+	{
+		if (last >= 0)
+		{
+			unsigned int at = count.load(memory_order_relaxed);
+			frames[at % PROFILE_FRAMES].store((float)((now - last) * 1e-6), memory_order_relaxed);
+			count.store(at + 1, memory_order_release);
+		}
+		last = now;
+	}
+
+	// frame times in milliseconds, oldest first
+	vector<float> times()
+	{
+		unsigned int end = count.load(memory_order_acquire);
+		unsigned int begin = end > PROFILE_FRAMES ? end - PROFILE_FRAMES : 0;
+		vector<float> result;
+		for (unsigned int i = begin; i < end; i++)
+			result.push_back(frames[i % PROFILE_FRAMES].load(memory_order_relaxed));
+		return result;
+	}
+
+	// p in [0, 1], 0.5 for the median
+	static float percentile(vector<float> sorted, float p)
+	{
+		if (sorted.empty())
+			return 0.0f;
+		sort(sorted.begin(), sorted.end());
+		return sorted[min((size_t)(p * sorted.size()), sorted.size() - 1)];
+	}
+
+	atomic<const char*> name{ NULL }; // claimed once by the loop's thread
+
+private:
+	long long last = -1;
+	atomic<float> frames[PROFILE_FRAMES];
+	atomic<unsigned int> count{ 0 };
+};
+
+class Profiler {
+public:
+	static Profiler& instance()
+	{
+		static Profiler profiler;
+		return profiler;
+	}
+
+	long long now() const
+	{
+		return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - epoch).count();
+	}
+
+	// events of the calling thread, created on first use
+	ProfileRing& ring()
+	{
+		thread_local ProfileRing* mine = NULL;
+		if (!mine)
+		{
+			lock_guard<mutex> guard(lock);
+			rings.push_back(unique_ptr<ProfileRing>(new ProfileRing(rings.size() + 1)));
+			mine = rings.back().get();
+		}
+		return *mine;
+	}
+
+	// shown for the calling thread in the trace, call before it records anything else
+	void setThreadName(const char* name)
+	{
+		ProfileRing& mine = ring();
+		lock_guard<mutex> guard(lock);
+		mine.threadName = name;
+	}
+
+	// read the hardware counters around every scope from now on, a lot slower than timing alone. the
+	// counts so far are cleared, false if the counters can't be opened (other systems than Linux,
+	// virtual machines without a PMU, perf_event_paranoid above 2)
+	bool setCounting(bool enabled)
+	{
+		{
+			lock_guard<mutex> guard(lock);
+			for (unsigned int i = 0; i < rings.size(); i++)
+				rings[i]->clearCounters();
+		}
+		if (enabled && !ring().openCounters())
+		{
+			std::cout << "ERROR::PROFILER::COUNTERS_UNAVAILABLE" << std::endl;
+			enabled = false;
+		}
+		counting.store(enabled, memory_order_relaxed);
+		return enabled;
+	}
+
+	bool isCounting() const
+	{
+		return counting.load(memory_order_relaxed);
+	}
+
+	// end of a frame of the loop called name, one thread per loop
+	void frame(const char* name)
+	{
+		FrameHistogram* histogram = findHistogram(name);
+		if (histogram)
+			histogram->mark(now());
+	}
+
+	// every recorded event as Chrome trace JSON, for chrome://tracing or ui.perfetto.dev
+	bool writeChromeTrace(const char* path)
+	{
+		FILE* file = fopen(path, "w");
+		if (!file)
+		{
+			std::cout << "ERROR::PROFILER::FILE_NOT_CREATED: " << path << std::endl;
+			return false;
+		}
+		fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+		bool first = true;
+		vector<ProfileEvent> events;
+		unsigned int threads;
+		{
+			lock_guard<mutex> guard(lock);
+			threads = rings.size();
+		}
+		for (unsigned int t = 0; t < threads; t++)
+		{
+			ProfileRing* ring;
+			string threadName;
+			{
+				lock_guard<mutex> guard(lock);
+				ring = rings[t].get();
+				threadName = ring->threadName;
+			}
+			if (!threadName.empty())
+			{
+				fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+					first ? "" : ",\n", ring->tid, threadName.c_str());
+				first = false;
+			}
+			events.clear();
+			ring->copy(events);
+			for (unsigned int i = 0; i < events.size(); i++)
+			{
+				fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", first ? "" : ",\n",
+					events[i].name, ring->tid, events[i].start * 1e-3, events[i].duration * 1e-3);
+				first = false;
+			}
+		}
+		fprintf(file, "\n]}\n");
+		return fclose(file) == 0;
+	}
+
+	// p50, p99 and worst frame time of every frame loop, and how the frames spread over power of two buckets
+	void report(ostream& out)
+	{
+		for (unsigned int h = 0; h < PROFILE_HISTOGRAMS; h++)
+		{
+			FrameHistogram& histogram = histograms[h];
+			const char* name = histogram.name.load(memory_order_acquire);
+			if (!name)
+				break;
+			vector<float> times = histogram.times();
+			if (times.empty())
+				continue;
+			char line[128];
+			snprintf(line, sizeof(line), "%s: %u frames, p50 %.2f ms, p99 %.2f ms, max %.2f ms", name, (unsigned int)times.size(),
+				FrameHistogram::percentile(times, 0.5f), FrameHistogram::percentile(times, 0.99f), *max_element(times.begin(), times.end()));
+			out << line << std::endl;
+
+			unsigned int buckets[16] = {};
+			for (unsigned int i = 0; i < times.size(); i++)
+			{
+				unsigned int b = 0;
+				while (b < 15 && times[i] >= (float)(1 << b))
+					b++;
+				buckets[b]++;
+			}
+			for (unsigned int b = 0; b < 16; b++)
+			{
+				if (!buckets[b])
+					continue;
+				snprintf(line, sizeof(line), "  %s%5u ms %6u ", b < 15 ? "< " : ">=", 1u << min(b, 14u), buckets[b]);
+				out << line << string((buckets[b] * 40 + times.size() - 1) / times.size(), '#') << std::endl;
+			}
+		}
+	}
+
+	// per scope name summed over all threads: IPC and cache and branch misses per particle
+	void reportCounters(ostream& out)
+	{
+		vector<PhaseCounters> phases;
+		{
+			lock_guard<mutex> guard(lock);
+			for (unsigned int i = 0; i < rings.size(); i++)
+			{
+				vector<PhaseCounters> thread = rings[i]->phaseCounters();
+				for (unsigned int k = 0; k < thread.size(); k++)
+				{
+					unsigned int p = 0;
+					while (p < phases.size() && strcmp(phases[p].name, thread[k].name) != 0)
+						p++;
+					if (p == phases.size())
+						phases.push_back(thread[k]);
+					else
+					{
+						phases[p].calls += thread[k].calls;
+						phases[p].particles += thread[k].particles;
+						phases[p].counts += thread[k].counts;
+					}
+				}
+			}
+		}
+		sort(phases.begin(), phases.end(), [](const PhaseCounters& a, const PhaseCounters& b) {
+			return a.counts.values[COUNTER_CYCLES] > b.counts.values[COUNTER_CYCLES];
+		});
+
+		char line[160];
+		snprintf(line, sizeof(line), "%-20s %8s %10s %6s %12s %12s %12s", "phase", "calls", "Mcycles", "IPC", "L1 miss/p", "LLC miss/p", "br miss/p");
+		out << line << std::endl;
+		for (unsigned int p = 0; p < phases.size(); p++)
+		{
+			const unsigned long long* v = phases[p].counts.values;
+			double particles = (double)phases[p].particles;
+			auto perParticle = [particles](unsigned long long count) {
+				return particles > 0.0 ? count / particles : 0.0;
+			};
+			snprintf(line, sizeof(line), "%-20s %8llu %10.2f %6.2f %12.3f %12.3f %12.3f", phases[p].name, phases[p].calls,
+				v[COUNTER_CYCLES] * 1e-6, v[COUNTER_CYCLES] ? (double)v[COUNTER_INSTRUCTIONS] / v[COUNTER_CYCLES] : 0.0,
+				perParticle(v[COUNTER_L1_MISSES]), perParticle(v[COUNTER_LLC_MISSES]), perParticle(v[COUNTER_BRANCH_MISSES]));
+			out << line << std::endl;
+		}
+	}
+
+private:
+	chrono::steady_clock::time_point epoch = chrono::steady_clock::now();
+	atomic<bool> counting{ false };
+	mutex lock;
+	vector<unique_ptr<ProfileRing>> rings;
+	FrameHistogram histograms[PROFILE_HISTOGRAMS];
+
+	Profiler() = default;
+
+	// names are string literals, the first free slot is claimed under the lock
+	FrameHistogram* findHistogram(const char* name)
+	{
+		for (unsigned int h = 0; h < PROFILE_HISTOGRAMS; h++)
+		{
+			if (histograms[h].name.load(memory_order_acquire) == name)
+				return &histograms[h];
+		}
+		lock_guard<mutex> guard(lock);
+		for (unsigned int h = 0; h < PROFILE_HISTOGRAMS; h++)
+		{
+			const char* claimed = histograms[h].name.load(memory_order_relaxed);
+			if (claimed == name)
+				return &histograms[h];
+			if (!claimed)
+			{
+				histograms[h].name.store(name, memory_order_release);
+				return &histograms[h];
+			}
+		}
+		return NULL;
+	}
+};
+
+// records the time from construction to the end of the scope, nothing if name is NULL. while the
+// profiler is counting, the hardware counters as well, over particles particles for a phase
+class ProfileScope {
+public:
+	ProfileScope(const char* name, unsigned long long particles = 0) : name(name), particles(particles)
+	{
+		if (!name)
+			return;
+		Profiler& profiler = Profiler::instance();
+		if (profiler.isCounting() && profiler.ring().openCounters())
+		{
+			counting = true;
+			counts = profiler.ring().readCounters();
+		}
+		start = profiler.now();
+	}
+
+	~ProfileScope()
+	{
+		if (!name)
+			return;
+		Profiler& profiler = Profiler::instance();
+		ProfileRing& ring = profiler.ring();
+		ring.push(name, start, profiler.now() - start);
+		if (counting)
+			ring.addCounters(name, particles, ring.readCounters() - counts);
+	}
+
+private:
+	const char* name;
+	unsigned long long particles;
+	long long start = 0;
+	bool counting = false;
+	CounterValues counts;
+};
+#endif
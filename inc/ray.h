@@ -0,0 +1,57 @@
+#ifndef RAY_H
+#define RAY_H
+
+#include <glm/glm.hpp>
+
+#include <cmath>
+
+struct Ray
+{
+	glm::vec3 origin;
+	glm::vec3 dir; // normalized
+
+	Ray(glm::vec3 origin, glm::vec3 dir) : origin(origin), dir(glm::normalize(dir)) {}
+
+	glm::vec3 at(float t) const
+	{
+		return origin + t * dir;
+	}
+};
+
+// Moller-Trumbore ray/triangle test, on hit gives distance t and barycentric (u, v) of b and c
+inline bool intersectTriangle(const Ray& ray, glm::vec3 a, glm::vec3 b, glm::vec3 c, float& t, float& u, float& v)
+{
+	glm::vec3 ab = b - a;
+	glm::vec3 ac = c - a;
+	glm::vec3 p = glm::cross(ray.dir, ac);
+	float det = glm::dot(ab, p);
+	if (fabs(det) < 1e-10f)
+		return false;
+
+	float inv_det = 1.0f / det;
+	glm::vec3 s = ray.origin - a;
+	u = glm::dot(s, p) * inv_det;
+	if (u < 0.0f || u > 1.0f)
+		return false;
+
+	glm::vec3 q = glm::cross(s, ab);
+	v = glm::dot(ray.dir, q) * inv_det;
+	if (v < 0.0f || u + v > 1.0f)
+		return false;
+
+	t = glm::dot(ac, q) * inv_det;
+	return t > 0.0f;
+}
+
+// slab test, returns entry distance or a negative value if the box is missed
+inline float intersectBox(const Ray& ray, glm::vec3 inv_dir, glm::vec3 box_min, glm::vec3 box_max)
+{
+	glm::vec3 t0 = (box_min - ray.origin) * inv_dir;
+	glm::vec3 t1 = (box_max - ray.origin) * inv_dir;
+	glm::vec3 t_near = glm::min(t0, t1);
+	glm::vec3 t_far = glm::max(t0, t1);
+	float enter = glm::max(glm::max(t_near.x, t_near.y), glm::max(t_near.z, 0.0f));
+	float exit = glm::min(glm::min(t_far.x, t_far.y), t_far.z);
+	return enter <= exit ? enter : -1.0f;
+}
+#endif
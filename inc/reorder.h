@@ -0,0 +1,182 @@
+#ifndef REORDER_H
+#define REORDER_H
+
+#include <glm/glm.hpp>
+
+#include "mesh.h"
+
+#include <vector>
+#include <algorithm>
+#include <cfloat>
+
+using namespace std;
+
+// particle orderings for meshes that do not come with a good one
+enum ParticleOrder
+{
+	ORDER_NONE,   // keep the order of the source
+	ORDER_MORTON, // z-order curve through the bounding box
+	ORDER_RCM     // reverse Cuthill-McKee, small bandwidth of the edge graph
+};
+
+// spread the lower 10 bits of x so there are two zero bits between each
+inline unsigned int expandBits(unsigned int x)
+{
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x030000ff;
+	x = (x | (x << 8)) & 0x0300f00f;
+	x = (x | (x << 4)) & 0x030c30c3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+// old index of every particle sorted by 30 bit morton code of its position
+inline vector<unsigned int> mortonOrder(const vector<Vertex>& vertices)
+{
+	glm::vec3 lo(FLT_MAX), hi(-FLT_MAX);
+	for (unsigned int i = 0; i < vertices.size(); i++)
+	{
+		lo = glm::min(lo, vertices[i].Position);
+		hi = glm::max(hi, vertices[i].Position);
+	}
+	glm::vec3 scale = 1023.0f / glm::max(hi - lo, glm::vec3(1e-6f));
+
+	vector<pair<unsigned int, unsigned int>> codes(vertices.size());
+	for (unsigned int i = 0; i < vertices.size(); i++)
+	{
+		glm::vec3 q = (vertices[i].Position - lo) * scale;
+		codes[i].first = (expandBits((unsigned int)q.x) << 2) | (expandBits((unsigned int)q.y) << 1) | expandBits((unsigned int)q.z);
+		codes[i].second = i;
+	}
+	sort(codes.begin(), codes.end());
+
+	vector<unsigned int> order(vertices.size());
+	for (unsigned int i = 0; i < codes.size(); i++)
+		order[i] = codes[i].second;
+	return order;
+}
+
+// old index of every particle in reverse Cuthill-McKee order of the triangle edge graph,
+// each connected component starts from a vertex of minimum degree
+inline vector<unsigned int> reverseCuthillMcKee(unsigned int vertexCount, const vector<unsigned int>& indices)
+{
+	vector<unsigned int> lines = triangleEdges(indices);
+	vector<unsigned int> offsets(vertexCount + 1, 0);
+	for (unsigned int i = 0; i < lines.size(); i++)
+		offsets[lines[i] + 1]++;
+	for (unsigned int i = 0; i < vertexCount; i++)
+		offsets[i + 1] += offsets[i];
+	vector<unsigned int> neighbors(lines.size());
+	vector<unsigned int> fill(offsets.begin(), offsets.end() - 1);
+	for (unsigned int i = 0; i < lines.size(); i += 2)
+	{
+		neighbors[fill[lines[i]]++] = lines[i + 1];
+		neighbors[fill[lines[i + 1]]++] = lines[i];
+	}
+
+	// seeds in order of increasing degree
+	vector<unsigned int> seeds(vertexCount);
+	for (unsigned int i = 0; i < vertexCount; i++)
+		seeds[i] = i;
+	stable_sort(seeds.begin(), seeds.end(), [&](unsigned int a, unsigned int b) {
+		return offsets[a + 1] - offsets[a] < offsets[b + 1] - offsets[b];
+	});
+
+	vector<unsigned int> order;
+	order.reserve(vertexCount);
+	vector<bool> visited(vertexCount, false);
+	vector<unsigned int> next;
+	for (unsigned int s = 0; s < vertexCount; s++)
+	{
+		if (visited[seeds[s]])
+			continue;
+		visited[seeds[s]] = true;
+		order.push_back(seeds[s]);
+		// breadth first, neighbors by increasing degree
+		for (unsigned int head = order.size() - 1; head < order.size(); head++)
+		{
+			unsigned int v = order[head];
+			next.clear();
+			for (unsigned int k = offsets[v]; k < offsets[v + 1]; k++)
+				if (!visited[neighbors[k]])
+				{
+					visited[neighbors[k]] = true;
+					next.push_back(neighbors[k]);
+				}
+			sort(next.begin(), next.end(), [&](unsigned int a, unsigned int b) {
+				return offsets[a + 1] - offsets[a] < offsets[b + 1] - offsets[b];
+			});
+			order.insert(order.end(), next.begin(), next.end());
+		}
+	}
+	reverse(order.begin(), order.end());
+	return order;
+}
+
+// reorder particles in place and rewrite the triangles,
+// returns the source index of every particle so callers can map external indices
+inline vector<unsigned int> reorderParticles(vector<Vertex>& vertices, vector<unsigned int>& indices, ParticleOrder order)
+{
+	vector<unsigned int> permutation;
+	if (order == ORDER_MORTON)
+		permutation = mortonOrder(vertices);
+	else if (order == ORDER_RCM)
+		permutation = reverseCuthillMcKee(vertices.size(), indices);
+	else
+	{
+		permutation.resize(vertices.size());
+		for (unsigned int i = 0; i < vertices.size(); i++)
+			permutation[i] = i;
+		return permutation;
+	}
+
+	vector<unsigned int> inverse(permutation.size());
+	vector<Vertex> original = vertices;
+	for (unsigned int i = 0; i < permutation.size(); i++)
+	{
+		vertices[i] = original[permutation[i]];
+		inverse[permutation[i]] = i;
+	}
+	for (unsigned int i = 0; i < indices.size(); i++)
+		indices[i] = inverse[indices[i]];
+	return permutation;
+}
+
+// cache misses of one sweep over the constraint edges, reading both particle positions,
+// in an 8-way set associative LRU cache (default 32 KB of 64 byte lines, like a typical L1)
+inline unsigned int estimateCacheMisses(const vector<unsigned int>& endpoints, unsigned int elementSize, unsigned int cacheLines = 512, unsigned int lineBytes = 64)
+{
+	const unsigned int ways = 8;
+	unsigned int sets = max(cacheLines / ways, 1u);
+	vector<unsigned long long> tags(sets * ways, ~0ull);
+	vector<unsigned int> ages(sets * ways, 0);
+	unsigned int misses = 0;
+	unsigned int clock = 0;
+	for (unsigned int i = 0; i < endpoints.size(); i++)
+	{
+		unsigned long long line = (unsigned long long)endpoints[i] * elementSize / lineBytes;
+		unsigned int set = line % sets;
+		unsigned int oldest = set * ways;
+		bool hit = false;
+		clock++;
+		for (unsigned int w = set * ways; w < (set + 1) * ways; w++)
+		{
+			if (tags[w] == line)
+			{
+				ages[w] = clock;
+				hit = true;
+				break;
+			}
+			if (ages[w] < ages[oldest])
+				oldest = w;
+		}
+		if (!hit)
+		{
+			misses++;
+			tags[oldest] = line;
+			ages[oldest] = clock;
+		}
+	}
+	return misses;
+}
+#endif
@@ -0,0 +1,27 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <glm/glm.hpp>
+
+#include "cloth.h"
+#include "sphere.h"
+#include "world.h"
+#include "loader.h"
+#include "scheduler.h"
+
+#include <vector>
+
+// the scene of the viewer: a cloth from an OBJ or PLY file, the 20x20 grid without one or if it can't be read,
+// and a sphere below it. replays of recorded input build it the same way, a snapshot only restores into
+// a world with the same cloths and colliders
+inline void buildScene(World& world, const char* meshPath, Scheduler* scheduler)
+{
+	vector<Vertex> meshVertices;
+	vector<unsigned int> meshIndices;
+	if (meshPath && MeshLoader(scheduler).load(meshPath, meshVertices, meshIndices))
+		world.addCloth(new Cloth(meshVertices, meshIndices))->setSleeping(true);
+	else
+		world.addCloth(new Cloth(20, 20))->setSleeping(true);
+	world.addCollider(Sphere(0.2f, glm::vec3(0.f, -0.7f, -0.5f)));
+}
+#endif
@@ -0,0 +1,287 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "profiler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+#define TASK_QUEUE_SIZE 256 // per thread, a range that can't be split further is run inline
+#define TASKS_PER_THREAD 8 // ranges are split into about this many tasks per thread unless the grain is larger
+#define IDLE_SPIN_TIME 200 // microseconds a worker keeps looking for work before it sleeps
+
+// one executed task, given to the hook set with Scheduler::setTaskHook()
+struct TaskTiming
+{
+	const char* name;
+	unsigned int worker;
+	unsigned int begin, end;
+	chrono::steady_clock::time_point start, stop;
+};
+
+// work stealing thread pool shared by all simulation phases. parallelFor() splits a range in halves
+// down to the grain size, every thread works on its own most recent half and idle threads steal
+// the oldest, largest halves of the others. the calling thread helps until its range is done,
+// so consecutive parallelFor() calls are phases where each one depends on the previous
+class Scheduler {
+public:
+	// workers in addition to the calling thread, 0 runs everything on the caller
+	Scheduler(unsigned int workers = defaultWorkers()) : workers(workers), queues(new Queue[workers + 1])
+	{
+		for (unsigned int i = 0; i < workers; i++)
+			threads.push_back(thread(&Scheduler::work, this, i + 1));
+	}
+
+	Scheduler(const Scheduler&) = delete;
+	Scheduler& operator=(const Scheduler&) = delete;
+
+	~Scheduler()
+	{
+		{
+			lock_guard<mutex> guard(sleepLock);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (unsigned int i = 0; i < threads.size(); i++)
+			threads[i].join();
+	}
+
+	// scheduler with one thread per core, created on first use
+	static Scheduler& shared()
+	{
+		static Scheduler scheduler;
+		return scheduler;
+	}
+
+	static unsigned int defaultWorkers()
+	{
+		unsigned int cores = thread::hardware_concurrency();
+		return cores > 1 ? cores - 1 : 0;
+	}
+
+	// workers plus the calling thread
+	unsigned int threadCount() const
+	{
+		return workers + 1;
+	}
+
+	// index of the current thread in [0, threadCount()), 0 for threads that aren't workers of this scheduler,
+	// for per thread scratch data. only one outside thread may call parallelFor() at a time if it is used
+	unsigned int workerIndex() const
+	{
+		return current().owner == this ? current().index : 0;
+	}
+
+	// called after every task with its timing, set while no parallelFor() is running
+	void setTaskHook(function<void(const TaskTiming&)> hook)
+	{
+		this->hook = hook;
+	}
+
+	// body(first, last) for subranges covering [begin, end), returns when all are done.
+	// ranges are not split below grain items, so grain should cover a few microseconds of work
+	template <typename F>
+	void parallelFor(const char* name, unsigned int begin, unsigned int end, unsigned int grain, const F& body)
+	{
+		if (begin >= end)
+			return;
+		unsigned int count = end - begin;
+		grain = max(max(grain, 1u), count / (threadCount() * TASKS_PER_THREAD));
+
+		Job job;
+		job.name = name;
+		job.run = &invoke<F>;
+		job.body = &body;
+		job.grain = grain;
+		job.remaining.store(count, memory_order_relaxed);
+
+		unsigned int self = workerIndex();
+		job.owner = self;
+		if (count <= grain || workers == 0)
+		{
+			runTask({ &job, begin, end }, self);
+			return;
+		}
+
+		{
+			lock_guard<mutex> guard(sleepLock);
+			activeJobs.fetch_add(1, memory_order_relaxed);
+		}
+		wake.notify_all();
+
+		runTask({ &job, begin, end }, self);
+		while (job.remaining.load(memory_order_acquire) != 0)
+		{
+			Task task;
+			if (findTask(self, task))
+				runTask(task, self);
+			else
+				this_thread::yield();
+		}
+		activeJobs.fetch_sub(1, memory_order_relaxed);
+	}
+
+private:
+	struct Job
+	{
+		const char* name;
+		unsigned int owner; // thread that called parallelFor()
+		void (*run)(const void* body, unsigned int begin, unsigned int end);
+		const void* body;
+		unsigned int grain;
+		atomic<unsigned int> remaining; // items not processed yet
+	};
+
+	struct Task
+	{
+		Job* job;
+		unsigned int begin, end;
+	};
+
+	// the owner pushes and pops at the tail, thieves take from the head
+	struct alignas(64) Queue
+	{
+		mutex lock;
+		Task tasks[TASK_QUEUE_SIZE];
+		unsigned int head = 0, tail = 0;
+	};
+
+	struct Current
+	{
+		const Scheduler* owner = NULL;
+		unsigned int index = 0;
+	};
+
+	const unsigned int workers; // fixed before the threads start, they read it without locking
+	unique_ptr<Queue[]> queues;
+	vector<thread> threads;
+	function<void(const TaskTiming&)> hook;
+
+	mutex sleepLock;
+	condition_variable wake;
+	atomic<unsigned int> activeJobs{ 0 };
+	bool stopping = false;
+
+	template <typename F>
+	static void invoke(const void* body, unsigned int begin, unsigned int end)
+	{
+		(*static_cast<const F*>(body))(begin, end);
+	}
+
+	static Current& current()
+	{
+		thread_local Current current;
+		return current;
+	}
+
+	void work(unsigned int index)
+	{
+		current().owner = this;
+		current().index = index;
+		PROFILE_THREAD("scheduler worker");
+		chrono::steady_clock::time_point idleSince = chrono::steady_clock::now();
+		while (true)
+		{
+			Task task;
+			if (findTask(index, task))
+			{
+				runTask(task, index);
+				idleSince = chrono::steady_clock::now();
+				continue;
+			}
+
+			// keep looking for a while, phases follow each other closely
+			if (activeJobs.load(memory_order_relaxed) > 0 ||
+				chrono::steady_clock::now() - idleSince < chrono::microseconds(IDLE_SPIN_TIME))
+			{
+				this_thread::yield();
+				continue;
+			}
+
+			unique_lock<mutex> guard(sleepLock);
+			wake.wait(guard, [this] { return stopping || activeJobs.load(memory_order_relaxed) > 0; });
+			if (stopping)
+				return;
+			idleSince = chrono::steady_clock::now();
+		}
+	}
+
+	// split off the upper half until the range is down to the grain, then run what is left
+	void runTask(Task task, unsigned int self)
+	{
+		Job* job = task.job;
+		while (task.end - task.begin > job->grain && workers > 0)
+		{
+			unsigned int mid = task.begin + (task.end - task.begin) / 2;
+			if (!push(self, { job, mid, task.end }))
+				break;
+			task.end = mid;
+		}
+
+		// the calling thread has the whole phase in its trace, other threads show every task they ran
+		PROFILE_SCOPE(self != job->owner ? job->name : NULL);
+		if (hook)
+		{
+			TaskTiming timing;
+			timing.name = job->name;
+			timing.worker = self;
+			timing.begin = task.begin;
+			timing.end = task.end;
+			timing.start = chrono::steady_clock::now();
+			job->run(job->body, task.begin, task.end);
+			timing.stop = chrono::steady_clock::now();
+			hook(timing);
+		}
+		else
+			job->run(job->body, task.begin, task.end);
+
+		job->remaining.fetch_sub(task.end - task.begin, memory_order_acq_rel);
+	}
+
+	bool push(unsigned int self, const Task& task)
+	{
+		Queue& queue = queues[self];
+		lock_guard<mutex> guard(queue.lock);
+		if (queue.tail - queue.head == TASK_QUEUE_SIZE)
+			return false;
+		queue.tasks[queue.tail++ % TASK_QUEUE_SIZE] = task;
+		return true;
+	}
+
+	// own newest task first, otherwise the oldest task of another thread
+	bool findTask(unsigned int self, Task& task)
+	{
+		{
+			Queue& queue = queues[self];
+			lock_guard<mutex> guard(queue.lock);
+			if (queue.tail != queue.head)
+			{
+				task = queue.tasks[--queue.tail % TASK_QUEUE_SIZE];
+				return true;
+			}
+		}
+
+		unsigned int count = threadCount();
+		for (unsigned int k = 1; k < count; k++)
+		{
+			Queue& queue = queues[(self + k) % count];
+			lock_guard<mutex> guard(queue.lock);
+			if (queue.tail != queue.head)
+			{
+				task = queue.tasks[queue.head++ % TASK_QUEUE_SIZE];
+				return true;
+			}
+		}
+		return false;
+	}
+};
+#endif
@@ -0,0 +1,381 @@
+#ifndef SIMULATOR_H
+#define SIMULATOR_H
+
+#include <glm/glm.hpp>
+
+#include "cloth.h"
+#include "sphere.h"
+#include "world.h"
+#include "ray.h"
+#include "lockfree.h"
+#include "cache.h"
+#include "exporter.h"
+#include "interaction.h"
+#include "input_log.h"
+#include "profiler.h"
+#include "memory_tracker.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// one cloth of a completed step
+struct ClothFrame
+{
+	vector<Vertex> vertices;
+	vector<Normal> normals; // empty unless requested with setNormalsWanted()
+	vector<PackedVertex> packed; // replaces vertices and normals with setQuantized()
+	bool packedNormals = false; // whether packed holds normals
+	glm::vec3 boundsMin, boundsExtent;
+	unsigned int step = 0; // steps the cloth had taken
+	vector<unsigned int> blockChanged; // see Cloth::getBlockChanges()
+
+	// particle ranges as begin, end pairs that changed after the given step of the cloth
+	void changedSince(unsigned int since, vector<unsigned int>& ranges) const
+	{
+		Cloth::changedRanges(blockChanged, since, max(vertices.size(), packed.size()), ranges);
+	}
+};
+
+// completed simulation step published to the renderer, cloths and colliders in world order
+struct Frame
+{
+	vector<ClothFrame> cloths;
+	vector<Sphere> colliders;
+	unsigned int step = 0;
+};
+
+// steps a world on its own thread at a fixed rate,
+// its cloths and colliders must not be touched by other threads while it runs
+class Simulator {
+public:
+	Simulator(World* world, float timeStep = 1.0f / 60.0f)
+		: world(world), timeStep(timeStep), interaction(world) {}
+
+	void start()
+	{
+		running = true;
+		publish();
+		worker = std::thread(&Simulator::run, this);
+	}
+
+	void stop()
+	{
+		running = false;
+		if (worker.joinable())
+			worker.join();
+		inputWanted = false;
+		updateInputRecording();
+	}
+
+	// called from the window thread, false if the event was dropped
+	bool post(const InputEvent& event)
+	{
+		return events.push(event);
+	}
+
+	// latest completed frame, true if it changed since the last call
+	bool acquire()
+	{
+		return frames.acquire();
+	}
+
+	const Frame& frame() const
+	{
+		return frames.readBuffer();
+	}
+
+	// whether the renderer consumes vertex normals, they are skipped otherwise
+	void setNormalsWanted(bool wanted)
+	{
+		normalsWanted = wanted;
+	}
+
+	// publish the compact render vertex format instead of float positions and normals
+	void setQuantized(bool quantized)
+	{
+		this->quantized = quantized;
+	}
+
+	// append every following step to a cache file, the writer encodes and writes on its own thread
+	bool startRecording(const char* path)
+	{
+		stopRecording();
+		// the topology never changes, so the window thread may read it while the world steps
+		vector<Cloth*> cloths;
+		for (unsigned int i = 0; i < world->clothCount(); i++)
+			cloths.push_back(world->getCloth(i));
+		if (!recorder.open(path, cloths))
+			return false;
+		std::lock_guard<std::mutex> guard(recordLock);
+		recordedCloths = cloths;
+		recording = true;
+		return true;
+	}
+
+	// the file is complete once this returns, false if it couldn't be written. frames gets the frames recorded
+	bool stopRecording(unsigned int* frames = NULL)
+	{
+		if (frames)
+			*frames = 0;
+		{
+			std::lock_guard<std::mutex> guard(recordLock);
+			if (!recording)
+				return false;
+			recording = false;
+		}
+		recorder.close();
+		if (recorder.droppedFrames() > 0)
+			std::cout << "ERROR::CACHE::FRAMES_DROPPED: " << recorder.droppedFrames() << std::endl;
+		if (frames)
+			*frames = recorder.frameCount();
+		return !recorder.hasFailed();
+	}
+
+	// write every following step as mesh files <prefix>_<cloth>_<frame>, the simulation only waits for
+	// the disk when it falls EXPORT_QUEUE frames behind
+	void startExport(const char* prefix, ExportFormat format = EXPORT_PLY)
+	{
+		stopExport();
+		vector<Cloth*> cloths;
+		for (unsigned int i = 0; i < world->clothCount(); i++)
+			cloths.push_back(world->getCloth(i));
+		exporter.open(prefix, cloths, format);
+		std::lock_guard<std::mutex> guard(recordLock);
+		exportedCloths = cloths;
+		exporting = true;
+	}
+
+	// frames exported, all files are written once this returns
+	unsigned int stopExport()
+	{
+		{
+			std::lock_guard<std::mutex> guard(recordLock);
+			if (!exporting)
+				return 0;
+			exporting = false;
+		}
+		exporter.close();
+		return exporter.frameCount();
+	}
+
+	// log the input events handled from the next step on with the state they start from, see InputLog.
+	// the file is written once stopInputRecording() is seen by the simulation thread
+	void startInputRecording(const char* path)
+	{
+		std::lock_guard<std::mutex> guard(recordLock);
+		inputPath = path;
+		inputWanted = true;
+	}
+
+	void stopInputRecording()
+	{
+		inputWanted = false;
+	}
+
+	~Simulator()
+	{
+		stop();
+		stopRecording();
+		stopExport();
+	}
+
+private:
+	World* world;
+	float timeStep;
+	unsigned int step = 0;
+
+	std::thread worker;
+	std::atomic<bool> running{ false };
+	std::atomic<bool> normalsWanted{ false };
+	std::atomic<bool> quantized{ false };
+	SPSCQueue<InputEvent, 256> events;
+	TripleBuffer<Frame> frames;
+
+	// held while the positions of a step are handed to the recorder and the exporter
+	std::mutex recordLock;
+	bool recording = false;
+	vector<Cloth*> recordedCloths;
+	CacheWriter recorder;
+	bool exporting = false;
+	vector<Cloth*> exportedCloths;
+	FrameExporter exporter;
+
+	// only used by the simulation thread
+	bool published = false; // what the last published frame holds, see publishChanged()
+	bool publishedNormals = false, publishedPacked = false;
+	vector<unsigned int> publishedSteps;
+	vector<Sphere> publishedColliders;
+	vector<vector<unsigned int>> publishRanges; // per cloth
+	Interaction interaction;
+	std::atomic<bool> inputWanted{ false };
+	bool inputRecording = false;
+	string inputPath; // under recordLock
+	InputLog inputLog;
+
+	void run()
+	{
+		using clock = std::chrono::steady_clock;
+		clock::duration period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<float>(timeStep));
+		clock::time_point next = clock::now();
+		PROFILE_THREAD("simulation");
+		while (running)
+		{
+			{
+				PROFILE_SCOPE("input");
+				updateInputRecording();
+				InputEvent event;
+				while (events.pop(event))
+				{
+					if (inputRecording)
+						inputLog.add(event);
+					interaction.handle(event);
+				}
+			}
+
+			world->step(timeStep);
+			step++;
+			if (inputRecording)
+				inputLog.stepped();
+			publish();
+			record();
+			PROFILE_FRAME("simulation");
+			MEMORY_FRAME();
+
+			// fixed rate, but don't try to catch up after a stall
+			next += period;
+			clock::time_point now = clock::now();
+			if (next < now)
+				next = now;
+			else
+				std::this_thread::sleep_until(next);
+		}
+	}
+
+	// the buffer to fill holds an older frame, only the blocks that changed since its step are copied,
+	// and nothing is published while the cloths sleep and the colliders stay where they were
+	void publish()
+	{
+		PROFILE_SCOPE("publish");
+		MEMORY_SUBSYSTEM(MEMORY_MESH);
+		bool normals = normalsWanted, packed = quantized;
+		if (!publishChanged(normals, packed))
+			return;
+
+		Frame& frame = frames.writeBuffer();
+		frame.cloths.resize(world->clothCount());
+		publishRanges.resize(world->clothCount());
+		world->forEachCloth("publish", [&](unsigned int i) {
+			Cloth* cloth = world->getCloth(i);
+			MEMORY_SCOPE(MEMORY_MESH, cloth);
+			ClothFrame& out = frame.cloths[i];
+			unsigned int particles = cloth->particleCount();
+			// a buffer of another cloth or format is filled from scratch
+			bool same = out.step <= cloth->stepCount() && out.blockChanged.size() == cloth->getBlockChanges().size();
+			if (normals)
+				cloth->computeNormals();
+			if (packed)
+			{
+				same = same && out.packedNormals == normals;
+				cloth->packVertices(out.packed, out.boundsMin, out.boundsExtent, normals, same ? (int)out.step : -1);
+				out.packedNormals = normals;
+				out.vertices.clear();
+				out.normals.clear();
+			}
+			else
+			{
+				vector<unsigned int>& ranges = publishRanges[i];
+				Cloth::changedRanges(cloth->getBlockChanges(), out.step, particles, ranges);
+				copyRanges(cloth->getVertices(), out.vertices, same ? &ranges : NULL);
+				if (normals)
+					copyRanges(cloth->getNormals(), out.normals, same ? &ranges : NULL);
+				else
+					out.normals.clear();
+				out.packed.clear();
+			}
+			out.step = cloth->stepCount();
+			out.blockChanged.assign(cloth->getBlockChanges().begin(), cloth->getBlockChanges().end());
+		});
+		frame.colliders.resize(world->colliderCount());
+		for (unsigned int i = 0; i < world->colliderCount(); i++)
+			frame.colliders[i] = *world->getCollider(i);
+		frame.step = step;
+		frames.publish();
+	}
+
+	// whether the frame to publish differs from the last one published, remembers it if so
+	bool publishChanged(bool normals, bool packed)
+	{
+		bool changed = !published || normals != publishedNormals || packed != publishedPacked
+			|| publishedSteps.size() != world->clothCount() || publishedColliders.size() != world->colliderCount();
+		for (unsigned int i = 0; i < world->clothCount() && !changed; i++)
+			changed = world->getCloth(i)->changedSince(publishedSteps[i]);
+		for (unsigned int i = 0; i < world->colliderCount() && !changed; i++)
+			changed = world->getCollider(i)->getOrigin() != publishedColliders[i].getOrigin()
+				|| world->getCollider(i)->getRadius() != publishedColliders[i].getRadius();
+		if (!changed)
+			return false;
+
+		published = true;
+		publishedNormals = normals;
+		publishedPacked = packed;
+		publishedSteps.resize(world->clothCount());
+		for (unsigned int i = 0; i < world->clothCount(); i++)
+			publishedSteps[i] = world->getCloth(i)->stepCount();
+		publishedColliders.resize(world->colliderCount());
+		for (unsigned int i = 0; i < world->colliderCount(); i++)
+			publishedColliders[i] = *world->getCollider(i);
+		return true;
+	}
+
+	// copy the particle ranges (begin, end pairs) of source into a copy of it, all of it without ranges
+	template <typename T>
+	static void copyRanges(const SimVector<T>& source, vector<T>& copy, const vector<unsigned int>* ranges)
+	{
+		if (!ranges || copy.size() != source.size())
+		{
+			copy.assign(source.begin(), source.end());
+			return;
+		}
+		for (unsigned int k = 0; k < ranges->size(); k += 2)
+			std::copy(source.begin() + (*ranges)[k], source.begin() + (*ranges)[k + 1], copy.begin() + (*ranges)[k]);
+	}
+
+	void record()
+	{
+		PROFILE_SCOPE("record");
+		MEMORY_SUBSYSTEM(MEMORY_IO);
+		std::lock_guard<std::mutex> guard(recordLock);
+		if (recording)
+			recorder.append(recordedCloths);
+		if (exporting)
+			exporter.append(exportedCloths);
+	}
+
+	// start or finish the input log between steps. starting waits for a drag to end, a replay
+	// wouldn't know what was picked
+	void updateInputRecording()
+	{
+		if (inputWanted == inputRecording || (inputWanted && interaction.isDragging()))
+			return;
+		inputRecording = inputWanted;
+		if (inputRecording)
+		{
+			inputLog.begin(*world, interaction, timeStep);
+			return;
+		}
+		inputLog.end(*world);
+		string path;
+		{
+			std::lock_guard<std::mutex> guard(recordLock);
+			path = inputPath;
+		}
+		if (inputLog.save(path.c_str()))
+			std::cout << "recorded " << inputLog.getEvents().size() << " input events over " << inputLog.stepCount()
+				<< " steps to " << path << std::endl;
+	}
+};
+#endif
@@ -9,6 +9,7 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 #include "mesh.h"
+#include "ray.h"
 
 #include <vector>
 
@@ -22,34 +23,67 @@ public:
 	Sphere() = default;
 
 	// constructor
-	Sphere(float radius) : radius(radius), origin(glm::vec3()) 
+	Sphere(float radius) : radius(radius), origin(glm::vec3()) {}
+
+	Sphere(float radius, glm::vec3 origin) : radius(radius), origin(origin) {}
+
+	// render the sphere
+	void Draw(Shader& shader)
 	{
-		generateMesh();
+		shader.setMat4("model", getModel());
+		unitMesh().Draw(shader);
 	}
-	
-	Sphere(float radius, glm::vec3 origin) : radius(radius), origin(origin) 
+
+	// render the wireframe, every edge once
+	void DrawLines(Shader& shader)
 	{
-		generateMesh();
+		shader.setMat4("model", getModel());
+		unitMesh().DrawLines(shader);
 	}
 
-	// render the sphere
-	void Draw(Shader& shader)
+	// render many spheres with one instanced draw call (shader takes the model matrix per instance)
+	static void DrawInstanced(Shader& shader, const vector<Sphere>& spheres)
 	{
-		mesh.Draw(shader);
+		unitMesh().DrawInstanced(shader, models(spheres));
+	}
+
+	// the same for the wireframes
+	static void DrawLinesInstanced(Shader& shader, const vector<Sphere>& spheres)
+	{
+		unitMesh().DrawLinesInstanced(shader, models(spheres));
 	}
 
 	// update the sphere according to the direction
 	void update(glm::vec3 dir)
 	{
 		origin += dir;
-		for (unsigned int i = 0; i < ROWS; i++)
-			for (unsigned int j = 0; j < COLS; j++)
-			{
-				float theta = j * 2.0f * PI / COLS;
-				float phi = i * 1.0f * PI / ROWS;
-				vertices[i * COLS + j].Position += dir;
-			}
-		mesh.updateVertices(vertices);
+	}
+
+	// transformation from the unit sphere mesh to world
+	glm::mat4 getModel() const
+	{
+		glm::mat4 model = glm::translate(glm::mat4(1.0f), origin);
+		return glm::scale(model, glm::vec3(radius));
+	}
+
+	// distance to the first hit along the ray
+	bool intersect(const Ray& ray, float& t)
+	{
+		glm::vec3 oc = ray.origin - origin;
+		float b = glm::dot(oc, ray.dir);
+		float c = glm::dot(oc, oc) - radius * radius;
+		float disc = b * b - c;
+		if (disc < 0.0f)
+			return false;
+		t = -b - sqrt(disc);
+		if (t < 0.0f)
+			t = -b + sqrt(disc);
+		return t >= 0.0f;
+	}
+
+	void setOrigin(glm::vec3 origin)
+	{
+		this->origin = origin;
 	}
 
 	glm::vec3 getOrigin()
@@ -62,20 +96,36 @@ public:
 		return radius;
 	}
 
-	~Sphere()
+	// release the shared mesh, call before the OpenGL context is destroyed
+	static void DeleteMesh()
 	{
-		mesh.Delete();
+		unitMesh().Delete();
 	}
 
 private:
-	vector<Vertex> vertices;
-
 	float radius;
 	glm::vec3 origin;
-	Mesh mesh;
 
-	void generateMesh()
+	// model matrices of the spheres, kept between frames
+	static const vector<glm::mat4>& models(const vector<Sphere>& spheres)
 	{
+		static vector<glm::mat4> result;
+		result.resize(spheres.size());
+		for (unsigned int i = 0; i < spheres.size(); i++)
+			result[i] = spheres[i].getModel();
+		return result;
+	}
+
+	// all spheres share one static unit sphere mesh, created on first draw
+	static Mesh& unitMesh()
+	{
+		static Mesh mesh = generateMesh();
+		return mesh;
+	}
+
+	static Mesh generateMesh()
+	{
+		vector<Vertex> vertices;
 		for(unsigned int i = 0; i < ROWS; i++)
 			for (unsigned int j = 0; j < COLS; j++)
 			{
@@ -83,11 +133,10 @@ private:
 				float theta = j * 2.0f * PI / COLS;
 				float phi = i * 1.0f * PI / ROWS;
 
-				v.Position.x = radius * cos(theta) * sin(phi);
-				v.Position.y = radius * sin(theta) * sin(phi);
-				v.Position.z = radius * cos(phi);
-				
-				v.Position += origin;
+				v.Position.x = cos(theta) * sin(phi);
+				v.Position.y = sin(theta) * sin(phi);
+				v.Position.z = cos(phi);
+
 				vertices.push_back(v);
 			}
 		vector<unsigned int> indices;
@@ -103,8 +152,16 @@ private:
 				indices.push_back((i + 1) * COLS + (j + 1) % COLS);
 			}
 
+		// normal of the unit sphere is the position itself
+		vector<glm::vec3> normals;
+		for (unsigned int i = 0; i < vertices.size(); i++)
+			normals.push_back(vertices[i].Position);
+
 		vector<Texture> textures; // now is empty;
-		mesh = Mesh(vertices, indices, textures);
+		Mesh mesh(vertices, indices, textures, true);
+		mesh.updateNormals(normals);
+		mesh.setLines(triangleEdges(indices));
+		return mesh;
 	}
 };
 #endif
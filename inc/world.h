@@ -0,0 +1,250 @@
+#ifndef WORLD_H
+#define WORLD_H
+
+#include "cloth.h"
+#include "sphere.h"
+#include "broadphase.h"
+#include "scheduler.h"
+#include "mapped_file.h"
+#include "profiler.h"
+#include "memory_tracker.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+// seconds spent in the last World::step()
+struct WorldTiming
+{
+	double step = 0.0;       // wall time of the whole step
+	double broadphase = 0.0; // building the shared collider data
+	double clothSum = 0.0;   // all cloths added up
+	double clothMax = 0.0;   // slowest cloth, no number of threads makes a step shorter than this
+	vector<double> cloth;    // every cloth in the order they were added, from start to end of its update, which
+	                         // includes other tasks the thread ran while it waited for its own phases
+	unsigned int steps = 0;  // steps taken so far
+	double total = 0.0;      // wall time of all of them
+};
+
+// start of a world snapshot, followed by origin and radius of every collider and the snapshot of every cloth
+struct WorldSnapshot
+{
+	char magic[4]; // "PBDW"
+	unsigned int version;
+	unsigned int cloths, colliders;
+};
+
+// owns all cloths and colliders of a scene and steps them together. every cloth is one task on the
+// scheduler and cloths large enough to be split run their own phases on it as well, so small and
+// large garments share the threads. colliders go into one broadphase per step that all cloths query
+class World {
+public:
+	World(Scheduler* scheduler = NULL) : scheduler(scheduler) {}
+
+	World(const World&) = delete;
+	World& operator=(const World&) = delete;
+
+	// the world takes ownership
+	Cloth* addCloth(Cloth* cloth)
+	{
+		cloth->setScheduler(scheduler);
+		cloths.push_back(unique_ptr<Cloth>(cloth));
+		timing.cloth.push_back(0.0);
+
+		// largest cloths first so none of them is started last
+		order.push_back(cloths.size() - 1);
+		stable_sort(order.begin(), order.end(), [this](unsigned int a, unsigned int b) {
+			return cloths[a]->particleCount() > cloths[b]->particleCount();
+		});
+		return cloth;
+	}
+
+	Sphere* addCollider(const Sphere& sphere)
+	{
+		colliders.push_back(unique_ptr<Sphere>(new Sphere(sphere)));
+		return colliders.back().get();
+	}
+
+	unsigned int clothCount()
+	{
+		return cloths.size();
+	}
+
+	Cloth* getCloth(unsigned int i)
+	{
+		return cloths[i].get();
+	}
+
+	unsigned int colliderCount()
+	{
+		return colliders.size();
+	}
+
+	Sphere* getCollider(unsigned int i)
+	{
+		return colliders[i].get();
+	}
+
+	void step(float dt)
+	{
+		PROFILE_SCOPE("world step");
+		MEMORY_SUBSYSTEM(MEMORY_SOLVER_SCRATCH);
+		using clock = chrono::steady_clock;
+		clock::time_point start = clock::now();
+
+		{
+			PROFILE_SCOPE("broadphase");
+			broadphase.clear();
+			for (unsigned int i = 0; i < colliders.size(); i++)
+				broadphase.add(colliders[i].get());
+			broadphase.build();
+		}
+		clock::time_point built = clock::now();
+
+		forEachCloth("step cloth", [&](unsigned int i) {
+			clock::time_point begin = clock::now();
+			cloths[i]->update(dt, broadphase);
+			timing.cloth[i] = chrono::duration<double>(clock::now() - begin).count();
+		});
+
+		timing.step = chrono::duration<double>(clock::now() - start).count();
+		timing.broadphase = chrono::duration<double>(built - start).count();
+		timing.clothSum = 0.0;
+		timing.clothMax = 0.0;
+		for (unsigned int i = 0; i < timing.cloth.size(); i++)
+		{
+			timing.clothSum += timing.cloth[i];
+			timing.clothMax = max(timing.clothMax, timing.cloth[i]);
+		}
+		timing.steps++;
+		timing.total += timing.step;
+	}
+
+	// state of all cloths and colliders in one blob, see Cloth::snapshot()
+	void snapshot(vector<char>& blob)
+	{
+		MEMORY_SUBSYSTEM(MEMORY_IO);
+		WorldSnapshot header = { { 'P', 'B', 'D', 'W' }, SNAPSHOT_VERSION, (unsigned int)cloths.size(), (unsigned int)colliders.size() };
+		blob.resize(sizeof(header) + colliders.size() * sizeof(glm::vec4));
+		memcpy(&blob[0], &header, sizeof(header));
+		for (unsigned int i = 0; i < colliders.size(); i++)
+		{
+			glm::vec4 sphere(colliders[i]->getOrigin(), colliders[i]->getRadius());
+			memcpy(&blob[sizeof(header) + i * sizeof(glm::vec4)], &sphere, sizeof(sphere));
+		}
+		vector<Sphere*> spheres = colliderList();
+		for (unsigned int i = 0; i < cloths.size(); i++)
+			cloths[i]->snapshot(blob, &spheres);
+	}
+
+	// back to a snapshot of a world with the same cloths and colliders, false and unchanged otherwise
+	bool restore(const char* blob, size_t size)
+	{
+		MEMORY_SUBSYSTEM(MEMORY_IO);
+		WorldSnapshot header;
+		if (size < sizeof(header))
+			return false;
+		memcpy(&header, blob, sizeof(header));
+		size_t at = sizeof(header) + header.colliders * sizeof(glm::vec4);
+		if (memcmp(header.magic, "PBDW", 4) != 0 || header.version != SNAPSHOT_VERSION ||
+			header.cloths != cloths.size() || header.colliders != colliders.size() || at > size)
+			return false;
+
+		// all cloths are checked before any of them changes
+		vector<size_t> offsets;
+		for (unsigned int i = 0; i < cloths.size(); i++)
+		{
+			if (at > size || !cloths[i]->canRestore(blob + at, size - at))
+				return false;
+			ClothSnapshot cloth;
+			memcpy(&cloth, blob + at, sizeof(cloth));
+			offsets.push_back(at);
+			at += cloth.size;
+		}
+		vector<Sphere*> spheres = colliderList();
+		for (unsigned int i = 0; i < cloths.size(); i++)
+			cloths[i]->restore(blob + offsets[i], size - offsets[i], &spheres);
+		for (unsigned int i = 0; i < colliders.size(); i++)
+		{
+			glm::vec4 sphere;
+			memcpy(&sphere, blob + sizeof(header) + i * sizeof(glm::vec4), sizeof(sphere));
+			colliders[i]->setOrigin(glm::vec3(sphere));
+		}
+		return true;
+	}
+
+	// snapshot to a file, for warm starts from a settled state
+	bool save(const char* path)
+	{
+		vector<char> blob;
+		snapshot(blob);
+		FILE* file = fopen(path, "wb");
+		bool written = file && fwrite(blob.data(), 1, blob.size(), file) == blob.size();
+		if (file && fclose(file) != 0)
+			written = false;
+		if (!written)
+			std::cout << "ERROR::WORLD::SNAPSHOT_NOT_WRITTEN: " << path << std::endl;
+		return written;
+	}
+
+	// restore from a file written by save(), straight from the mapped file
+	bool load(const char* path)
+	{
+		MappedFile file;
+		if (!file.open(path))
+		{
+			std::cout << "ERROR::WORLD::SNAPSHOT_NOT_READ: " << path << std::endl;
+			return false;
+		}
+		if (!restore(file.data(), file.size()))
+		{
+			std::cout << "ERROR::WORLD::SNAPSHOT_DOES_NOT_MATCH: " << path << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	const WorldTiming& getTiming()
+	{
+		return timing;
+	}
+
+	// body(i) for every cloth, one task each, largest first
+	template <typename F>
+	void forEachCloth(const char* name, const F& body)
+	{
+		PROFILE_SCOPE(name);
+		auto run = [&](unsigned int begin, unsigned int end) {
+			for (unsigned int k = begin; k < end; k++)
+				body(order[k]);
+		};
+		if (scheduler)
+			scheduler->parallelFor(name, 0, order.size(), 1, run);
+		else
+			run(0, order.size());
+	}
+
+private:
+	Scheduler* scheduler;
+	vector<unique_ptr<Cloth>> cloths;
+	vector<unique_ptr<Sphere>> colliders;
+	vector<unsigned int> order; // cloth indices by decreasing particle count
+	Broadphase broadphase;
+	WorldTiming timing;
+
+	// the colliders as the cloths know them, their position in here identifies them in a snapshot
+	vector<Sphere*> colliderList()
+	{
+		vector<Sphere*> spheres;
+		for (unsigned int i = 0; i < colliders.size(); i++)
+			spheres.push_back(colliders[i].get());
+		return spheres;
+	}
+};
+#endif
@@ -5,8 +5,14 @@ uniform mat4 model;
 uniform mat4 view;
 uniform mat4 projection;
 
+// packed vertices carry normalized 16 bit positions inside the mesh bounds
+uniform bool quantized;
+uniform vec3 boundsMin;
+uniform vec3 boundsExtent;
+
 void main()
 {
-	gl_Position = projection * view * model * vec4(aPos, 1.0);
+	vec3 pos = quantized ? boundsMin + aPos * boundsExtent : aPos;
+	gl_Position = projection * view * model * vec4(pos, 1.0);
 	//gl_Position = vec4(aPos, 1.0);
-}
\ No newline at end of file
+}
@@ -0,0 +1,13 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec3 Normal;
+
+uniform vec3 lightDir;
+
+void main()
+{
+    // two sided diffuse, the cloth is seen from both sides
+    float diffuse = abs(dot(normalize(Normal), normalize(-lightDir)));
+    FragColor = vec4(vec3(0.2 + 0.8 * diffuse), 1.0);
+}
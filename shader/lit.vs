@@ -0,0 +1,31 @@
+#version 330 core
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aNormal;
+
+out vec3 Normal;
+
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+
+// packed vertices carry normalized 16 bit positions inside the mesh bounds
+// and octahedral encoded normals
+uniform bool quantized;
+uniform vec3 boundsMin;
+uniform vec3 boundsExtent;
+
+vec3 octDecode(vec2 e)
+{
+	vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+	if (n.z < 0.0)
+		n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	return normalize(n);
+}
+
+void main()
+{
+	vec3 pos = quantized ? boundsMin + aPos * boundsExtent : aPos;
+	vec3 normal = quantized ? octDecode(aNormal.xy) : aNormal;
+	Normal = mat3(transpose(inverse(model))) * normal;
+	gl_Position = projection * view * model * vec4(pos, 1.0);
+}
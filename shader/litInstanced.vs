@@ -0,0 +1,15 @@
+#version 330 core
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aNormal;
+layout (location = 4) in mat4 aModel;
+
+out vec3 Normal;
+
+uniform mat4 view;
+uniform mat4 projection;
+
+void main()
+{
+	Normal = mat3(transpose(inverse(aModel))) * aNormal;
+	gl_Position = projection * view * aModel * vec4(aPos, 1.0);
+}
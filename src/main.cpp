@@ -8,28 +8,60 @@
 #include "shader.h"
 #include "cloth.h"
 #include "sphere.h"
+#include "world.h"
+#include "simulator.h"
+#include "scene.h"
+#include "profiler.h"
+#include "memory_tracker.h"
 
 #include <iostream>
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
 void processInput(GLFWwindow* window);
 void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
+void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods);
+Ray cursorRay(double xpos, double ypos);
+glm::vec3 cameraForward();
 
 // settings
 const unsigned int SCR_WIDTH = 800;
 const unsigned int SCR_HEIGHT = 600;
-unsigned int framebuffer;
 
 // timing
 float deltaTime = 0.0f;
 float lastFrame = 0.0f;
 
-// position
-glm::vec4 lastPos;
-
-// whether is dragging
+// whether the mouse is held down after a click
 bool dragging = false;
 
+// wireframe or lit shading, toggled with L
+bool lit = false;
+
+// upload 16 bit quantized vertices, toggled with Q
+bool quantized = false;
+
+// record the simulation to a cache file with R, play the file back instead of the simulation with P
+const char* CACHE_PATH = "cloth.pbdc";
+bool recording = false;
+bool playing = false;
+float playStart = 0.0f;
+CacheReader playback;
+vector<Vertex> played;
+
+// write every step as binary PLY files, toggled with E
+const char* EXPORT_PREFIX = "cloth";
+bool exporting = false;
+
+// write the recorded scopes as a Chrome trace and print frame time percentiles with T, needs PBD_PROFILE.
+// C toggles reading hardware counters per phase, T prints them as well
+const char* TRACE_PATH = "pbd_trace.json";
+
+// print allocations and footprint per subsystem and cloth with M, needs PBD_MEMORY
+
+// record picking and dragging with I for headless replays (pbd_bench --replay), starts once nothing is dragged
+const char* INPUT_PATH = "input.pbdi";
+bool recordingInput = false;
+
 // view/projection transformations and their reverse
 glm::mat4 projection = glm::perspective(glm::radians(45.0f), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
 glm::mat4 view = glm::lookAt(glm::vec3(1.3f, -0.3f, 1.2f), glm::vec3(0.7f, -0.45f, 0.5f), glm::vec3(-0.1f, 1.0f, -0.1f));
@@ -39,10 +71,20 @@ glm::mat4 view_inverse = glm::inverse(view);
 // world transformation
 glm::mat4 model = glm::mat4(1.0f);
 
-Cloth* cloth;
-Sphere* sphere;
+World* world;
+Simulator* simulator;
 
-int main()
+// what was last uploaded for every cloth, later frames in the same format only upload what changed since
+struct ClothUpload
+{
+	unsigned int step = 0;
+	bool packed = false, normals = false;
+	bool uploaded = false; // false after playback replaced the mesh
+};
+vector<ClothUpload> uploads;
+vector<unsigned int> ranges;
+
+int main(int argc, char** argv)
 {
 	// glfw: initialize and configure
 	// ------------------------------
@@ -67,6 +109,7 @@ int main()
 	glfwMakeContextCurrent(window);
 	glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
 	glfwSetMouseButtonCallback(window, mouseButtonCallback);
+	glfwSetKeyCallback(window, keyCallback);
 
 	// tell GLFW to capture our mouse
 	//glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
@@ -79,8 +122,15 @@ int main()
 		return -1;
 	}
 
-	cloth = new Cloth(20, 20);
-	sphere = new Sphere(0.2f, glm::vec3(0.f, -0.7f, -0.5f));
+	// cloths are stepped in parallel on all cores, large ones also split their own phases
+	world = new World(&Scheduler::shared());
+
+	// an OBJ or PLY file given on the command line replaces the grid cloth
+	buildScene(*world, argc > 1 ? argv[1] : NULL, &Scheduler::shared());
+
+	// the world is stepped on the simulation thread from now on
+	simulator = new Simulator(world);
+	simulator->start();
 
 	// configure global opengl state
 	// -----------------------------
@@ -89,33 +139,14 @@ int main()
 	// build and compile our shader zprogram
 	// ------------------------------------
 	Shader colorShader("colors.vs", "colors.fs");
-	Shader colorIDShader("colors.vs", "colorsID.fs");
-
-	// framebuffer configuration
-	// -------------------------
-	glGenFramebuffers(1, &framebuffer);
-	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
-	// create a color attachment texture
-	unsigned int textureColorbuffer;
-	glGenTextures(1, &textureColorbuffer);
-	glBindTexture(GL_TEXTURE_2D, textureColorbuffer);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, SCR_WIDTH, SCR_HEIGHT, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textureColorbuffer, 0);
-	// create a renderbuffer object for depth and stencil attachment (we won't be sampling these)
-	unsigned int rbo;
-	glGenRenderbuffers(1, &rbo);
-	glBindRenderbuffer(GL_RENDERBUFFER, rbo);
-	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, SCR_WIDTH, SCR_HEIGHT); // use a single renderbuffer object for both a depth AND stencil buffer.
-	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, rbo); // now actually attach it
-	// now that we actually created the framebuffer and added all attachments we want to check if it is actually complete now
-	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
-		cout << "ERROR::FRAMEBUFFER:: Framebuffer is not complete!" << endl;
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	Shader litShader("lit.vs", "lit.fs");
+	// colliders all share the unit sphere mesh and are drawn with one instanced call
+	Shader colorInstancedShader("colorsInstanced.vs", "colors.fs");
+	Shader litInstancedShader("litInstanced.vs", "lit.fs");
 
 	// render loop
 	// -----------
+	PROFILE_THREAD("render");
 	while (!glfwWindowShouldClose(window))
 	{
 		// per-frame time logic
@@ -128,59 +159,115 @@ int main()
 		// -----
 		processInput(window);
 
-		// 1. bind to framebuffer and render sphere to set sphere id
-		glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
-		
-		// make sure we clear the framebuffer's content
-		glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-		// be sure to activate shader when setting uniforms/drawing objects
-		colorIDShader.use();
-
-		colorIDShader.setMat4("projection", projection);
-		colorIDShader.setMat4("view", view);
-		colorIDShader.setMat4("model", model);
-
-		// set default plot mode
-		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-
-		// render sphere
-		sphere->Draw(colorIDShader);
-
-		// 2. Bind back to default framebuffer and draw scene 
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
 		// render
 		// ------
 		glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 		// be sure to activate shader when setting uniforms/drawing objects
-		colorShader.use();
-
-		colorShader.setMat4("projection", projection);
-		colorShader.setMat4("view", view);
-		colorShader.setMat4("model", model);
-
-		// update the cloth, calculate new vertices' velocity, positon and collision
-		cloth->update(deltaTime, sphere);
-
-		// set wire as plot mode
-		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+		Shader& shader = lit ? litShader : colorShader;
+		shader.use();
+
+		shader.setMat4("projection", projection);
+		shader.setMat4("view", view);
+		shader.setMat4("model", model);
+		shader.setVec3("lightDir", glm::vec3(-0.3f, -1.0f, -0.5f));
+
+		// take the latest frame from the simulation thread, sleeping parts of the cloths aren't uploaded again
+		bool fresh = simulator->acquire();
+		const Frame& frame = simulator->frame();
+		if (fresh && !playing)
+		{
+			PROFILE_SCOPE("upload");
+			uploads.resize(frame.cloths.size());
+			for (unsigned int i = 0; i < frame.cloths.size(); i++)
+			{
+				Cloth* cloth = world->getCloth(i);
+				const ClothFrame& clothFrame = frame.cloths[i];
+				ClothUpload& upload = uploads[i];
+				bool packed = !clothFrame.packed.empty(), normals = !clothFrame.normals.empty();
+				if (!upload.uploaded || packed != upload.packed || normals != upload.normals)
+				{
+					if (packed)
+						cloth->updateMeshPacked(clothFrame.packed, clothFrame.boundsMin, clothFrame.boundsExtent);
+					else
+					{
+						cloth->updateMesh(clothFrame.vertices);
+						if (normals)
+							cloth->updateMeshNormals(clothFrame.normals);
+					}
+				}
+				else
+				{
+					clothFrame.changedSince(upload.step, ranges);
+					if (packed)
+						cloth->updateMeshPackedRanges(clothFrame.packed, clothFrame.boundsMin, clothFrame.boundsExtent, ranges);
+					else
+					{
+						cloth->updateMeshRanges(clothFrame.vertices, ranges);
+						if (normals)
+							cloth->updateMeshNormalRanges(clothFrame.normals, ranges);
+					}
+				}
+				upload.step = clothFrame.step;
+				upload.packed = packed;
+				upload.normals = normals;
+				upload.uploaded = true;
+			}
+		}
 
-		// render the cloth
-		cloth->Draw(colorShader);
+		// cached positions at 60 steps per second, looping, frames dropped while recording hold the one before
+		if (playing && playback.stepCount() > 0)
+		{
+			PROFILE_SCOPE("playback");
+			playback.seekStep((unsigned int)((currentFrame - playStart) * 60.0f) % playback.stepCount());
+			for (unsigned int i = 0; i < playback.clothCount() && i < world->clothCount(); i++)
+			{
+				playback.positions(i, played);
+				if (played.size() == world->getCloth(i)->particleCount())
+					world->getCloth(i)->updateMesh(played);
+			}
+		}
 
-		// render the sphere
-		sphere->Draw(colorShader);
+		// render the cloths and the colliders, lit or as line lists
+		{
+			PROFILE_SCOPE("draw");
+			for (unsigned int i = 0; i < world->clothCount(); i++)
+			{
+				if (lit)
+					world->getCloth(i)->Draw(shader);
+				else
+					world->getCloth(i)->DrawLines(shader);
+			}
+
+			Shader& instancedShader = lit ? litInstancedShader : colorInstancedShader;
+			instancedShader.use();
+			instancedShader.setMat4("projection", projection);
+			instancedShader.setMat4("view", view);
+			instancedShader.setVec3("lightDir", glm::vec3(-0.3f, -1.0f, -0.5f));
+			if (lit)
+				Sphere::DrawInstanced(instancedShader, frame.colliders);
+			else
+				Sphere::DrawLinesInstanced(instancedShader, frame.colliders);
+		}
 
 		// glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
 		// -------------------------------------------------------------------------------
-		glfwSwapBuffers(window);
+		{
+			PROFILE_SCOPE("swap");
+			glfwSwapBuffers(window);
+		}
 		glfwPollEvents();
+		PROFILE_FRAME("render");
 	}
 
+	simulator->stop();
+
+	// release the cloth meshes and the shared sphere mesh while the context is alive
+	delete simulator;
+	delete world;
+	Sphere::DeleteMesh();
+
 	// glfw: terminate, clearing all previously allocated GLFW resources.
 	// ------------------------------------------------------------------
 	glfwTerminate();
@@ -194,19 +281,12 @@ void processInput(GLFWwindow* window)
 	if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
 		glfwSetWindowShouldClose(window, true);
 
+	// the simulation thread moves whatever was picked along with the cursor
 	if (dragging == true)
 	{
 		double xpos, ypos;
 		glfwGetCursorPos(window, &xpos, &ypos);
-
-		glm::vec4 Pos((float)xpos * 2.0f / SCR_WIDTH - 1.0f, 1.0f - (float)ypos * 2.0f / SCR_HEIGHT, lastPos.z, 1.0f);
-
-		glm::vec4 WorldPos = view_inverse * projection_inverse * Pos;
-		glm::vec4 WorldLastPos = view_inverse * projection_inverse * lastPos;
-		glm::vec3 WorldDir3 = glm::vec3(WorldPos.x / WorldPos.w, WorldPos.y / WorldPos.w, WorldPos.z / WorldPos.w) - glm::vec3(WorldLastPos.x / WorldLastPos.w, WorldLastPos.y / WorldLastPos.w, WorldLastPos.z / WorldLastPos.w);
-		sphere->update(WorldDir3);
-
-		lastPos = Pos;
+		simulator->post(InputEvent(InputEvent::DRAG, cursorRay(xpos, ypos), cameraForward()));
 	}
 }
 
@@ -219,30 +299,132 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 	glViewport(0, 0, width, height);
 }
 
+void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+	// normals are only computed by the simulation while they are drawn
+	if (key == GLFW_KEY_L && action == GLFW_PRESS)
+	{
+		lit = !lit;
+		simulator->setNormalsWanted(lit);
+	}
+	if (key == GLFW_KEY_Q && action == GLFW_PRESS)
+	{
+		quantized = !quantized;
+		simulator->setQuantized(quantized);
+	}
+	if (key == GLFW_KEY_R && action == GLFW_PRESS)
+	{
+		if (recording)
+		{
+			unsigned int frames;
+			if (simulator->stopRecording(&frames))
+				std::cout << "recorded " << frames << " frames to " << CACHE_PATH << std::endl;
+			recording = false;
+		}
+		else
+			recording = simulator->startRecording(CACHE_PATH);
+	}
+	// F5 keeps the current state, F9 rewinds to it
+	if (key == GLFW_KEY_F5 && action == GLFW_PRESS)
+		simulator->post(InputEvent(InputEvent::SAVE));
+	if (key == GLFW_KEY_F9 && action == GLFW_PRESS)
+		simulator->post(InputEvent(InputEvent::RESTORE));
+	if (key == GLFW_KEY_E && action == GLFW_PRESS)
+	{
+		if (exporting)
+			std::cout << "exported " << simulator->stopExport() << " frames to " << EXPORT_PREFIX << "_*.ply" << std::endl;
+		else
+			simulator->startExport(EXPORT_PREFIX);
+		exporting = !exporting;
+	}
+	if (key == GLFW_KEY_T && action == GLFW_PRESS)
+	{
+#ifdef PBD_PROFILE
+		if (Profiler::instance().writeChromeTrace(TRACE_PATH))
+			std::cout << "trace written to " << TRACE_PATH << std::endl;
+		Profiler::instance().report(std::cout);
+		if (Profiler::instance().isCounting())
+			Profiler::instance().reportCounters(std::cout);
+#else
+		std::cout << "profiling is compiled out, configure with -DPBD_PROFILE=ON" << std::endl;
+#endif
+	}
+	if (key == GLFW_KEY_C && action == GLFW_PRESS)
+	{
+#ifdef PBD_PROFILE
+		Profiler::instance().setCounting(!Profiler::instance().isCounting());
+#else
+		std::cout << "profiling is compiled out, configure with -DPBD_PROFILE=ON" << std::endl;
+#endif
+	}
+	if (key == GLFW_KEY_I && action == GLFW_PRESS)
+	{
+		if (recordingInput)
+			simulator->stopInputRecording();
+		else
+			simulator->startInputRecording(INPUT_PATH);
+		recordingInput = !recordingInput;
+	}
+	if (key == GLFW_KEY_M && action == GLFW_PRESS)
+	{
+#ifdef PBD_MEMORY
+		MemoryTracker::report(std::cout);
+#else
+		std::cout << "allocation tracking is compiled out, configure with -DPBD_MEMORY=ON" << std::endl;
+#endif
+	}
+	if (key == GLFW_KEY_P && action == GLFW_PRESS)
+	{
+		if (playing)
+		{
+			playback.close();
+			for (unsigned int i = 0; i < uploads.size(); i++)
+				uploads[i].uploaded = false;
+			playing = false;
+		}
+		else if (!recording && playback.open(CACHE_PATH))
+		{
+			playStart = static_cast<float>(glfwGetTime());
+			playing = true;
+		}
+	}
+}
+
 void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
 {
 	if (button == GLFW_MOUSE_BUTTON_LEFT)
 	{
+		double xpos, ypos;
+		glfwGetCursorPos(window, &xpos, &ypos);
 		if (action == GLFW_PRESS)
 		{
-			double xpos, ypos;
-			glfwGetCursorPos(window, &xpos, &ypos);
 			std::cout << xpos << " " << ypos << std::endl;
 
-			unsigned char pixel[3];
-			float depth;
-			glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
-			glReadPixels(xpos, SCR_HEIGHT - ypos, 1, 1, GL_RGB, GL_UNSIGNED_BYTE, pixel);
-			glReadPixels(xpos, SCR_HEIGHT - ypos, 1, 1, GL_DEPTH_COMPONENT, GL_FLOAT, &depth);
-			glBindFramebuffer(GL_FRAMEBUFFER, 0);
-			lastPos = glm::vec4((float)xpos * 2.0f / SCR_WIDTH - 1.0f, 1.0f - (float)ypos * 2.0f / SCR_HEIGHT, depth * 2.0f - 1.0f, 1.0f);
-			// pick the sphere
-			if (pixel[0] == 255 && pixel[1] == 0 && pixel[2] == 0)
-				dragging = true;
+			// the simulation thread picks the nearest of sphere and cloth along the cursor ray
+			simulator->post(InputEvent(InputEvent::PICK, cursorRay(xpos, ypos), cameraForward()));
+			dragging = true;
 		}
 		else if (action == GLFW_RELEASE)
 		{
+			simulator->post(InputEvent(InputEvent::RELEASE, cursorRay(xpos, ypos), cameraForward()));
 			dragging = false;
 		}
 	}
+}
+
+// ray from the camera through the cursor in world space
+Ray cursorRay(double xpos, double ypos)
+{
+	float x = (float)xpos * 2.0f / SCR_WIDTH - 1.0f;
+	float y = 1.0f - (float)ypos * 2.0f / SCR_HEIGHT;
+	glm::vec4 nearPos = view_inverse * projection_inverse * glm::vec4(x, y, -1.0f, 1.0f);
+	glm::vec4 farPos = view_inverse * projection_inverse * glm::vec4(x, y, 1.0f, 1.0f);
+	glm::vec3 origin = glm::vec3(nearPos) / nearPos.w;
+	return Ray(origin, glm::vec3(farPos) / farPos.w - origin);
+}
+
+// viewing direction of the camera in world space
+glm::vec3 cameraForward()
+{
+	return -glm::vec3(view_inverse[2]);
 }
\ No newline at end of file
@@ -0,0 +1,95 @@
+// global operator new and delete counting every heap allocation for MemoryTracker, see inc/memory_tracker.h.
+// only compiled in with PBD_MEMORY, the default build keeps the library's own operators
+#ifdef PBD_MEMORY
+#include <cstdlib>
+#include <new>
+
+#include "memory_tracker.h"
+
+namespace {
+	// in front of every block, the size and tag its free has to take back off the counters
+	struct AllocationHeader
+	{
+		size_t size;
+		unsigned int offset; // from the start of the block to the pointer handed out
+		MemoryTag tag;
+	};
+
+	const size_t headerSpace = 16;
+	static_assert(sizeof(AllocationHeader) <= headerSpace, "allocation header has to fit in front of the pointer");
+
+	void* trackedAllocate(size_t size, size_t alignment)
+	{
+		alignment = alignment < headerSpace ? headerSpace : alignment;
+		size_t offset = alignment; // a whole alignment step keeps the pointer aligned with the header in front
+		void* block = NULL;
+#ifdef _WIN32
+		block = _aligned_malloc(size + offset, alignment);
+#else
+		if (alignment == headerSpace)
+			block = malloc(size + offset);
+		else if (posix_memalign(&block, alignment, size + offset) != 0)
+			block = NULL;
+#endif
+		if (block == NULL)
+			return NULL;
+		char* memory = (char*)block + offset;
+		AllocationHeader* header = (AllocationHeader*)(memory - headerSpace);
+		header->size = size;
+		header->offset = (unsigned int)offset;
+		header->tag = MemoryTracker::current();
+		MemoryTracker::allocated(header->tag, size);
+		return memory;
+	}
+
+	void trackedFree(void* memory)
+	{
+		if (memory == NULL)
+			return;
+		AllocationHeader* header = (AllocationHeader*)((char*)memory - headerSpace);
+		MemoryTracker::freed(header->tag, header->size);
+		void* block = (char*)memory - header->offset;
+#ifdef _WIN32
+		_aligned_free(block);
+#else
+		free(block);
+#endif
+	}
+
+	void* allocateOrThrow(size_t size, size_t alignment)
+	{
+		void* memory = trackedAllocate(size, alignment);
+		while (memory == NULL)
+		{
+			new_handler handler = get_new_handler();
+			if (handler == NULL)
+				throw bad_alloc();
+			handler();
+			memory = trackedAllocate(size, alignment);
+		}
+		return memory;
+	}
+}
+
+void* operator new(size_t size) { return allocateOrThrow(size, headerSpace); }
+void* operator new[](size_t size) { return allocateOrThrow(size, headerSpace); }
+void* operator new(size_t size, align_val_t alignment) { return allocateOrThrow(size, (size_t)alignment); }
+void* operator new[](size_t size, align_val_t alignment) { return allocateOrThrow(size, (size_t)alignment); }
+void* operator new(size_t size, const nothrow_t&) noexcept { return trackedAllocate(size, headerSpace); }
+void* operator new[](size_t size, const nothrow_t&) noexcept { return trackedAllocate(size, headerSpace); }
+void* operator new(size_t size, align_val_t alignment, const nothrow_t&) noexcept { return trackedAllocate(size, (size_t)alignment); }
+void* operator new[](size_t size, align_val_t alignment, const nothrow_t&) noexcept { return trackedAllocate(size, (size_t)alignment); }
+
+void operator delete(void* memory) noexcept { trackedFree(memory); }
+void operator delete[](void* memory) noexcept { trackedFree(memory); }
+void operator delete(void* memory, size_t) noexcept { trackedFree(memory); }
+void operator delete[](void* memory, size_t) noexcept { trackedFree(memory); }
+void operator delete(void* memory, align_val_t) noexcept { trackedFree(memory); }
+void operator delete[](void* memory, align_val_t) noexcept { trackedFree(memory); }
+void operator delete(void* memory, size_t, align_val_t) noexcept { trackedFree(memory); }
+void operator delete[](void* memory, size_t, align_val_t) noexcept { trackedFree(memory); }
+void operator delete(void* memory, const nothrow_t&) noexcept { trackedFree(memory); }
+void operator delete[](void* memory, const nothrow_t&) noexcept { trackedFree(memory); }
+void operator delete(void* memory, align_val_t, const nothrow_t&) noexcept { trackedFree(memory); }
+void operator delete[](void* memory, align_val_t, const nothrow_t&) noexcept { trackedFree(memory); }
+#endif